@@ -0,0 +1,81 @@
+// Per event cost of calling into Lua, lua_call_va (global lookup, signature
+// parsing, one pcall per event) against queued events delivered once per
+// frame through the hook registry.
+//
+//   make bench_lua && bin/lua_hooks_bench [events]
+
+#include "../src/base/base.h"
+#include "../src/lua/lua.h"
+#include "../src/lua/hooks.h"
+
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_EVENTS 1000000
+// Events per frame, a burst of typing or key repeat
+#define BENCH_FRAME_EVENTS 64
+
+static const char* bench_script =
+    "package.path = 'scripts/?.lua;' .. package.path\n"
+    "local hooks = require('hooks')\n"
+    "keys = 0\n"
+    "function on_key(key) keys = keys + key end\n"
+    "hooks.on(hooks.KEY, function(event) keys = keys + event.key end)\n";
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static lua_Number bench_keys(lua_State* L) {
+    lua_getglobal(L, "keys");
+    lua_Number keys = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_pushnumber(L, 0);
+    lua_setglobal(L, "keys");
+    return keys;
+}
+
+int main(int argc, char** argv) {
+    uint32_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_EVENTS;
+
+    lua_State* L = lua_init();
+    if (luaL_dostring(L, bench_script) != 0) {
+        fprintf(stderr, "Error in benchmark script: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+
+    LuaHooks hooks;
+    if (lua_hooks_init(&hooks, L) != 0) return 1;
+
+    double start = bench_now();
+    for (uint32_t i = 0; i < count; i++) {
+        lua_call_va(L, "on_key", "i", (int) (i & 0xff));
+    }
+    double call_va = bench_now() - start;
+    lua_Number call_va_keys = bench_keys(L);
+
+    start = bench_now();
+    for (uint32_t i = 0; i < count; i++) {
+        lua_hooks_push(&hooks, LUA_EVENT_KEY, i & 0xff, 0, 0);
+        if ((i + 1) % BENCH_FRAME_EVENTS == 0) lua_hooks_flush(&hooks);
+    }
+    lua_hooks_flush(&hooks);
+    double batched = bench_now() - start;
+    lua_Number batched_keys = bench_keys(L);
+
+    printf("%u events, %u per frame\n\n", count, BENCH_FRAME_EVENTS);
+    printf("%-16s %8.1f ns per event  (sum %.0f)\n", "lua_call_va", call_va / count * 1e9, call_va_keys);
+    printf("%-16s %8.1f ns per event  (sum %.0f)\n", "hooks batched", batched / count * 1e9, batched_keys);
+    printf("%-16s %8.1f ns per event  (time inside Lua)\n", "hooks dispatch", lua_hooks_ns_per_event(&hooks));
+
+    lua_hooks_release(&hooks);
+    lua_shutdown(L);
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+// Main loop stall caused by a busy plugin: the same work run straight
+// through lua_call_va against spread over frames by the task scheduler,
+// where the longest lua_sched_run is what a keystroke may wait for. Runs
+// once with the JIT off, where the count hook preempts the tasks, once
+// with it on, where compiled traces never see the hook, and once more
+// with the tasks calling sched.check from the hot loop.
+//
+//   make bench_lua && bin/lua_sched_bench [iterations] [tasks]
+
+#include "../src/base/base.h"
+#include "../src/base/job.h"
+#include "../src/lua/lua.h"
+#include "../src/lua/sched.h"
+
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_ITERATIONS 200000
+#define BENCH_DEFAULT_TASKS 4
+// Iterations between sched.check calls in the checked run
+#define BENCH_CHECK_EVERY 256
+
+// Function calls and string work. The concatenation is cut back every
+// 64 steps so each step costs the same, n steps in one call and n steps
+// split over tasks are the same amount of work.
+static const char* bench_script =
+    "local function step(i, parts)\n"
+    "  parts[#parts + 1] = string.format('%d:%s', i, tostring(i * 7))\n"
+    "  if #parts > 64 then parts = { table.concat(parts, ','):sub(-16) } end\n"
+    "  return parts\n"
+    "end\n"
+    "function work(n, check_every)\n"
+    "  local sched = require('sched')\n"
+    "  local parts = {}\n"
+    "  for i = 1, n do\n"
+    "    parts = step(i, parts)\n"
+    "    if check_every > 0 and i % check_every == 0 then sched.check() end\n"
+    "  end\n"
+    "  return #parts\n"
+    "end\n"
+    "function spawn_work(n, tasks, check_every)\n"
+    "  local sched = require('sched')\n"
+    "  finished = 0\n"
+    "  for t = 1, tasks do\n"
+    "    sched.spawn(function() work(n / tasks, check_every) finished = finished + 1 end)\n"
+    "  end\n"
+    "end\n";
+
+struct bench_mode {
+    const char* name;
+    const char* jit;
+    int check_every;
+};
+
+static const struct bench_mode bench_modes[] = {
+    { "interpreter", "jit.off() jit.flush()", 0 },
+    { "jit", "jit.on() jit.flush()", 0 },
+    { "jit + check", "jit.on() jit.flush()", BENCH_CHECK_EVERY },
+};
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_ITERATIONS;
+    uint32_t tasks = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_DEFAULT_TASKS;
+
+    lua_State* L = lua_init();
+    if (luaL_dostring(L, bench_script) != 0) {
+        fprintf(stderr, "Error in benchmark script: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+
+    JobPool pool;
+    LuaScheduler sched;
+    if (job_pool_init(&pool, 1) != 0 || lua_sched_init(&sched, L, &pool) != 0) return 1;
+
+    printf("%u iterations, %u tasks, budget %.2f ms\n\n", iterations, tasks, sched.budget_ns / 1e6);
+    printf("%-12s %10s %10s %7s %10s %10s\n", "", "direct", "scheduled", "frames", "longest", "preempted");
+
+    for (size_t m = 0; m < sizeof(bench_modes) / sizeof(bench_modes[0]); m++) {
+        const struct bench_mode* mode = &bench_modes[m];
+        if (luaL_dostring(L, mode->jit) != 0) {
+            fprintf(stderr, "Error switching the JIT: %s\n", lua_tostring(L, -1));
+            return 1;
+        }
+
+        double start = bench_now();
+        lua_call_va(L, "work", "ii", (int) iterations, 0);
+        double direct = bench_now() - start;
+
+        uint64_t preempted = sched.stats.preempted;
+        lua_call_va(L, "spawn_work", "iii", (int) iterations, (int) tasks, mode->check_every);
+
+        uint32_t frames = 0;
+        double longest = 0;
+        start = bench_now();
+        while (lua_sched_timeout(&sched) != -1) {
+            double frame_start = bench_now();
+            lua_sched_run(&sched);
+            longest = max(longest, bench_now() - frame_start);
+            frames++;
+        }
+        double spread = bench_now() - start;
+
+        lua_getglobal(L, "finished");
+        if (lua_tonumber(L, -1) != tasks) {
+            fprintf(stderr, "Only %g of %u tasks finished\n", lua_tonumber(L, -1), tasks);
+            return 1;
+        }
+        lua_pop(L, 1);
+
+        printf("%-12s %7.2f ms %7.2f ms %7u %7.2f ms %10llu\n", mode->name, direct * 1e3, spread * 1e3, frames,
+               longest * 1e3, (unsigned long long) (sched.stats.preempted - preempted));
+    }
+
+    lua_sched_release(&sched);
+    job_pool_release(&pool);
+    lua_shutdown(L);
+    return 0;
+}
@@ -0,0 +1,146 @@
+// Script start up through require, parsing every module from source
+// against the bytecode cache, cold (empty cache, every module compiled and
+// written) and warm (every module a mapped hit). Each run uses a fresh
+// state, the way the editor starts.
+//
+//   make bench_lua && bin/lua_startup_bench [modules] [functions]
+
+#include "../src/base/base.h"
+#include "../src/lua/lua.h"
+#include "../src/lua/cache.h"
+
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BENCH_DEFAULT_MODULES 64
+// Functions per module, each a few lines of table and string work
+#define BENCH_DEFAULT_FUNCTIONS 200
+#define BENCH_WARM_RUNS 5
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int32_t bench_write_modules(const char* dir, uint32_t modules, uint32_t functions) {
+    char path[PATH_MAX];
+    for (uint32_t m = 0; m < modules; m++) {
+        if (snprintf(path, sizeof(path), "%s/mod%u.lua", dir, m) >= (int) sizeof(path)) {
+            error_print("Module path too long");
+            return -1;
+        }
+        FILE* f = fopen(path, "w");
+        if (!f) {
+            perror("fopen");
+            return -1;
+        }
+
+        fprintf(f, "local M = {}\n");
+        for (uint32_t i = 0; i < functions; i++) {
+            fprintf(f,
+                    "function M.f%u(t, s)\n"
+                    "  local out = {}\n"
+                    "  for k, v in pairs(t) do\n"
+                    "    if type(v) == 'string' then out[#out + 1] = s .. v:upper() .. '%u'\n"
+                    "    else out[k] = (v or 0) * %u + #out end\n"
+                    "  end\n"
+                    "  return out\n"
+                    "end\n",
+                    i, i, i + 1);
+        }
+        fprintf(f, "return M\n");
+        fclose(f);
+    }
+
+    return 0;
+}
+
+/// Requires every module in a fresh state, through the cache when `cache`
+/// is set
+static double bench_startup(const char* dir, uint32_t modules, uint8_t cache, LuaCache* stats) {
+    double start = bench_now();
+
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+
+    char cache_dir[PATH_MAX];
+    if (cache && (lua_cache_dir(cache_dir, sizeof(cache_dir)) != 0 || lua_cache_install(L, cache_dir) != 0)) {
+        error_print("No cache directory");
+        exit(1);
+    }
+
+    lua_getglobal(L, "package");
+    lua_pushfstring(L, "%s/?.lua", dir);
+    lua_setfield(L, -2, "path");
+    lua_pop(L, 1);
+
+    char name[32];
+    for (uint32_t m = 0; m < modules; m++) {
+        snprintf(name, sizeof(name), "mod%u", m);
+        lua_getglobal(L, "require");
+        lua_pushstring(L, name);
+        if (lua_pcall(L, 1, 0, 0) != 0) {
+            fprintf(stderr, "Error requiring %s: %s\n", name, lua_tostring(L, -1));
+            exit(1);
+        }
+    }
+
+    if (cache && stats) *stats = *lua_cache_get(L);
+    lua_close(L);
+
+    return bench_now() - start;
+}
+
+int main(int argc, char** argv) {
+    uint32_t modules = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_MODULES;
+    uint32_t functions = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_DEFAULT_FUNCTIONS;
+
+    char root[] = "/tmp/lua_startup_bench.XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    char scripts[PATH_MAX];
+    char cache[PATH_MAX];
+    snprintf(scripts, sizeof(scripts), "%s/scripts", root);
+    snprintf(cache, sizeof(cache), "%s/cache", root);
+    mkdir(scripts, 0700);
+    // Keeps the user's cache out of it
+    setenv("XDG_CACHE_HOME", cache, 1);
+
+    if (bench_write_modules(scripts, modules, functions) != 0) return 1;
+
+    // Page cache warm for all three
+    bench_startup(scripts, modules, 0, NULL);
+
+    double source = 0;
+    for (uint32_t i = 0; i < BENCH_WARM_RUNS; i++) source += bench_startup(scripts, modules, 0, NULL);
+    source /= BENCH_WARM_RUNS;
+
+    LuaCache stats = {0};
+    double cold = bench_startup(scripts, modules, 1, &stats);
+    printf("Cold cache:   %8.3f ms (%u hits, %u misses)\n", cold * 1e3, stats.hits, stats.misses);
+
+    double warm = 0;
+    for (uint32_t i = 0; i < BENCH_WARM_RUNS; i++) warm += bench_startup(scripts, modules, 1, &stats);
+    warm /= BENCH_WARM_RUNS;
+
+    printf("Source:       %8.3f ms\n", source * 1e3);
+    printf("Warm cache:   %8.3f ms (%u hits, %u misses)\n", warm * 1e3, stats.hits, stats.misses);
+    printf("Speedup:      %8.2fx (%u modules, %u functions each)\n", source / warm, modules, functions);
+
+    char cmd[PATH_MAX + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+    if (system(cmd) != 0) fprintf(stderr, "Could not remove %s\n", root);
+
+    return 0;
+}
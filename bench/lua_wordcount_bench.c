@@ -0,0 +1,127 @@
+// Lua word count over a piece table, reading spans through the FFI against
+// copying the text into Lua strings first.
+//
+//   make bench_lua && bin/lua_wordcount_bench [megabytes]
+
+#include "../src/base/base.h"
+#include "../src/lua/lua.h"
+#include "../src/ptable/ptable.h"
+
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_MB 100
+#define BENCH_EDITS 10000
+#define BENCH_RUNS 3
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t bench_next(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Words of 1 to 12 letters, mostly spaces between them and a line feed
+// every so often
+static void bench_fill(char* buf, size_t len) {
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t word_left = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        uint64_t r = bench_next(&state);
+        if (word_left == 0) {
+            buf[i] = r % 12 == 0 ? '\n' : ' ';
+            word_left = 1 + (r >> 8) % 12;
+        } else {
+            buf[i] = 'a' + (char) ((r >> 8) % 26);
+            word_left--;
+        }
+    }
+}
+
+static void bench_report(const char* name, size_t bytes, double seconds, lua_Number words) {
+    printf("%-20s %8.3f s %8.2f GB/s  (%.0f words)\n", name, seconds, bytes / seconds / 1e9, words);
+}
+
+/// Calls Bench[name] with the table (or, for `copy`, the whole document as
+/// one string) and returns the best time of BENCH_RUNS
+static double bench_run(lua_State* L, PTable* table, const char* name, uint8_t copy, lua_Number* words) {
+    double best = 1e9;
+
+    for (int32_t run = 0; run < BENCH_RUNS; run++) {
+        lua_getfield(L, -1, name);
+
+        double start = bench_now();
+        if (copy) {
+            char* text = ptable_full_buffer(table);
+            lua_pushlstring(L, text, ptable_get_length(table));
+            free(text);
+        } else {
+            lua_pushlightuserdata(L, table);
+        }
+
+        if (lua_pcall(L, 1, 1, 0) != 0) {
+            fprintf(stderr, "Error running %s: %s\n", name, lua_tostring(L, -1));
+            exit(1);
+        }
+        best = min(best, bench_now() - start);
+
+        *words = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return best;
+}
+
+int main(int argc, char** argv) {
+    size_t mb = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_DEFAULT_MB;
+    size_t len = mb << 20;
+
+    char* buf = malloc(len);
+    if (!buf) {
+        perror("Failed to allocate benchmark buffer");
+        return 1;
+    }
+    bench_fill(buf, len);
+
+    // Scattered edits so the document is spread over many pieces
+    PTable* table = ptable_create_len(buf, len, BUFFER_OWNED);
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    for (int32_t i = 0; i < BENCH_EDITS; i++) {
+        ptable_insert(table, bench_next(&state) % ptable_get_length(table), " edit ");
+    }
+    len = ptable_get_length(table);
+
+    lua_State* L = lua_init();
+    if (luaL_dostring(L, "package.path = 'scripts/?.lua;' .. package.path") != 0 ||
+        lua_load_file(L, "bench/wordcount.lua") != 0 || lua_exec_script(L) != 0) {
+        return 1;
+    }
+
+    printf("%zu MB over %zu pieces\n\n", mb, table->node_count);
+
+    lua_Number words = 0;
+    double seconds = bench_run(L, table, "count_spans", 0, &words);
+    bench_report("ffi spans", len, seconds, words);
+
+    seconds = bench_run(L, table, "count_span_copies", 0, &words);
+    bench_report("ffi.string per span", len, seconds, words);
+
+    seconds = bench_run(L, table, "count_string", 1, &words);
+    bench_report("pushed string", len, seconds, words);
+
+    lua_shutdown(L);
+    ptable_release(table);
+
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Word count over a shared snapshot on the main VM alone against split
+// into ranges counted in parallel by the worker VMs. Only a snapshot
+// reference travels to the workers, the text is never copied.
+//
+//   make bench_lua && bin/lua_workers_bench [megabytes] [workers]
+
+#include "../src/base/base.h"
+#include "../src/base/event.h"
+#include "../src/base/job.h"
+#include "../src/lua/lua.h"
+#include "../src/lua/sched.h"
+#include "../src/lua/workers.h"
+#include "../src/ptable/ptable.h"
+
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_MB 100
+#define BENCH_EDITS 10000
+
+static const char* bench_script =
+    "package.path = 'bench/?.lua;scripts/?.lua;' .. package.path\n"
+    "function direct()\n"
+    "  local snapshot = require('workers').snapshot()\n"
+    "  return require('wordcount').count_range(snapshot, 0, snapshot:length())\n"
+    "end\n"
+    "function parallel(parts)\n"
+    "  local workers, sched = require('workers'), require('sched')\n"
+    "  local snapshot = workers.snapshot()\n"
+    "  local len = snapshot:length()\n"
+    "  total, pending = 0, parts\n"
+    "  for p = 0, parts - 1 do\n"
+    "    sched.spawn(function()\n"
+    "      local from, to = math.floor(len * p / parts), math.floor(len * (p + 1) / parts)\n"
+    "      local ok, words = workers.call('wordcount', 'count_range', snapshot, from, to)\n"
+    "      if not ok then error(words) end\n"
+    "      total, pending = total + words, pending - 1\n"
+    "    end)\n"
+    "  end\n"
+    "end\n";
+
+static PTable* bench_table;
+
+static PTable* bench_get_table() {
+    return bench_table;
+}
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t bench_next(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static lua_Number bench_global(lua_State* L, const char* name) {
+    lua_getglobal(L, name);
+    lua_Number value = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return value;
+}
+
+int main(int argc, char** argv) {
+    size_t mb = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_DEFAULT_MB;
+    uint32_t worker_count = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+    size_t len = mb << 20;
+
+    char* buf = malloc(len);
+    if (!buf) {
+        perror("Failed to allocate benchmark buffer");
+        return 1;
+    }
+
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < len; i++) {
+        uint64_t r = bench_next(&state);
+        buf[i] = r % 7 == 0 ? ' ' : 'a' + (char) ((r >> 8) % 26);
+    }
+
+    bench_table = ptable_create_len(buf, len, BUFFER_OWNED);
+    for (int32_t i = 0; i < BENCH_EDITS; i++) {
+        ptable_insert(bench_table, bench_next(&state) % ptable_get_length(bench_table), " edit ");
+    }
+
+    // package.path is set before the workers copy it
+    lua_State* L = lua_init();
+    if (luaL_dostring(L, bench_script) != 0) {
+        fprintf(stderr, "Error in benchmark script: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+
+    EventLoop loop;
+    JobPool jobs;
+    LuaScheduler sched;
+    LuaWorkerPool workers;
+    if (event_loop_init(&loop) != 0 || job_pool_init(&jobs, 1) != 0) return 1;
+    if (lua_sched_init(&sched, L, &jobs) != 0) return 1;
+    if (lua_workers_init(&workers, L, &sched, worker_count, NULL, bench_get_table) != 0) return 1;
+    lua_workers_attach(&workers, &loop);
+
+    double start = bench_now();
+    lua_Number direct_words = 0;
+    lua_call_va(L, "direct", ">d", &direct_words);
+    double direct = bench_now() - start;
+
+    start = bench_now();
+    lua_call_va(L, "parallel", "i", (int) workers.worker_count);
+    // The last task finishes inside lua_sched_run, check before waiting
+    lua_sched_run(&sched);
+    while (bench_global(L, "pending") > 0) {
+        if (event_loop_wait(&loop, lua_sched_timeout(&sched)) == -1) return 1;
+        lua_sched_run(&sched);
+    }
+    double parallel = bench_now() - start;
+
+    printf("%zu MB over %zu pieces\n\n", mb, bench_table->node_count);
+    printf("Main VM:    %8.3f s (%.0f words)\n", direct, direct_words);
+    printf("%2u workers: %8.3f s (%.0f words), %.2fx\n",
+           workers.worker_count, parallel, bench_global(L, "total"), direct / parallel);
+
+    lua_workers_release(&workers);
+    lua_sched_release(&sched);
+    job_pool_release(&jobs);
+    event_loop_release(&loop);
+    lua_shutdown(L);
+    ptable_release(bench_table);
+
+    return 0;
+}
@@ -0,0 +1,117 @@
+// Newline counting throughput, scalar against every SIMD kernel the CPU
+// supports, plus the parallel line index build used when opening files.
+//
+//   make bench && bin/newline_bench [megabytes]
+
+#include "../src/base/base.h"
+#include "../src/base/bytes.h"
+#include "../src/base/job.h"
+#include "../src/ptable/ptable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_MB 512
+#define BENCH_RUNS 5
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Lines of 0 to 120 printable bytes, roughly the shape of a log file
+static void bench_fill(char* buf, size_t len) {
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t line_left = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        if (line_left == 0) {
+            buf[i] = '\n';
+            line_left = state % 121;
+        } else {
+            buf[i] = ' ' + (char) (state % 95);
+            line_left--;
+        }
+    }
+}
+
+static void bench_report(const char* name, size_t bytes, double seconds, size_t lines) {
+    printf("%-20s %8.2f GB/s  (%zu lines)\n", name, bytes / seconds / 1e9, lines);
+}
+
+int main(int argc, char** argv) {
+    size_t mb = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_DEFAULT_MB;
+    size_t len = mb << 20;
+
+    char* buf = malloc(len);
+    size_t* positions = malloc(sizeof(size_t) * (len / 2 + 1));
+    if (!buf || !positions) {
+        perror("Failed to allocate benchmark buffers");
+        return 1;
+    }
+    bench_fill(buf, len);
+
+    printf("%zu MB, best kernel: %s\n\n", mb, bytes_kernel_name(bytes_best_kernel()));
+
+    for (BytesKernel kernel = BYTES_SCALAR; kernel <= bytes_best_kernel(); kernel++) {
+        double best = 1e9;
+        size_t lines = 0;
+        for (int32_t run = 0; run < BENCH_RUNS; run++) {
+            double start = bench_now();
+            lines = bytes_count_with(kernel, buf, len, '\n');
+            best = min(best, bench_now() - start);
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "count %s", bytes_kernel_name(kernel));
+        bench_report(name, len, best, lines);
+    }
+
+    for (BytesKernel kernel = BYTES_SCALAR; kernel <= bytes_best_kernel(); kernel++) {
+        double best = 1e9;
+        size_t lines = 0;
+        for (int32_t run = 0; run < BENCH_RUNS; run++) {
+            double start = bench_now();
+            lines = bytes_positions_with(kernel, buf, len, '\n', 0, positions);
+            best = min(best, bench_now() - start);
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "positions %s", bytes_kernel_name(kernel));
+        bench_report(name, len, best, lines);
+    }
+
+    // Full line index build, single threaded and over the job pool
+    JobPool pool;
+    if (job_pool_init(&pool, 0) != 0) return 1;
+
+    for (int32_t parallel = 0; parallel < 2; parallel++) {
+        double best = 1e9;
+        size_t lines = 0;
+        for (int32_t run = 0; run < BENCH_RUNS; run++) {
+            PTable* table = ptable_create_len(buf, len, BUFFER_BORROWED);
+            double start = bench_now();
+            ptable_build_line_index_jobs(table, parallel ? &pool : NULL);
+            best = min(best, bench_now() - start);
+            lines = ptable_line_count(table);
+            ptable_release(table);
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), parallel ? "index %u workers" : "index serial", pool.worker_count + 1);
+        bench_report(name, len, best, lines);
+    }
+
+    job_pool_release(&pool);
+    free(positions);
+    free(buf);
+
+    return 0;
+}
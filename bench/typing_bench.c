@@ -0,0 +1,29 @@
+// Node growth under keystroke-by-keystroke typing. Every key is its own
+// insert, the cursor jumps back to the start after each 'e' so the trace
+// mixes runs that coalesce with inserts that have to split a piece.
+//
+//   make bench && bin/typing_bench
+
+#include "../src/ptable/ptable.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int main() {
+    // The table takes ownership of its original text
+    PTable* table = ptable_create(strdup("Hello world"));
+
+    const char* typed = " typed one key at a time";
+    size_t cursor = ptable_get_length(table);
+    for (const char* key = typed; *key; key++) {
+        char keystroke[2] = { *key, '\0' };
+        ptable_insert(table, cursor++, keystroke);
+        if (*key == 'e') cursor = 0;
+    }
+
+    ptable_print_node_sequence(table, 1);
+    ptable_print_stats(table);
+    ptable_release(table);
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+-- wordcount.lua
+-- Word counting three ways, driven by bench/lua_wordcount_bench.c: straight
+-- through the span pointers, over FFI copies of each span, and over one
+-- Lua string holding the whole document. count_range splits the work for
+-- bench/lua_workers_bench.c.
+local ffi = require("ffi")
+local ptable = require("ptable")
+
+local Bench = {}
+
+-- Words are runs of anything but space, tab, CR and LF
+local function is_space(c)
+  return c == 32 or c == 10 or c == 9 or c == 13
+end
+
+-- Zero copy, bytes are read through the pointers into the table
+function Bench.count_spans(handle)
+  local words = 0
+  local in_word = false
+
+  for ptr, len in ptable.wrap(handle):spans() do
+    for i = 0, len - 1 do
+      if is_space(ptr[i]) then
+        in_word = false
+      elseif not in_word then
+        in_word = true
+        words = words + 1
+      end
+    end
+  end
+
+  return words
+end
+
+local function count_string(s, words, in_word)
+  local byte = string.byte
+  for i = 1, #s do
+    if is_space(byte(s, i)) then
+      in_word = false
+    elseif not in_word then
+      in_word = true
+      words = words + 1
+    end
+  end
+  return words, in_word
+end
+
+-- One interned Lua string per span
+function Bench.count_span_copies(handle)
+  local words = 0
+  local in_word = false
+
+  for ptr, len in ptable.wrap(handle):spans() do
+    words, in_word = count_string(ffi.string(ptr, len), words, in_word)
+  end
+
+  return words
+end
+
+-- Words starting in [from, to) of a shared snapshot, so the counts of
+-- adjacent ranges add up to the document's
+function Bench.count_range(handle, from, to)
+  local words = 0
+  local prev_space = true
+  local start = from > 0 and from - 1 or 0
+
+  for ptr, len, pos in ptable.shared(handle):spans(start) do
+    for i = 0, len - 1 do
+      if pos + i >= to then return words end
+      local space = is_space(ptr[i])
+      if not space and prev_space and pos + i >= from then
+        words = words + 1
+      end
+      prev_space = space
+    end
+  end
+
+  return words
+end
+
+-- The document pushed from C as a single string
+function Bench.count_string(s)
+  return (count_string(s, 0, false))
+end
+
+return Bench
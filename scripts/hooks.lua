@@ -0,0 +1,69 @@
+-- hooks.lua
+-- Event handlers. The editor queues events in C and calls dispatch once
+-- per frame with the whole queue, every handler runs from here without
+-- going back to C in between.
+--
+--   local hooks = require("hooks")
+--   hooks.on(hooks.KEY, function(event) print(event.key) end)
+--
+-- The event handed to a handler points into the C queue and is only
+-- valid during the call, copy the fields that need to outlive it.
+local ffi = require("ffi")
+
+ffi.cdef[[
+typedef struct lua_event {
+  uint32_t type;
+  uint32_t key;
+  double a;
+  double b;
+} LuaEvent;
+]]
+
+-- Mirrors LuaEventType in src/lua/hooks.h
+local Hooks = {
+  KEY = 0,
+  EDIT = 1,
+  SAVE = 2,
+  RESIZE = 3,
+  FRAME = 4,
+  COUNT = 5,
+  handlers = {},
+}
+
+for type = 0, Hooks.COUNT - 1 do
+  Hooks.handlers[type] = {}
+end
+
+function Hooks.on(type, fn)
+  local list = Hooks.handlers[type]
+  list[#list + 1] = fn
+  return fn
+end
+
+function Hooks.off(type, fn)
+  local list = Hooks.handlers[type]
+  for i = #list, 1, -1 do
+    if list[i] == fn then table.remove(list, i) end
+  end
+end
+
+local event_ptr = ffi.typeof("const LuaEvent*")
+
+local function run(handlers, events, count)
+  for i = 0, count - 1 do
+    local event = events[i]
+    local list = handlers[event.type]
+    for h = 1, #list do
+      list[h](event)
+    end
+  end
+end
+
+function Hooks.dispatch(handlers, first, first_count, rest, rest_count)
+  run(handlers, ffi.cast(event_ptr, first), first_count)
+  if rest_count > 0 then
+    run(handlers, ffi.cast(event_ptr, rest), rest_count)
+  end
+end
+
+return Hooks
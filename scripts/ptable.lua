@@ -0,0 +1,224 @@
+-- ptable.lua
+-- Direct FFI access to the piece table. Spans are handed out as pointers
+-- into the table's own buffers, nothing is copied unless asked for with
+-- ffi.string. Pointers stay valid until the next edit (or for as long as
+-- the snapshot they came from).
+local ffi = require("ffi")
+
+ffi.cdef[[
+typedef struct piece_table PTable;
+typedef struct table_iter PTableIter;
+typedef struct table_snapshot PTableSnapshot;
+
+typedef struct table_span {
+  const char* ptr;
+  size_t len;
+} PTableSpan;
+
+typedef struct table_edit {
+  size_t pos;
+  size_t delete_len;
+  const char* text;
+  size_t text_len;
+} PTableEdit;
+
+size_t ptable_get_length(PTable* table);
+char ptable_index(PTable* table, size_t at);
+int32_t ptable_insert_len(PTable* table, size_t pos, const char* text, size_t text_len);
+void ptable_delete(PTable* table, size_t at, size_t len);
+int32_t ptable_apply_batch(PTable* table, const PTableEdit* edits, size_t count);
+
+void ptable_begin_group(PTable* table);
+void ptable_end_group(PTable* table);
+int32_t ptable_undo(PTable* table, size_t* pos);
+int32_t ptable_redo(PTable* table, size_t* pos);
+
+size_t ptable_line_count(PTable* table);
+size_t ptable_line_to_offset(PTable* table, size_t line);
+void ptable_offset_to_line(PTable* table, size_t offset, size_t* line, size_t* column);
+
+PTableIter* ptable_iter_create(PTable* table, size_t offset);
+void ptable_iter_release(PTableIter* iter);
+int32_t ptable_iter_step_span(PTableIter* iter, int dir, PTableSpan* out);
+
+PTableSnapshot* ptable_snapshot(PTable* table);
+void ptable_snapshot_release(PTableSnapshot* snapshot);
+size_t ptable_snapshot_length(PTableSnapshot* snapshot);
+PTableIter* ptable_snapshot_iter_create(PTableSnapshot* snapshot, size_t offset);
+
+PTable* terminal_table();
+]]
+
+local C = ffi.C
+local FORWARD = 0
+
+local PTable = {}
+PTable.__index = PTable
+
+local Snapshot = {}
+Snapshot.__index = Snapshot
+
+local M = {}
+
+-- Accepts a PTable* cdata or a light userdata handed over from C
+function M.wrap(ptr)
+  return setmetatable({ ptr = ffi.cast("PTable*", ptr) }, PTable)
+end
+
+-- Table of the document open in the editor, nil when there is none
+function M.current()
+  local ok, ptr = pcall(function() return C.terminal_table() end)
+  if not ok or ptr == nil then return nil end
+  return M.wrap(ptr)
+end
+
+-- for ptr, len, pos in iter do ... end, over spans from `from` on
+local function span_iter(iter, from)
+  local span = ffi.new("PTableSpan")
+  local pos = from
+  return function()
+    if C.ptable_iter_step_span(iter, FORWARD, span) == 0 then return nil end
+    local at = pos
+    local len = tonumber(span.len)
+    pos = pos + len
+    return span.ptr, len, at
+  end
+end
+
+-- Copies [from, to) out of a span iterator into one Lua string
+local function sub_from(spans, from, to)
+  local parts = {}
+  for ptr, len, pos in spans do
+    if pos >= to then break end
+    local take = math.min(len, to - pos)
+    parts[#parts + 1] = ffi.string(ptr, take)
+  end
+  return table.concat(parts)
+end
+
+-- Reads a shared snapshot (see require("workers")), typically on a worker
+-- VM. The handle owns the snapshot and is kept alive by the wrapper.
+function M.shared(handle)
+  local ptr = ffi.cast("PTableSnapshot*", handle:pointer())
+  return setmetatable({ ptr = ptr, handle = handle }, Snapshot)
+end
+
+function PTable:length()
+  return tonumber(C.ptable_get_length(self.ptr))
+end
+
+function PTable:byte(at)
+  return C.ptable_index(self.ptr, at) % 256
+end
+
+function PTable:spans(from)
+  from = from or 0
+  local iter = ffi.gc(C.ptable_iter_create(self.ptr, from), C.ptable_iter_release)
+  return span_iter(iter, from)
+end
+
+function PTable:sub(from, to)
+  to = math.min(to or self:length(), self:length())
+  if from >= to then return "" end
+  return sub_from(self:spans(from), from, to)
+end
+
+-- Returns true when the text went in
+function PTable:insert(pos, text)
+  return C.ptable_insert_len(self.ptr, pos, text, #text) == 0
+end
+
+function PTable:delete(pos, len)
+  C.ptable_delete(self.ptr, pos, len)
+end
+
+-- edits = { { pos, delete_len, text }, ... } sorted by position, offsets
+-- in the document as it was before. Returns true when applied.
+function PTable:apply(edits)
+  local n = #edits
+  local array = ffi.new("PTableEdit[?]", n)
+  for i = 1, n do
+    local edit = edits[i]
+    local text = edit[3] or ""
+    array[i - 1].pos = edit[1]
+    array[i - 1].delete_len = edit[2] or 0
+    array[i - 1].text = text
+    array[i - 1].text_len = #text
+  end
+  -- The edit strings stay referenced by `edits` for the whole call
+  return C.ptable_apply_batch(self.ptr, array, n) == 0
+end
+
+function PTable:group(fn)
+  C.ptable_begin_group(self.ptr)
+  local ok, err = pcall(fn, self)
+  C.ptable_end_group(self.ptr)
+  if not ok then error(err, 0) end
+end
+
+local pos_out = ffi.new("size_t[2]")
+
+function PTable:undo()
+  if C.ptable_undo(self.ptr, pos_out) == 0 then return nil end
+  return tonumber(pos_out[0])
+end
+
+function PTable:redo()
+  if C.ptable_redo(self.ptr, pos_out) == 0 then return nil end
+  return tonumber(pos_out[0])
+end
+
+function PTable:line_count()
+  return tonumber(C.ptable_line_count(self.ptr))
+end
+
+function PTable:line_to_offset(line)
+  return tonumber(C.ptable_line_to_offset(self.ptr, line))
+end
+
+function PTable:offset_to_line(offset)
+  C.ptable_offset_to_line(self.ptr, offset, pos_out, pos_out + 1)
+  return tonumber(pos_out[0]), tonumber(pos_out[1])
+end
+
+function PTable:snapshot()
+  local snapshot = C.ptable_snapshot(self.ptr)
+  if snapshot == nil then return nil end
+  return setmetatable({ ptr = ffi.gc(snapshot, C.ptable_snapshot_release) }, Snapshot)
+end
+
+function Snapshot:length()
+  return tonumber(C.ptable_snapshot_length(self.ptr))
+end
+
+-- The iterator keeps the snapshot referenced so it cannot be collected
+-- while spans are still being read
+function Snapshot:spans(from)
+  from = from or 0
+  local iter = ffi.gc(C.ptable_snapshot_iter_create(self.ptr, from), C.ptable_iter_release)
+  local spans = span_iter(iter, from)
+  local snapshot = self
+  return function()
+    local _ = snapshot
+    return spans()
+  end
+end
+
+function Snapshot:sub(from, to)
+  to = math.min(to or self:length(), self:length())
+  if from >= to then return "" end
+  return sub_from(self:spans(from), from, to)
+end
+
+function Snapshot:release()
+  if self.handle then
+    self.handle:release()
+    self.handle = nil
+  else
+    ffi.gc(self.ptr, nil)
+    C.ptable_snapshot_release(self.ptr)
+  end
+  self.ptr = nil
+end
+
+return M
@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+
+#include "bytes.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#define BYTES_X86
+#include <immintrin.h>
+#endif
+
+typedef size_t bytes_count_func(const char* buf, size_t len, char byte);
+typedef size_t bytes_positions_func(const char* buf, size_t len, char byte, size_t base, size_t* out);
+typedef const char* bytes_find_func(const char* hay, size_t len, const char* needle, size_t needle_len);
+
+/* Scalar */
+
+static size_t bytes_count_scalar(const char* buf, size_t len, char byte) {
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        count += buf[i] == byte;
+    }
+    return count;
+}
+
+static size_t bytes_positions_scalar(const char* buf, size_t len, char byte, size_t base, size_t* out) {
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == byte) out[count++] = base + i;
+    }
+    return count;
+}
+
+// glibc memmem is two-way for longer needles, linear in the worst case
+static const char* bytes_find_scalar(const char* hay, size_t len, const char* needle, size_t needle_len) {
+    return memmem(hay, len, needle, needle_len);
+}
+
+/// Expands a 64 byte match mask into positions
+static inline size_t bytes_emit_mask(uint64_t mask, size_t at, size_t* out) {
+    size_t count = 0;
+    while (mask) {
+        out[count++] = at + __builtin_ctzll(mask);
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+#ifdef BYTES_X86
+
+/* SSE2 */
+
+// Byte lanes count matches for up to 255 blocks before they are widened
+// with a sum of absolute differences against zero
+__attribute__((target("sse2")))
+static size_t bytes_count_sse2(const char* buf, size_t len, char byte) {
+    const __m128i needle = _mm_set1_epi8(byte);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i total = zero;
+    size_t i = 0;
+
+    while (len - i >= 16) {
+        __m128i acc = zero;
+        size_t blocks = (len - i) / 16;
+        if (blocks > 255) blocks = 255;
+
+        for (size_t b = 0; b < blocks; b++, i += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*) (buf + i));
+            // Matches compare to -1, subtracting adds one per match
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(chunk, needle));
+        }
+        total = _mm_add_epi64(total, _mm_sad_epu8(acc, zero));
+    }
+
+    size_t count = (size_t) _mm_cvtsi128_si64(total) + (size_t) _mm_cvtsi128_si64(_mm_unpackhi_epi64(total, total));
+    return count + bytes_count_scalar(buf + i, len - i, byte);
+}
+
+__attribute__((target("sse2")))
+static size_t bytes_positions_sse2(const char* buf, size_t len, char byte, size_t base, size_t* out) {
+    const __m128i needle = _mm_set1_epi8(byte);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; len - i >= 64; i += 64) {
+        uint64_t m0 = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (buf + i)), needle));
+        uint64_t m1 = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (buf + i + 16)), needle));
+        uint64_t m2 = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (buf + i + 32)), needle));
+        uint64_t m3 = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (buf + i + 48)), needle));
+        count += bytes_emit_mask(m0 | (m1 << 16) | (m2 << 32) | (m3 << 48), base + i, out + count);
+    }
+
+    return count + bytes_positions_scalar(buf + i, len - i, byte, base + i, out + count);
+}
+
+/// Candidates are positions where both the first and the last byte of the
+/// needle match, only those are compared in full. Rare byte pairs make
+/// this skip most of the haystack a vector at a time.
+__attribute__((target("sse2")))
+static const char* bytes_find_sse2(const char* hay, size_t len, const char* needle, size_t needle_len) {
+    if (needle_len < 2 || len < needle_len) return bytes_find_scalar(hay, len, needle, needle_len);
+
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+
+    for (; i + needle_len - 1 + 16 <= len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*) (hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*) (hay + i + needle_len - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(hay + at + 1, needle + 1, needle_len - 2) == 0) return hay + at;
+            mask &= mask - 1;
+        }
+    }
+
+    return bytes_find_scalar(hay + i, len - i, needle, needle_len);
+}
+
+/* AVX2 */
+
+__attribute__((target("avx2")))
+static size_t bytes_count_avx2(const char* buf, size_t len, char byte) {
+    const __m256i needle = _mm256_set1_epi8(byte);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    size_t i = 0;
+
+    while (len - i >= 32) {
+        __m256i acc = zero;
+        size_t blocks = (len - i) / 32;
+        if (blocks > 255) blocks = 255;
+
+        for (size_t b = 0; b < blocks; b++, i += 32) {
+            __m256i chunk = _mm256_loadu_si256((const __m256i*) (buf + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(chunk, needle));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(acc, zero));
+    }
+
+    size_t count = (size_t) _mm256_extract_epi64(total, 0) + (size_t) _mm256_extract_epi64(total, 1)
+        + (size_t) _mm256_extract_epi64(total, 2) + (size_t) _mm256_extract_epi64(total, 3);
+    return count + bytes_count_scalar(buf + i, len - i, byte);
+}
+
+__attribute__((target("avx2,bmi")))
+static size_t bytes_positions_avx2(const char* buf, size_t len, char byte, size_t base, size_t* out) {
+    const __m256i needle = _mm256_set1_epi8(byte);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; len - i >= 64; i += 64) {
+        uint64_t lo = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (buf + i)), needle));
+        uint64_t hi = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (buf + i + 32)), needle));
+        count += bytes_emit_mask(lo | (hi << 32), base + i, out + count);
+    }
+
+    return count + bytes_positions_scalar(buf + i, len - i, byte, base + i, out + count);
+}
+
+__attribute__((target("avx2,bmi")))
+static const char* bytes_find_avx2(const char* hay, size_t len, const char* needle, size_t needle_len) {
+    if (needle_len < 2 || len < needle_len) return bytes_find_scalar(hay, len, needle, needle_len);
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+
+    for (; i + needle_len - 1 + 32 <= len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*) (hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*) (hay + i + needle_len - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(hay + at + 1, needle + 1, needle_len - 2) == 0) return hay + at;
+            mask &= mask - 1;
+        }
+    }
+
+    return bytes_find_scalar(hay + i, len - i, needle, needle_len);
+}
+
+/* AVX-512 */
+
+__attribute__((target("avx512bw,popcnt,bmi2")))
+static size_t bytes_count_avx512(const char* buf, size_t len, char byte) {
+    const __m512i needle = _mm512_set1_epi8(byte);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; len - i >= 64; i += 64) {
+        __m512i chunk = _mm512_loadu_si512((const void*) (buf + i));
+        count += __builtin_popcountll(_mm512_cmpeq_epi8_mask(chunk, needle));
+    }
+
+    // Masked load covers the tail without reading past the buffer
+    if (i < len) {
+        __mmask64 tail = _bzhi_u64(~0ULL, len - i);
+        __m512i chunk = _mm512_maskz_loadu_epi8(tail, buf + i);
+        count += __builtin_popcountll(_mm512_mask_cmpeq_epi8_mask(tail, chunk, needle));
+    }
+
+    return count;
+}
+
+__attribute__((target("avx512bw,bmi,bmi2")))
+static size_t bytes_positions_avx512(const char* buf, size_t len, char byte, size_t base, size_t* out) {
+    const __m512i needle = _mm512_set1_epi8(byte);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; len - i >= 64; i += 64) {
+        __m512i chunk = _mm512_loadu_si512((const void*) (buf + i));
+        count += bytes_emit_mask(_mm512_cmpeq_epi8_mask(chunk, needle), base + i, out + count);
+    }
+
+    if (i < len) {
+        __mmask64 tail = _bzhi_u64(~0ULL, len - i);
+        __m512i chunk = _mm512_maskz_loadu_epi8(tail, buf + i);
+        count += bytes_emit_mask(_mm512_mask_cmpeq_epi8_mask(tail, chunk, needle), base + i, out + count);
+    }
+
+    return count;
+}
+
+#endif // BYTES_X86
+
+/* Dispatch */
+
+static bytes_count_func* const bytes_count_kernels[BYTES_KERNEL_COUNT] = {
+    bytes_count_scalar,
+#ifdef BYTES_X86
+    bytes_count_sse2,
+    bytes_count_avx2,
+    bytes_count_avx512,
+#endif
+};
+
+static bytes_positions_func* const bytes_positions_kernels[BYTES_KERNEL_COUNT] = {
+    bytes_positions_scalar,
+#ifdef BYTES_X86
+    bytes_positions_sse2,
+    bytes_positions_avx2,
+    bytes_positions_avx512,
+#endif
+};
+
+// Substring search gains nothing measurable from 64 byte vectors, the
+// AVX-512 level reuses the AVX2 filter
+static bytes_find_func* const bytes_find_kernels[BYTES_KERNEL_COUNT] = {
+    bytes_find_scalar,
+#ifdef BYTES_X86
+    bytes_find_sse2,
+    bytes_find_avx2,
+    bytes_find_avx2,
+#endif
+};
+
+static pthread_once_t bytes_once = PTHREAD_ONCE_INIT;
+static BytesKernel bytes_kernel = BYTES_SCALAR;
+
+static void bytes_detect() {
+#ifdef BYTES_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("bmi2")) {
+        bytes_kernel = BYTES_AVX512;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")) {
+        bytes_kernel = BYTES_AVX2;
+    } else {
+        bytes_kernel = BYTES_SSE2;
+    }
+#endif
+}
+
+BytesKernel bytes_best_kernel() {
+    pthread_once(&bytes_once, bytes_detect);
+    return bytes_kernel;
+}
+
+static inline BytesKernel bytes_supported(BytesKernel kernel) {
+    BytesKernel best = bytes_best_kernel();
+    return kernel > best ? best : kernel;
+}
+
+size_t bytes_count_with(BytesKernel kernel, const char* buf, size_t len, char byte) {
+    return bytes_count_kernels[bytes_supported(kernel)](buf, len, byte);
+}
+
+size_t bytes_positions_with(BytesKernel kernel, const char* buf, size_t len, char byte, size_t base, size_t* out) {
+    return bytes_positions_kernels[bytes_supported(kernel)](buf, len, byte, base, out);
+}
+
+size_t bytes_count(const char* buf, size_t len, char byte) {
+    return bytes_count_kernels[bytes_best_kernel()](buf, len, byte);
+}
+
+size_t bytes_positions(const char* buf, size_t len, char byte, size_t base, size_t* out) {
+    return bytes_positions_kernels[bytes_best_kernel()](buf, len, byte, base, out);
+}
+
+const char* bytes_find_with(BytesKernel kernel, const char* hay, size_t len, const char* needle, size_t needle_len) {
+    return bytes_find_kernels[bytes_supported(kernel)](hay, len, needle, needle_len);
+}
+
+const char* bytes_find(const char* hay, size_t len, const char* needle, size_t needle_len) {
+    return bytes_find_kernels[bytes_best_kernel()](hay, len, needle, needle_len);
+}
+
+const char* bytes_kernel_name(BytesKernel kernel) {
+    switch (kernel) {
+        case BYTES_SCALAR: return "scalar";
+        case BYTES_SSE2: return "sse2";
+        case BYTES_AVX2: return "avx2";
+        case BYTES_AVX512: return "avx512bw";
+        default: return "unknown";
+    }
+}
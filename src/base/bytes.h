@@ -0,0 +1,40 @@
+#ifndef BYTES_H_
+#define BYTES_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/// Byte class scanning
+/// -------------------
+///
+/// Counting and locating one byte value (line feeds mostly) over large
+/// buffers. The kernel is picked once at runtime from what the CPU
+/// supports: AVX-512BW, AVX2, or the SSE2 baseline every x86-64 has.
+/// Other targets use the scalar version.
+
+typedef enum bytes_kernel {
+BYTES_SCALAR,
+BYTES_SSE2,
+BYTES_AVX2,
+BYTES_AVX512,
+BYTES_KERNEL_COUNT
+} BytesKernel;
+
+/// Number of bytes in buf[0, len) equal to `byte`
+size_t bytes_count(const char* buf, size_t len, char byte);
+/// Writes `base` + offset of every match in buf[0, len) to `out`, which
+/// must have room for all of them. Returns how many were written.
+size_t bytes_positions(const char* buf, size_t len, char byte, size_t base, size_t* out);
+/// First occurrence of needle[0, needle_len) in hay[0, len), NULL if none.
+/// An empty needle matches at `hay`.
+const char* bytes_find(const char* hay, size_t len, const char* needle, size_t needle_len);
+
+// Explicit kernels, for benchmarks and comparisons. Asking for a kernel
+// the CPU lacks falls back to the best supported one.
+BytesKernel bytes_best_kernel();
+size_t bytes_count_with(BytesKernel kernel, const char* buf, size_t len, char byte);
+size_t bytes_positions_with(BytesKernel kernel, const char* buf, size_t len, char byte, size_t base, size_t* out);
+const char* bytes_find_with(BytesKernel kernel, const char* hay, size_t len, const char* needle, size_t needle_len);
+const char* bytes_kernel_name(BytesKernel kernel);
+
+#endif // BYTES_H_
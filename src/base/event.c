@@ -0,0 +1,164 @@
+#include "event.h"
+
+#include "base.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+int32_t event_loop_init(EventLoop* loop) {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        perror("Failed to create epoll instance");
+        return -1;
+    }
+
+    for (int32_t i = 0; i < EVENT_MAX_SOURCES; i++) {
+        loop->sources[i].fd = -1;
+        loop->sources[i].callback = NULL;
+        loop->sources[i].user = NULL;
+    }
+
+    return 0;
+}
+
+void event_loop_release(EventLoop* loop) {
+    if (loop->epoll_fd != -1) {
+        close(loop->epoll_fd);
+    }
+    loop->epoll_fd = -1;
+}
+
+int32_t event_loop_add(EventLoop* loop, int fd, uint32_t events, event_callback* callback, void* user) {
+    EventSource* source = NULL;
+    for (int32_t i = 0; i < EVENT_MAX_SOURCES; i++) {
+        if (loop->sources[i].fd == -1) {
+            source = &loop->sources[i];
+            break;
+        }
+    }
+
+    if (!source) {
+        error_print("No free event source slot for fd %d", fd);
+        return -1;
+    }
+
+    struct epoll_event ev = {0};
+    if (events & EVENT_READ) ev.events |= EPOLLIN;
+    if (events & EVENT_WRITE) ev.events |= EPOLLOUT;
+    ev.data.ptr = source;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("Failed to add event source");
+        return -1;
+    }
+
+    source->fd = fd;
+    source->callback = callback;
+    source->user = user;
+
+    return 0;
+}
+
+int32_t event_loop_remove(EventLoop* loop, int fd) {
+    for (int32_t i = 0; i < EVENT_MAX_SOURCES; i++) {
+        if (loop->sources[i].fd == fd) {
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            loop->sources[i].fd = -1;
+            loop->sources[i].callback = NULL;
+            loop->sources[i].user = NULL;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int32_t event_loop_wait(EventLoop* loop, int32_t timeout_ms) {
+    struct epoll_event ready[EVENT_MAX_SOURCES];
+
+    int count = epoll_wait(loop->epoll_fd, ready, EVENT_MAX_SOURCES, timeout_ms);
+    if (count == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        EventSource* source = (EventSource*) ready[i].data.ptr;
+
+        // An earlier callback of this batch may have removed the source
+        if (source->fd == -1 || !source->callback) continue;
+
+        uint32_t events = 0;
+        if (ready[i].events & (EPOLLIN | EPOLLHUP)) events |= EVENT_READ;
+        if (ready[i].events & EPOLLOUT) events |= EVENT_WRITE;
+        if (ready[i].events & EPOLLERR) events |= EVENT_ERROR;
+
+        source->callback(loop, source->fd, events, source->user);
+    }
+
+    return count;
+}
+
+int event_signal_fd(int signo) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+
+    int err = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if (err != 0) {
+        errno = err;
+        perror("Failed to block signal");
+        return -1;
+    }
+
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        perror("Failed to create signalfd");
+    }
+
+    return fd;
+}
+
+void event_block_signals() {
+    sigset_t mask;
+    sigfillset(&mask);
+
+    // Faults go to the thread that caused them, blocking them would kill
+    // the process instead of running the handler
+    sigdelset(&mask, SIGBUS);
+    sigdelset(&mask, SIGSEGV);
+    sigdelset(&mask, SIGFPE);
+    sigdelset(&mask, SIGILL);
+
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+void event_signal_drain(int fd) {
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {}
+}
+
+int event_watch_file(const char* path) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+        perror("Failed to create inotify instance");
+        return -1;
+    }
+
+    if (inotify_add_watch(fd, path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+        perror("Failed to watch file");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void event_watch_drain(int fd) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+}
@@ -0,0 +1,58 @@
+#ifndef EVENT_H_
+#define EVENT_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef EVENT_MAX_SOURCES
+#define EVENT_MAX_SOURCES 32
+#endif
+
+#define EVENT_READ  (1 << 0)
+#define EVENT_WRITE (1 << 1)
+#define EVENT_ERROR (1 << 2)
+
+/// epoll based readiness loop. Anything that can be expressed as a file
+/// descriptor (terminal input, signals, file watches, job completions)
+/// is registered with a callback and served by the same wait.
+typedef struct EventLoop EventLoop;
+
+typedef void event_callback(EventLoop* loop, int fd, uint32_t events, void* user);
+
+typedef struct EventSource EventSource;
+struct EventSource {
+    int fd;
+    event_callback* callback;
+    void* user;
+};
+
+struct EventLoop {
+    int epoll_fd;
+    EventSource sources[EVENT_MAX_SOURCES];
+};
+
+int32_t event_loop_init(EventLoop* loop);
+void event_loop_release(EventLoop* loop);
+
+int32_t event_loop_add(EventLoop* loop, int fd, uint32_t events, event_callback* callback, void* user);
+int32_t event_loop_remove(EventLoop* loop, int fd);
+
+/// Blocks until at least one source is ready or `timeout_ms` passes (-1
+/// waits forever) and runs the callbacks of every ready source. Returns
+/// the number of sources served, 0 on timeout and -1 on error.
+int32_t event_loop_wait(EventLoop* loop, int32_t timeout_ms);
+
+/// Blocks `signo` and returns a signalfd that becomes readable when it is
+/// raised. Drain it with event_signal_drain.
+int event_signal_fd(int signo);
+void event_signal_drain(int fd);
+/// For helper threads: blocks every asynchronous signal on the calling
+/// thread. Signals blocked only on the main thread would otherwise be
+/// delivered to a helper, which never reads the signalfd.
+void event_block_signals();
+
+/// inotify descriptor watching `path` for changes, moves and deletion
+int event_watch_file(const char* path);
+void event_watch_drain(int fd);
+
+#endif // EVENT_H_
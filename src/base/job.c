@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+
+#include "job.h"
+
+#include "base.h"
+#include "mem.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// Worker the current thread belongs to, NULL on the main thread
+static _Thread_local JobWorker* job_current_worker = NULL;
+
+/* Deque */
+
+static int32_t job_deque_init(JobDeque* deque) {
+    deque->jobs = malloc(sizeof(Job*) * JOB_DEQUE_INIT_SIZE);
+    if (!deque->jobs) {
+        perror("Failed to allocate job deque");
+        return -1;
+    }
+
+    deque->head = 0;
+    deque->tail = 0;
+    deque->capacity = JOB_DEQUE_INIT_SIZE;
+    pthread_mutex_init(&deque->lock, NULL);
+
+    return 0;
+}
+
+static void job_deque_release(JobDeque* deque) {
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->jobs);
+    deque->jobs = NULL;
+}
+
+// head and tail only ever grow, slots are indexed modulo the capacity
+static int32_t job_deque_push(JobDeque* deque, Job* job) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail - deque->head == deque->capacity) {
+        size_t new_capacity = deque->capacity * 2;
+        Job** jobs = malloc(sizeof(Job*) * new_capacity);
+        if (!jobs) {
+            pthread_mutex_unlock(&deque->lock);
+            perror("Failed to grow job deque");
+            return -1;
+        }
+
+        for (size_t i = deque->head; i < deque->tail; i++) {
+            jobs[i & (new_capacity - 1)] = deque->jobs[i & (deque->capacity - 1)];
+        }
+        free(deque->jobs);
+        deque->jobs = jobs;
+        deque->capacity = new_capacity;
+    }
+
+    deque->jobs[deque->tail++ & (deque->capacity - 1)] = job;
+
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+static Job* job_deque_pop_back(JobDeque* deque) {
+    Job* job = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail != deque->head) {
+        job = deque->jobs[--deque->tail & (deque->capacity - 1)];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return job;
+}
+
+static Job* job_deque_pop_front(JobDeque* deque) {
+    Job* job = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail != deque->head) {
+        job = deque->jobs[deque->head++ & (deque->capacity - 1)];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return job;
+}
+
+/* Scheduling */
+
+/// Own deque first, newest job first while it is still warm, then steal
+/// the oldest job of the next worker that has one
+static Job* job_take(JobPool* pool, JobWorker* self) {
+    uint32_t start = 0;
+    Job* job = NULL;
+
+    if (self) {
+        job = job_deque_pop_back(&self->deque);
+        start = self->index + 1;
+    }
+
+    for (uint32_t i = 0; !job && i < pool->worker_count; i++) {
+        JobWorker* victim = &pool->workers[(start + i) % pool->worker_count];
+        if (victim == self) continue;
+        job = job_deque_pop_front(&victim->deque);
+    }
+
+    if (job) atomic_fetch_sub(&pool->pending, 1);
+    return job;
+}
+
+static void job_post_done(JobPool* pool, Job* job) {
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->done_lock);
+    if (pool->done_tail) {
+        pool->done_tail->next = job;
+    } else {
+        pool->done_head = job;
+    }
+    pool->done_tail = job;
+    pthread_mutex_unlock(&pool->done_lock);
+
+    uint64_t one = 1;
+    while (write(pool->done_fd, &one, sizeof(one)) == -1 && errno == EINTR) {}
+}
+
+static void job_execute(JobPool* pool, Job* job) {
+    if (!job_cancelled(job->cancel)) {
+        job->run(job->data, job->cancel);
+    }
+
+    // The waiter may free `data` as soon as the counter drops
+    if (job->counter) {
+        atomic_fetch_sub(&job->counter->remaining, 1);
+    }
+
+    if (job->done) {
+        job_post_done(pool, job);
+    } else {
+        free(job);
+    }
+}
+
+static void* job_worker_main(void* arg) {
+    JobWorker* self = arg;
+    JobPool* pool = self->pool;
+    job_current_worker = self;
+
+    // Resizes and the like are left to the main thread's signalfd
+    event_block_signals();
+
+    // Per thread nice value, keeps the input thread ahead of heavy jobs
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), JOB_WORKER_NICE);
+
+    while (!atomic_load(&pool->stop)) {
+        Job* job = job_take(pool, self);
+        if (job) {
+            job_execute(pool, job);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->sleep_lock);
+        while (atomic_load(&pool->pending) == 0 && !atomic_load(&pool->stop)) {
+            pthread_cond_wait(&pool->wake, &pool->sleep_lock);
+        }
+        pthread_mutex_unlock(&pool->sleep_lock);
+    }
+
+    // Jobs may have reserved scratch arenas on this thread
+    arena_scratch_release();
+    return NULL;
+}
+
+static int32_t job_push(JobPool* pool, Job* job) {
+    JobWorker* worker = job_current_worker;
+    if (!worker || worker->pool != pool) {
+        uint32_t next = atomic_fetch_add(&pool->next_worker, 1);
+        worker = &pool->workers[next % pool->worker_count];
+    }
+
+    // Counted before it is visible so a taker never underflows pending
+    atomic_fetch_add(&pool->pending, 1);
+    if (job_deque_push(&worker->deque, job) != 0) {
+        atomic_fetch_sub(&pool->pending, 1);
+        free(job);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->sleep_lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->sleep_lock);
+
+    return 0;
+}
+
+static Job* job_create(job_func* run, job_done_func* done, void* data, JobCancel* cancel, JobCounter* counter) {
+    Job* job = malloc(sizeof(Job));
+    if (!job) {
+        perror("Failed to allocate job");
+        return NULL;
+    }
+
+    job->run = run;
+    job->done = done;
+    job->data = data;
+    job->cancel = cancel;
+    job->counter = counter;
+    job->next = NULL;
+
+    return job;
+}
+
+/* Pool */
+
+int32_t job_pool_init(JobPool* pool, uint32_t worker_count) {
+    memset(pool, 0, sizeof(*pool));
+
+    if (worker_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cores > 1 ? (uint32_t) cores - 1 : 1;
+    }
+
+    pool->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->done_fd == -1) {
+        perror("Failed to create job completion fd");
+        return -1;
+    }
+
+    pool->workers = calloc(worker_count, sizeof(JobWorker));
+    if (!pool->workers) {
+        perror("Failed to allocate job workers");
+        close(pool->done_fd);
+        return -1;
+    }
+
+    atomic_init(&pool->next_worker, 0);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->stop, 0);
+    pthread_mutex_init(&pool->sleep_lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_mutex_init(&pool->done_lock, NULL);
+
+    for (uint32_t i = 0; i < worker_count; i++) {
+        JobWorker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        if (job_deque_init(&worker->deque) != 0) {
+            pool->worker_count = i;
+            job_pool_release(pool);
+            return -1;
+        }
+    }
+
+    // Deques must all exist before any worker starts stealing
+    pool->worker_count = worker_count;
+    for (uint32_t i = 0; i < worker_count; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, job_worker_main, &pool->workers[i]) != 0) {
+            error_print("Failed to start job worker %u", i);
+            job_pool_release(pool);
+            return -1;
+        }
+        pool->started++;
+    }
+
+    return 0;
+}
+
+void job_pool_release(JobPool* pool) {
+    if (!pool->workers) return;
+
+    pthread_mutex_lock(&pool->sleep_lock);
+    atomic_store(&pool->stop, 1);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->sleep_lock);
+
+    for (uint32_t i = 0; i < pool->started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    // Whatever is still queued never runs
+    for (uint32_t i = 0; i < pool->worker_count; i++) {
+        Job* job;
+        while ((job = job_deque_pop_front(&pool->workers[i].deque))) {
+            if (job->counter) atomic_fetch_sub(&job->counter->remaining, 1);
+            if (job->done) job->done(job->data, 1);
+            free(job);
+        }
+        job_deque_release(&pool->workers[i].deque);
+    }
+
+    job_pool_complete(pool);
+
+    pthread_mutex_destroy(&pool->sleep_lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->done_lock);
+    close(pool->done_fd);
+    free(pool->workers);
+
+    pool->workers = NULL;
+    pool->worker_count = 0;
+    pool->started = 0;
+    pool->done_fd = -1;
+}
+
+int32_t job_submit(JobPool* pool, job_func* run, job_done_func* done, void* data, JobCancel* cancel) {
+    Job* job = job_create(run, done, data, cancel, NULL);
+    if (!job) return -1;
+
+    return job_push(pool, job);
+}
+
+int32_t job_submit_counted(JobPool* pool, JobCounter* counter, job_func* run, void* data, JobCancel* cancel) {
+    Job* job = job_create(run, NULL, data, cancel, counter);
+    if (!job) {
+        atomic_fetch_sub(&counter->remaining, 1);
+        return -1;
+    }
+
+    if (job_push(pool, job) != 0) {
+        atomic_fetch_sub(&counter->remaining, 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+void job_wait(JobPool* pool, JobCounter* counter) {
+    while (atomic_load(&counter->remaining) > 0) {
+        Job* job = job_take(pool, job_current_worker);
+        if (job) {
+            job_execute(pool, job);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+/* Completions */
+
+static void job_pool_on_done(EventLoop* loop, int fd, uint32_t events, void* user) {
+    unused(loop);
+    unused(fd);
+    unused(events);
+
+    job_pool_complete(user);
+}
+
+int32_t job_pool_attach(JobPool* pool, EventLoop* loop) {
+    return event_loop_add(loop, pool->done_fd, EVENT_READ, job_pool_on_done, pool);
+}
+
+uint32_t job_pool_complete(JobPool* pool) {
+    uint64_t count;
+    while (read(pool->done_fd, &count, sizeof(count)) == -1 && errno == EINTR) {}
+
+    pthread_mutex_lock(&pool->done_lock);
+    Job* job = pool->done_head;
+    pool->done_head = NULL;
+    pool->done_tail = NULL;
+    pthread_mutex_unlock(&pool->done_lock);
+
+    uint32_t completed = 0;
+    while (job) {
+        Job* next = job->next;
+        job->done(job->data, job_cancelled(job->cancel));
+        free(job);
+        job = next;
+        completed++;
+    }
+
+    return completed;
+}
@@ -0,0 +1,127 @@
+#ifndef JOB_H_
+#define JOB_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "event.h"
+
+#define JOB_DEQUE_INIT_SIZE 64
+#define JOB_WORKER_NICE 5
+
+/// Work stealing job system
+/// ------------------------
+///
+/// Every worker owns a deque. Workers pop their own deque from the back
+/// and steal from the front of the others when it runs dry, so a burst
+/// of jobs spreads over the pool without a shared queue to fight over.
+///
+/// Jobs that carry a completion are handed back to the main thread: the
+/// pool exposes an eventfd that is registered with the EventLoop and the
+/// completions run from its callback, next to input handling. Workers
+/// run at a lower priority so heavy jobs do not delay keystrokes.
+
+typedef struct JobPool JobPool;
+
+/// Cooperative cancellation, jobs poll job_cancelled at convenient points.
+/// The token must outlive every job it was passed to.
+typedef struct JobCancel {
+    atomic_uint cancelled;
+} JobCancel;
+
+/// Fork/join counter, job_wait returns once every counted job has run
+typedef struct JobCounter {
+    atomic_size_t remaining;
+} JobCounter;
+
+typedef void job_func(void* data, JobCancel* cancel);
+/// Runs on the main thread. `cancelled` is set when the token was
+/// cancelled before or while the job ran, or the pool was released.
+typedef void job_done_func(void* data, uint8_t cancelled);
+
+typedef struct Job {
+    job_func* run;
+    job_done_func* done;
+    void* data;
+    JobCancel* cancel;
+    JobCounter* counter;
+
+    // Completion queue link
+    struct Job* next;
+} Job;
+
+typedef struct JobDeque {
+    pthread_mutex_t lock;
+    Job** jobs;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} JobDeque;
+
+typedef struct JobWorker {
+    JobPool* pool;
+    pthread_t thread;
+    uint32_t index;
+    JobDeque deque;
+} JobWorker;
+
+struct JobPool {
+    JobWorker* workers;
+    uint32_t worker_count;
+    uint32_t started;
+    atomic_uint next_worker;
+
+    // Idle workers sleep until something is queued
+    atomic_size_t pending;
+    atomic_uint stop;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+
+    // Finished jobs waiting for the main thread, oldest first
+    pthread_mutex_t done_lock;
+    Job* done_head;
+    Job* done_tail;
+    int done_fd;
+};
+
+/// Starts `worker_count` workers, 0 picks one less than the number of
+/// online cores (at least one)
+int32_t job_pool_init(JobPool* pool, uint32_t worker_count);
+/// Joins the workers. Jobs that never ran complete as cancelled.
+void job_pool_release(JobPool* pool);
+
+/// Queues `run` on a worker. `done` may be NULL, otherwise it is called
+/// on the main thread once the job finished (or was skipped because it
+/// was cancelled before it started). `cancel` may be NULL.
+int32_t job_submit(JobPool* pool, job_func* run, job_done_func* done, void* data, JobCancel* cancel);
+/// Queues a job that decrements `counter` when it finishes, for fork/join
+/// work waited on with job_wait. Add to the counter before submitting.
+int32_t job_submit_counted(JobPool* pool, JobCounter* counter, job_func* run, void* data, JobCancel* cancel);
+/// Helps running queued jobs until `counter` reaches zero
+void job_wait(JobPool* pool, JobCounter* counter);
+
+/// Registers the completion fd with `loop`, completions then run from
+/// event_loop_wait
+int32_t job_pool_attach(JobPool* pool, EventLoop* loop);
+/// Runs every pending completion, returns how many ran
+uint32_t job_pool_complete(JobPool* pool);
+
+static inline void job_cancel_init(JobCancel* cancel) {
+    atomic_init(&cancel->cancelled, 0);
+}
+
+static inline void job_cancel(JobCancel* cancel) {
+    atomic_store_explicit(&cancel->cancelled, 1, memory_order_release);
+}
+
+static inline uint8_t job_cancelled(JobCancel* cancel) {
+    return cancel && atomic_load_explicit(&cancel->cancelled, memory_order_acquire);
+}
+
+static inline void job_counter_init(JobCounter* counter, size_t count) {
+    atomic_init(&counter->remaining, count);
+}
+
+#endif // JOB_H_
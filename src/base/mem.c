@@ -5,6 +5,7 @@
 #include <memory.h>
 #include <assert.h>
 #include <stdint.h>
+#include <sys/mman.h>
 
 bool is_power_of_two(uintptr_t x) {
     return (x & (x - 1)) == 0;
@@ -26,24 +27,53 @@ uintptr_t align_forward(uintptr_t ptr, size_t align) {
     return p;
 }
 
+/// Makes sure [0, end) is usable, committing pages of virtual arenas
+static bool arena_ensure(Arena* a, size_t end) {
+    if (end > a->buf_len) return false;
+    if (!a->is_virtual || end <= a->committed) return true;
 
-void* arena_alloc_align(Arena* a, size_t size, size_t align) {
+    size_t commit_end = align_forward(end, ARENA_COMMIT_SIZE);
+    if (commit_end > a->buf_len) commit_end = a->buf_len;
+
+    if (mprotect(a->buf + a->committed, commit_end - a->committed, PROT_READ | PROT_WRITE) != 0) {
+        perror("Failed to commit arena pages");
+        return false;
+    }
+
+    a->committed = commit_end;
+    return true;
+}
+
+void* arena_alloc_align_nz(Arena* a, size_t size, size_t align) {
     uintptr_t curr_ptr = (uintptr_t)a->buf + (uintptr_t)a->curr_offset;
     uintptr_t offset = align_forward(curr_ptr, align);
     offset -= (uintptr_t)a->buf;
 
-    if (offset+size <= a->buf_len) {
+    if (arena_ensure(a, offset+size)) {
         void *ptr = &a->buf[offset];
         a->prev_offset = offset;
         a->curr_offset = offset+size;
 
-        memset(ptr, 0, size);
         return ptr;
     }
 
     return NULL;
 }
 
+void* arena_alloc_nz(Arena* a, size_t size) {
+    return arena_alloc_align_nz(a, size, DEFAULT_ALIGNMENT);
+}
+
+void* arena_alloc_align(Arena* a, size_t size, size_t align) {
+    void* ptr = arena_alloc_align_nz(a, size, align);
+
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+
+    return ptr;
+}
+
 void* arena_alloc(Arena* a, size_t size) {
     return arena_alloc_align(a, size, DEFAULT_ALIGNMENT);
 }
@@ -54,6 +84,40 @@ void arena_init(Arena* a, void* backing_buffer, size_t backing_buffer_length) {
     a->buf_len = backing_buffer_length;
     a->curr_offset = 0;
     a->prev_offset = 0;
+    a->committed = backing_buffer_length;
+    a->is_virtual = false;
+}
+
+/// Reserves address space only, nothing is backed by memory until used
+int32_t arena_reserve(Arena* a, size_t reserve_size) {
+    reserve_size = align_forward(reserve_size, ARENA_COMMIT_SIZE);
+
+    void* range = mmap(NULL, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (range == MAP_FAILED) {
+        perror("Failed to reserve arena range");
+        return -1;
+    }
+
+    a->buf = (uint8_t*)range;
+    a->buf_len = reserve_size;
+    a->curr_offset = 0;
+    a->prev_offset = 0;
+    a->committed = 0;
+    a->is_virtual = true;
+
+    return 0;
+}
+
+void arena_release(Arena* a) {
+    if (a->is_virtual && a->buf) {
+        munmap(a->buf, a->buf_len);
+    }
+
+    a->buf = NULL;
+    a->buf_len = 0;
+    a->curr_offset = 0;
+    a->prev_offset = 0;
+    a->committed = 0;
 }
 
 void arena_free(Arena* a, void* ptr) {
@@ -70,14 +134,18 @@ void* arena_resize_align(Arena* a, void* old_memory, size_t old_size, size_t new
         return arena_alloc_align(a, new_size, align);
     } else if (a->buf <= old_mem && old_mem < a->buf+a->buf_len) {
         if (a->buf+a->prev_offset == old_mem) {
+            if (!arena_ensure(a, a->prev_offset + new_size)) return NULL;
+
             a->curr_offset = a->prev_offset + new_size;
             if (new_size > old_size) {
-                memset(&a->buf[a->curr_offset], 0, new_size - old_size);
+                memset(&a->buf[a->prev_offset + old_size], 0, new_size - old_size);
             }
 
             return old_memory;
         } else {
             void *new_memory = arena_alloc_align(a, new_size, align);
+            if (!new_memory) return NULL;
+
             size_t copy_size = old_size < new_size ? old_size : new_size;
             memmove(new_memory, old_memory, copy_size);
             return new_memory;
@@ -96,3 +164,51 @@ void arena_free_all(Arena* a) {
     a->curr_offset = 0;
     a->prev_offset = 0;
 }
+
+ArenaTemp arena_temp_begin(Arena* a) {
+    ArenaTemp temp = { .arena = a, .prev_offset = a->prev_offset, .curr_offset = a->curr_offset };
+    return temp;
+}
+
+void arena_temp_end(ArenaTemp temp) {
+    temp.arena->prev_offset = temp.prev_offset;
+    temp.arena->curr_offset = temp.curr_offset;
+}
+
+static _Thread_local Arena scratch_arenas[ARENA_SCRATCH_COUNT];
+
+Arena* arena_scratch_get(Arena** conflicts, size_t conflict_count) {
+    for (size_t i = 0; i < ARENA_SCRATCH_COUNT; i++) {
+        Arena* scratch = &scratch_arenas[i];
+
+        bool in_use = false;
+        for (size_t c = 0; c < conflict_count; c++) {
+            if (conflicts[c] == scratch) {
+                in_use = true;
+                break;
+            }
+        }
+        if (in_use) continue;
+
+        if (!scratch->buf && arena_reserve(scratch, ARENA_SCRATCH_RESERVE) != 0) {
+            return NULL;
+        }
+
+        return scratch;
+    }
+
+    return NULL;
+}
+
+ArenaTemp scratch_begin(Arena** conflicts, size_t conflict_count) {
+    Arena* scratch = arena_scratch_get(conflicts, conflict_count);
+    assert(scratch && "No scratch arena left");
+
+    return arena_temp_begin(scratch);
+}
+
+void arena_scratch_release() {
+    for (size_t i = 0; i < ARENA_SCRATCH_COUNT; i++) {
+        arena_release(&scratch_arenas[i]);
+    }
+}
@@ -5,23 +5,53 @@
 #define DEFAULT_ALIGNMENT (2*sizeof(void*))
 #endif
 
+#ifndef ARENA_COMMIT_SIZE
+#define ARENA_COMMIT_SIZE (64 * 1024)
+#endif
+
+#ifndef ARENA_SCRATCH_RESERVE
+#define ARENA_SCRATCH_RESERVE ((size_t) 1 << 30)
+#endif
+
+#define ARENA_SCRATCH_COUNT 2
+
 #include <stdint.h>
 #include <stdlib.h>
 
 
 
+/// Linear allocator. Either works on a caller supplied buffer (arena_init)
+/// or on a reserved virtual range whose pages are committed as the arena
+/// grows (arena_reserve). For virtual arenas `buf_len` is the reserved size.
 typedef struct Arena Arena;
 struct Arena {
     uint8_t* buf;
     size_t buf_len;
     size_t prev_offset;
     size_t curr_offset;
+    size_t committed;
+    uint8_t is_virtual;
+};
+
+/// Savepoint, everything allocated after arena_temp_begin is dropped by
+/// the matching arena_temp_end
+typedef struct ArenaTemp ArenaTemp;
+struct ArenaTemp {
+    Arena* arena;
+    size_t prev_offset;
+    size_t curr_offset;
 };
 
 void* arena_alloc_align(Arena* a, size_t size, size_t align);
 void* arena_alloc(Arena* a, size_t size);
 
+// Same as above but the memory is not zeroed
+void* arena_alloc_align_nz(Arena* a, size_t size, size_t align);
+void* arena_alloc_nz(Arena* a, size_t size);
+
 void arena_init(Arena* a, void* backing_buffer, size_t backing_buffer_length);
+int32_t arena_reserve(Arena* a, size_t reserve_size);
+void arena_release(Arena* a);
 void arena_free(Arena* a, void* ptr);
 
 void* arena_resize_align(Arena* a, void* old_memory, size_t old_size, size_t new_size, size_t align);
@@ -29,4 +59,16 @@ void* arena_resize(Arena* a, void* old_memory, size_t old_size, size_t new_size)
 
 void arena_free_all(Arena* a);
 
+ArenaTemp arena_temp_begin(Arena* a);
+void arena_temp_end(ArenaTemp temp);
+
+/// Thread local scratch arenas for per frame and per command temporaries.
+/// Pass the arenas already in use up the call stack as `conflicts` so a
+/// callee never hands out memory its caller is still allocating into.
+Arena* arena_scratch_get(Arena** conflicts, size_t conflict_count);
+ArenaTemp scratch_begin(Arena** conflicts, size_t conflict_count);
+#define scratch_end(temp) arena_temp_end(temp)
+/// Unmaps the calling thread's scratch arenas, for threads about to exit
+void arena_scratch_release();
+
 #endif // MEM_H_
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #ifdef VOLT_USE_OPENGL
 #include <glad/gl.h>
 #endif
@@ -5,6 +7,27 @@
 #include "util.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAPPED_FILES_MAX 64
+
+/// Live file mappings, the SIGBUS handler only rescues faults inside these
+struct mapped_range {
+    atomic_uintptr_t start;
+    atomic_size_t length;
+};
+
+static struct mapped_range mapped_files[MAPPED_FILES_MAX];
+static pthread_once_t mapped_files_once = PTHREAD_ONCE_INIT;
+static uintptr_t mapped_page_size;
+static atomic_uint mapped_faults;
 
 
 file_buff_t read_full_file(const char* path) {
@@ -30,3 +53,122 @@ file_buff_t read_full_file(const char* path) {
 
     return file_buffer;
 }
+
+/// A page past the end of a truncated file, zero filled pages are mapped
+/// over it and the read is retried. Faults anywhere else crash as usual.
+static void mapped_file_sigbus(int sig, siginfo_t* info, void* context) {
+    (void) context;
+    uintptr_t addr = (uintptr_t) info->si_addr;
+
+    for (uint32_t i = 0; i < MAPPED_FILES_MAX; i++) {
+        uintptr_t start = atomic_load(&mapped_files[i].start);
+        size_t length = atomic_load(&mapped_files[i].length);
+        if (!start || addr < start || addr >= start + length) continue;
+
+        void* page = (void*) (addr & ~(mapped_page_size - 1));
+        if (mmap(page, mapped_page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            atomic_fetch_add(&mapped_faults, 1);
+            return;
+        }
+        break;
+    }
+
+    // Faults again with the default action
+    signal(sig, SIG_DFL);
+}
+
+static void mapped_files_init() {
+    mapped_page_size = sysconf(_SC_PAGESIZE);
+
+    struct sigaction action = {0};
+    action.sa_sigaction = mapped_file_sigbus;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGBUS, &action, NULL) == -1) perror("Failed to install SIGBUS handler");
+}
+
+static void mapped_files_add(char* buff, size_t length) {
+    for (uint32_t i = 0; i < MAPPED_FILES_MAX; i++) {
+        uintptr_t expected = 0;
+        if (atomic_compare_exchange_strong(&mapped_files[i].start, &expected, (uintptr_t) buff)) {
+            atomic_store(&mapped_files[i].length, length);
+            return;
+        }
+    }
+}
+
+static void mapped_files_remove(char* buff) {
+    for (uint32_t i = 0; i < MAPPED_FILES_MAX; i++) {
+        if (atomic_load(&mapped_files[i].start) != (uintptr_t) buff) continue;
+        atomic_store(&mapped_files[i].length, 0);
+        atomic_store(&mapped_files[i].start, 0);
+        return;
+    }
+}
+
+int32_t map_full_file(const char* path, file_buff_t* out) {
+    out->buff = NULL;
+    out->length = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size > 0) {
+        void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+
+        out->buff = mapping;
+        out->length = st.st_size;
+
+        pthread_once(&mapped_files_once, mapped_files_init);
+        mapped_files_add(out->buff, out->length);
+    }
+
+    // The mapping keeps its own reference to the file
+    close(fd);
+
+    return 0;
+}
+
+int32_t copy_mapped_file(file_buff_t* file) {
+    if (!file->buff || file->length == 0) return 0;
+
+    void* copy = mmap(NULL, file->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy == MAP_FAILED) return -1;
+
+    // Pages gone with a truncation read back as zeros through the handler
+    memcpy(copy, file->buff, file->length);
+
+    // Moved over the mapping in one step, readers never see a hole
+    if (mprotect(copy, file->length, PROT_READ) == -1 ||
+        mremap(copy, file->length, file->length, MREMAP_MAYMOVE | MREMAP_FIXED, file->buff) == MAP_FAILED) {
+        munmap(copy, file->length);
+        return -1;
+    }
+
+    mapped_files_remove(file->buff);
+    return 0;
+}
+
+uint32_t mapped_file_faults() {
+    return atomic_load(&mapped_faults);
+}
+
+void unmap_full_file(file_buff_t* file) {
+    if (file->buff && file->length > 0) {
+        mapped_files_remove(file->buff);
+        munmap(file->buff, file->length);
+    }
+
+    file->buff = NULL;
+    file->length = 0;
+}
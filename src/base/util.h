@@ -2,6 +2,7 @@
 #define UTIL_H_
 
 #include <stdio.h>
+#include <stdint.h>
 
 typedef struct file_buff file_buff_t;
 struct file_buff {
@@ -11,4 +12,20 @@ struct file_buff {
 
 file_buff_t read_full_file(const char* path);
 
+/// Maps the whole file read-only, pages are only faulted in when touched.
+/// An empty file maps to a NULL buffer of length 0.
+///
+/// The mapping follows the file: bytes another process writes in place
+/// show up in it, and pages cut off by a truncation would raise SIGBUS.
+/// A SIGBUS handler, installed with the first mapping, maps zero pages
+/// over those instead so the process keeps running.
+int32_t map_full_file(const char* path, file_buff_t* out);
+/// Replaces the mapping with a private copy at the same address, later
+/// changes to the file no longer reach it. Safe while other threads read
+/// the buffer. The copy is released with unmap_full_file as before.
+int32_t copy_mapped_file(file_buff_t* file);
+/// Truncated pages the SIGBUS handler replaced with zeros so far
+uint32_t mapped_file_faults();
+void unmap_full_file(file_buff_t* file);
+
 #endif // UTIL_H_
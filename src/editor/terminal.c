@@ -1,11 +1,17 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include "terminal.h"
 
 #include "../base/base.h"
+#include "../base/mem.h"
+#include "../base/event.h"
+#include "../base/job.h"
 #include "../ptable/ptable.h"
-
-#define _DEFAULT_SOURCE
-#define _BSD_SOURCE
-#define _GNU_SOURCE
+#include "../lua/hooks.h"
+#include "../lua/sched.h"
+#include "../lua/workers.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,12 +19,27 @@
 #include <termios.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/ioctl.h>
 
 /* Defines */
 #define EDITOR_VERSION "0.0.1"
 #define EDITOR_BUFFER_MAX_SIZE 1024
 #define CTRL_KEY(k) ((k) & 0x1f)
+#define PASTE_RESERVE ((size_t) 1 << 30)
+#define PASTE_INIT_SIZE (64 * 1024)
+#define PASTE_END "\x1b[201~"
+#define PASTE_END_LEN 6
+#define ABUF_BYTES_PER_CELL 4
+#define ABUF_FRAME_SLACK 256
+#define DIFF_MERGE_GAP 4
+#define ROW_LINE_NONE SIZE_MAX
+#define TAB_STOP 8
+#define INPUT_READ_SIZE 4096
+#define ESCAPE_TIMEOUT_MS 25
+#define KEY_DECODER_MAX_PARAMS 16
 
 slice_prototype(char);
 
@@ -31,11 +52,32 @@ DEL_KEY,
 HOME_KEY,
 END_KEY,
 PAGE_UP,
-PAGE_DOWN
+PAGE_DOWN,
+PASTE_KEY
+};
+
+/// Incremental escape sequence parser, a sequence split across reads just
+/// leaves the decoder mid state until the rest arrives
+enum key_decoder_state {
+DECODE_GROUND,
+DECODE_ESC,
+DECODE_CSI,
+DECODE_SS3,
+DECODE_PASTE
+};
+
+struct key_decoder {
+    enum key_decoder_state state;
+    char params[KEY_DECODER_MAX_PARAMS];
+    uint32_t param_len;
 };
 
+/// `x` is the byte column and `y` the line in the document, `rx` is the
+/// screen column of `x` once tabs are expanded
 struct cursor_params {
-    int x, y;
+    int x;
+    size_t y;
+    int rx;
 };
 
 /* Data */
@@ -44,20 +86,88 @@ struct erow {
     char* chars;
 };
 
+/* append buffer, frames are built in scratch and the paste has its own arena */
+struct abuf {
+    char* b;
+    size_t len;
+    size_t cap;
+    uint32_t allocs;
+    Arena* arena;
+};
+
+/* screen grids, `front` mirrors the terminal and `back` the next frame */
+struct screen_grid {
+    char* cells;
+    int32_t rows;
+    int32_t cols;
+};
+
+/// Document line a back grid row was rendered from, rows still valid and
+/// showing the wanted line are not recomputed
+struct row_state {
+    size_t line;
+    uint8_t valid;
+};
+
+struct frame_stats {
+    uint64_t frames;
+    uint64_t allocs_total;
+    uint32_t allocs_last_frame;
+    size_t bytes_last_frame;
+    uint32_t rows_rendered_last_frame;
+    uint64_t keys;
+};
+
 struct terminal_config {
     struct cursor_params c_params;
     int32_t screen_rows;
     int32_t screen_cols;
-    int32_t numrows;
+    size_t numrows;
+    size_t rowoff;
+    int32_t coloff;
     struct termios orig_termios;
 
     slice(char) add_buffer;
 
     PTable* ptable_buffer;
+    char* filename;
+
+    EventLoop events;
+    JobPool jobs;
+    struct key_decoder decoder;
+    // When a half read escape sequence is taken for a lone escape key, 0
+    // while none is pending
+    uint64_t escape_deadline_ms;
+    int winch_fd;
+    int watch_fd;
+    uint8_t running;
+    uint8_t needs_redraw;
+    uint8_t file_changed;
+
+    struct abuf paste;
+    Arena paste_arena;
+    struct frame_stats frame_stats;
+    LuaHooks hooks;
+    LuaScheduler sched;
+    LuaWorkerPool workers;
+
+    struct screen_grid front;
+    struct screen_grid back;
+    struct row_state* row_states;
+    int32_t rendered_coloff;
+    uint8_t front_valid;
+
+    // Where the terminal cursor is after the bytes emitted so far, -1 when
+    // unknown (e.g. pending wrap after writing the last column)
+    int32_t term_x, term_y;
 };
 
 struct terminal_config t_config;
 
+void ab_reset(struct abuf* ab);
+void ab_append(struct abuf *ab, const char* s, size_t len);
+void terminal_save();
+
 /* Terminal */
 void critical_die(const char* s) {
     write(STDOUT_FILENO, "\x1b[2J", 4);
@@ -68,6 +178,7 @@ void critical_die(const char* s) {
 }
 
 void disable_raw_mode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &t_config.orig_termios) == -1 ) {
         critical_die("tcsetattr");
     }
@@ -82,60 +193,143 @@ void enable_raw_mode() {
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    // Reads never block, the event loop only reads once input is ready
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) critical_die("tcsetattr");
+
+    // Bracketed paste, pasted text arrives between ESC[200~ and ESC[201~
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-uint32_t terminal_read_key() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) critical_die("read");
-    }
-
-    if (c == '\x1b') {
-        char seq[3];
-
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            } else {
-                switch(seq[1]) {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
-                }
+static uint32_t key_decoder_csi(struct key_decoder* decoder, char final) {
+    if (final == '~') {
+        switch (atoi(decoder->params)) {
+            case 200: {
+                decoder->state = DECODE_PASTE;
+                ab_reset(&t_config.paste);
+                return 0;
             }
-        } else if (seq[0] == '0') {
-            switch (seq[1]) {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
+            case 1: return HOME_KEY;
+            case 3: return DEL_KEY;
+            case 4: return END_KEY;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 7: return HOME_KEY;
+            case 8: return END_KEY;
+        }
+        return 0;
+    }
+
+    switch (final) {
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+    }
+
+    return 0;
+}
+
+/// Consumes one byte and writes the keys it completes to `keys`. Returns
+/// how many were written, at most two.
+uint32_t key_decoder_feed(struct key_decoder* decoder, char c, uint32_t* keys) {
+    switch (decoder->state) {
+        case DECODE_GROUND: {
+            if (c == '\x1b') {
+                decoder->state = DECODE_ESC;
+                return 0;
             }
+            keys[0] = (uint8_t) c;
+            return 1;
         }
+        case DECODE_ESC: {
+            if (c == '[') {
+                decoder->state = DECODE_CSI;
+                decoder->param_len = 0;
+                return 0;
+            } else if (c == 'O') {
+                decoder->state = DECODE_SS3;
+                return 0;
+            }
 
-        return '\x1b';
+            // Not a sequence, a lone escape followed by an ordinary byte
+            decoder->state = DECODE_GROUND;
+            keys[0] = '\x1b';
+            return 1 + key_decoder_feed(decoder, c, keys + 1);
+        }
+        case DECODE_CSI: {
+            if ((c >= '0' && c <= '9') || c == ';') {
+                if (decoder->param_len < KEY_DECODER_MAX_PARAMS - 1) {
+                    decoder->params[decoder->param_len++] = c;
+                }
+                return 0;
+            }
+
+            decoder->state = DECODE_GROUND;
+            decoder->params[decoder->param_len] = '\0';
+            keys[0] = key_decoder_csi(decoder, c);
+            return keys[0] ? 1 : 0;
+        }
+        case DECODE_PASTE: {
+            // Bulk input goes through key_decoder_paste
+            return 0;
+        }
+        case DECODE_SS3: {
+            decoder->state = DECODE_GROUND;
+            switch (c) {
+                case 'A': keys[0] = ARROW_UP; return 1;
+                case 'B': keys[0] = ARROW_DOWN; return 1;
+                case 'C': keys[0] = ARROW_RIGHT; return 1;
+                case 'D': keys[0] = ARROW_LEFT; return 1;
+                case 'H': keys[0] = HOME_KEY; return 1;
+                case 'F': keys[0] = END_KEY; return 1;
+            }
+            return 0;
+        }
     }
 
-    return c;
+    return 0;
+}
+
+/// Collects pasted bytes in bulk until the closing ESC[201~, which may be
+/// split across reads. Returns how many bytes of `buf` were consumed and
+/// sets `done` once the paste is complete.
+size_t key_decoder_paste(struct key_decoder* decoder, const char* buf, size_t len, uint8_t* done) {
+    struct abuf* paste = &t_config.paste;
+    size_t old_len = paste->len;
+
+    ab_append(paste, buf, len);
+    *done = 0;
+
+    size_t search_from = old_len > PASTE_END_LEN - 1 ? old_len - (PASTE_END_LEN - 1) : 0;
+    char* end = memmem(paste->b + search_from, paste->len - search_from, PASTE_END, PASTE_END_LEN);
+    if (!end) return len;
+
+    size_t payload_len = end - paste->b;
+    paste->len = payload_len;
+    decoder->state = DECODE_GROUND;
+    *done = 1;
+
+    return payload_len + PASTE_END_LEN - old_len;
+}
+
+/// Inside an escape sequence that may still be a lone escape key
+static inline uint8_t key_decoder_pending(struct key_decoder* decoder) {
+    return decoder->state == DECODE_ESC || decoder->state == DECODE_CSI || decoder->state == DECODE_SS3;
+}
+
+/// No more bytes came within ESCAPE_TIMEOUT_MS, whatever is pending was a
+/// plain escape key press
+uint32_t key_decoder_flush(struct key_decoder* decoder, uint32_t* keys) {
+    if (decoder->state == DECODE_GROUND || decoder->state == DECODE_PASTE) return 0;
+
+    decoder->state = DECODE_GROUND;
+    keys[0] = '\x1b';
+    return 1;
 }
 
 int32_t get_cursor_position(int32_t *rows, int32_t* cols) {
@@ -144,7 +338,10 @@ int32_t get_cursor_position(int32_t *rows, int32_t* cols) {
 
     if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
+    // Raw mode reads do not wait, give the terminal some time to answer
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
     while (i < sizeof(buf) -1) {
+        if (poll(&pfd, 1, 100) != 1) break;
         if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
         if (buf[i] == 'R') break;
         i++;
@@ -152,7 +349,7 @@ int32_t get_cursor_position(int32_t *rows, int32_t* cols) {
     buf[i] = '\0';
 
     if (buf[0] != '\x1b' || buf[1] != '[') return -1;
-    if (sscanf(&buf[2], "%d,%d", rows, cols) != 2) return -1;
+    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
 
     //terminal_read_key();
 
@@ -175,54 +372,184 @@ int32_t get_window_size(int32_t* rows, int32_t* cols) {
 
 /* file io */
 int32_t terminal_open(const char* filename) {
-    FILE* fp = fopen(filename, "r");
-    if (!fp) return -1;
+    PTable* table = ptable_open(filename);
+    if (!table) return -1;
 
-    fseek(fp, 0L, SEEK_END);
-    size_t filesize = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
+    // Index the whole file up front, in parallel, instead of on the
+    // first line lookup from the render loop
+    ptable_build_line_index_jobs(table, &t_config.jobs);
 
-    char* filebuffer = malloc(sizeof(char) * filesize + 1);
-    if (filebuffer == NULL) return -1;
+    t_config.ptable_buffer = table;
+    free(t_config.filename);
+    t_config.filename = strdup(filename);
 
-    size_t result = fread(filebuffer, 1, filesize, fp);
-    if (result != filesize) return -2;
+    return 0;
+}
 
-    fclose(fp);
+/* append buffer / temp buffer / pre piece table */
 
-    filebuffer[filesize] = '\0';
-    t_config.ptable_buffer = ptable_create(filebuffer);
+/// The buffer has to stay the last allocation in `arena`, growing it then
+/// always extends in place. `allocs` counts growths since the last reset.
+void ab_init(struct abuf* ab, Arena* arena, size_t capacity) {
+    ab->len = 0;
+    ab->allocs = 0;
+    ab->arena = arena;
 
-    return (int32_t) filesize;
+    ab->b = arena_alloc_nz(arena, capacity);
+    if (ab->b == NULL) critical_die("arena_alloc");
+    ab->cap = capacity;
 }
 
-/* append buffer / temp buffer / pre piece table */
-struct abuf {
-    char* b;
-    size_t len;
-};
-
-#define ABUF_INIT {NULL, 0}
+void ab_reset(struct abuf* ab) {
+    ab->len = 0;
+    ab->allocs = 0;
+}
 
 void ab_append(struct abuf *ab, const char* s, size_t len) {
-    char* new = realloc(ab->b, ab->len + len);
+    if (ab->len + len > ab->cap) {
+        size_t new_cap = max(ab->cap * 2, ab->len + len);
+        char* new = arena_resize(ab->arena, ab->b, ab->cap, new_cap);
+
+        if (new == NULL) return;
+        ab->b = new;
+        ab->cap = new_cap;
+        ab->allocs++;
+    }
 
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
-void ab_free(struct abuf* ab) {
-    free(ab->b);
+void ab_flush(struct abuf* ab) {
+    size_t written = 0;
+
+    while (written < ab->len) {
+        ssize_t result = write(STDOUT_FILENO, ab->b + written, ab->len - written);
+        if (result == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return;
+        }
+        written += result;
+    }
 }
 
+
 /* output */
 
-void terminal_draw_rows(struct abuf* ab) {
+void terminal_resize_grids() {
+    size_t cells = (size_t) t_config.screen_rows * t_config.screen_cols;
+
+    free(t_config.front.cells);
+    free(t_config.back.cells);
+    free(t_config.row_states);
+
+    t_config.front.cells = malloc(cells);
+    t_config.back.cells = malloc(cells);
+    t_config.row_states = calloc(t_config.screen_rows, sizeof(struct row_state));
+    if (!t_config.front.cells || !t_config.back.cells || !t_config.row_states) critical_die("malloc");
+
+    t_config.front.rows = t_config.back.rows = t_config.screen_rows;
+    t_config.front.cols = t_config.back.cols = t_config.screen_cols;
+    t_config.front_valid = 0;
+}
+
+/// Reads the document a span at a time, rows are cut out of the spans
+/// directly so nothing is copied into an intermediate line buffer
+struct span_cursor {
+    PTableIter iter;
+    const char* ptr;
+    const char* end;
+};
+
+static void span_cursor_seek(struct span_cursor* sc, PTable* table, size_t offset) {
+    ptable_iter_seek(&sc->iter, table, offset);
+    sc->ptr = NULL;
+    sc->end = NULL;
+}
+
+static int32_t span_cursor_fill(struct span_cursor* sc) {
+    if (sc->ptr < sc->end) return 1;
+
+    PTableSpan span;
+    if (!ptable_iter_step_span(&sc->iter, FORWARD, &span)) return 0;
+
+    sc->ptr = span.ptr;
+    sc->end = span.ptr + span.len;
+    return 1;
+}
+
+/// Renders the visible columns of the line under the cursor into `row`,
+/// expanding tabs, and leaves the cursor at the start of the next line.
+/// Past the right edge the rest of the line is skipped with memchr.
+static void terminal_render_line(char* row, struct span_cursor* sc) {
+    int32_t first = t_config.coloff;
+    int32_t last = t_config.coloff + t_config.screen_cols;
+    int32_t col = 0;
+
+    while (span_cursor_fill(sc)) {
+        if (col >= last) {
+            const char* lf = memchr(sc->ptr, '\n', sc->end - sc->ptr);
+            if (lf) {
+                sc->ptr = lf + 1;
+                return;
+            }
+            sc->ptr = sc->end;
+            continue;
+        }
+
+        char c = *sc->ptr++;
+        if (c == '\n') return;
+
+        if (c == '\t') {
+            int32_t next_stop = (col / TAB_STOP + 1) * TAB_STOP;
+            for (; col < next_stop; col++) {
+                if (col >= first && col < last) row[col - first] = ' ';
+            }
+            continue;
+        }
+
+        // Cells must be one column wide each, control bytes would move the cursor
+        if (col >= first) row[col - first] = (c >= ' ' && c != 127) ? c : '?';
+        col++;
+    }
+}
+
+void terminal_draw_rows() {
+    struct screen_grid* back = &t_config.back;
+    PTable* table = t_config.ptable_buffer;
+
+    t_config.numrows = table ? ptable_line_count(table) : 0;
+
+    // Throw away rows whose lines were edited since the last frame
+    size_t dirty_first, dirty_last;
+    if (table && ptable_take_dirty_lines(table, &dirty_first, &dirty_last)) {
+        for (int y = 0; y < back->rows; y++) {
+            struct row_state* state = &t_config.row_states[y];
+            if (state->line >= dirty_first && state->line <= dirty_last) state->valid = 0;
+        }
+    }
+
+    if (t_config.rendered_coloff != t_config.coloff) {
+        for (int y = 0; y < back->rows; y++) t_config.row_states[y].valid = 0;
+        t_config.rendered_coloff = t_config.coloff;
+    }
+
+    t_config.frame_stats.rows_rendered_last_frame = 0;
+
+    // Only seeks when a cached row broke the run of consecutive lines
+    struct span_cursor sc;
+    uint8_t cursor_in_sync = 0;
+
+    for (int y = 0; y < back->rows; y++) {
+        char* row = back->cells + (size_t) y * back->cols;
+        struct row_state* state = &t_config.row_states[y];
+        size_t filerow = y + t_config.rowoff;
+
+        if (filerow >= t_config.numrows) {
+            memset(row, ' ', back->cols);
+            state->line = ROW_LINE_NONE;
+            state->valid = 0;
 
-    for (int y = 0; y < t_config.screen_rows; y++) {
-        if (y >= t_config.numrows) {
             if (t_config.numrows == 0 && y == t_config.screen_rows / 3) {
                 char welcome[80];
                 size_t welcome_len = snprintf(welcome, sizeof(welcome),
@@ -231,77 +558,382 @@ void terminal_draw_rows(struct abuf* ab) {
                 if ((int) welcome_len > t_config.screen_cols) welcome_len = t_config.screen_cols;
                 int padding = (t_config.screen_cols - welcome_len) / 2;
                 if (padding) {
-                    ab_append(ab, "~", 1);
-                    padding--;
+                    row[0] = '~';
                 }
-                while (padding--) ab_append(ab, " ", 1);
 
-                ab_append(ab, welcome, welcome_len);
+                memcpy(row + padding, welcome, welcome_len);
             } else {
-                ab_append(ab, "~", 1);
+                row[0] = '~';
             }
 
         } else {
-            size_t len = t_config.row.size;
-            if (len > (size_t) t_config.screen_cols) len = t_config.screen_cols;
-            ab_append(ab, t_config.row.chars, len);
+            size_t line = filerow;
+            if (state->valid && state->line == line) {
+                cursor_in_sync = 0;
+                continue;
+            }
+
+            if (!cursor_in_sync) {
+                span_cursor_seek(&sc, table, ptable_line_to_offset(table, line));
+                cursor_in_sync = 1;
+            }
+
+            memset(row, ' ', back->cols);
+            terminal_render_line(row, &sc);
+            state->line = line;
+            state->valid = 1;
+            t_config.frame_stats.rows_rendered_last_frame++;
+        }
+    }
+}
+
+static size_t terminal_digits(int32_t value) {
+    size_t digits = 1;
+    while (value >= 10) {
+        value /= 10;
+        digits++;
+    }
+
+    return digits;
+}
+
+/// Emits the cheapest cursor motion to (x, y). Over a short stretch of the
+/// same row the cells already on screen are simply written out again.
+static void terminal_move_to(struct abuf* ab, int32_t x, int32_t y) {
+    int32_t cx = t_config.term_x;
+    int32_t cy = t_config.term_y;
+    char buf[32];
+
+    if (cy == y && cx == x) return;
+
+    size_t absolute_cost = x == 0 ? 3 + terminal_digits(y + 1) : 4 + terminal_digits(y + 1) + terminal_digits(x + 1);
+
+    // Start of the current or the next row
+    int32_t from_x = -1;
+    size_t prefix_cost = 0;
+    const char* prefix = NULL;
+
+    if (cy == y && cx >= 0) {
+        from_x = cx;
+        if (x < cx) {
+            from_x = 0;
+            prefix = "\r";
+            prefix_cost = 1;
         }
+    } else if (cy >= 0 && cy + 1 == y) {
+        from_x = 0;
+        prefix = "\r\n";
+        prefix_cost = 2;
+    }
+
+    if (from_x >= 0) {
+        int32_t gap = x - from_x;
+        size_t step_cost = gap == 0 ? 0 : 3 + terminal_digits(gap);
+        size_t rewrite_cost = (size_t) gap;
+        size_t relative_cost = prefix_cost + min(step_cost, rewrite_cost);
 
-        ab_append(ab, "\x1b[K", 3);
-        if (y < t_config.screen_rows -1) {
-            ab_append(ab, "\r\n", 2);
+        if (relative_cost < absolute_cost) {
+            if (prefix) ab_append(ab, prefix, prefix_cost);
+
+            if (gap > 0 && rewrite_cost <= step_cost) {
+                ab_append(ab, t_config.front.cells + (size_t) y * t_config.front.cols + from_x, gap);
+            } else if (gap > 0) {
+                snprintf(buf, sizeof(buf), "\x1b[%dC", gap);
+                ab_append(ab, buf, strlen(buf));
+            }
+
+            t_config.term_x = x;
+            t_config.term_y = y;
+            return;
         }
+    }
 
+    if (x == 0) {
+        snprintf(buf, sizeof(buf), "\x1b[%dH", y + 1);
+    } else {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    }
+    ab_append(ab, buf, strlen(buf));
+
+    t_config.term_x = x;
+    t_config.term_y = y;
+}
+
+/// Writes the cells of `back` that differ from `front` and brings `front`
+/// up to date. Runs closer than DIFF_MERGE_GAP are merged, blank row tails
+/// are cleared with a single erase to end of line.
+static uint32_t terminal_diff_rows(struct abuf* ab) {
+    struct screen_grid* front = &t_config.front;
+    struct screen_grid* back = &t_config.back;
+    uint32_t changed_runs = 0;
+
+    for (int32_t y = 0; y < back->rows; y++) {
+        char* old_row = front->cells + (size_t) y * front->cols;
+        char* new_row = back->cells + (size_t) y * back->cols;
+
+        if (memcmp(old_row, new_row, back->cols) == 0) continue;
+
+        int32_t blank_from = back->cols;
+        while (blank_from > 0 && new_row[blank_from - 1] == ' ') blank_from--;
+
+        int32_t x = 0;
+        while (x < blank_from) {
+            if (old_row[x] == new_row[x]) {
+                x++;
+                continue;
+            }
+
+            int32_t run_start = x;
+            int32_t run_end = x + 1;
+            for (int32_t scan = run_end; scan < blank_from && scan - run_end <= DIFF_MERGE_GAP; scan++) {
+                if (old_row[scan] != new_row[scan]) run_end = scan + 1;
+            }
+
+            terminal_move_to(ab, run_start, y);
+            ab_append(ab, new_row + run_start, run_end - run_start);
+            memcpy(old_row + run_start, new_row + run_start, run_end - run_start);
+            changed_runs++;
+
+            t_config.term_x = run_end < back->cols ? run_end : -1;
+            if (t_config.term_x < 0) t_config.term_y = -1;
+            x = run_end;
+        }
+
+        if (memcmp(old_row + blank_from, new_row + blank_from, back->cols - blank_from) != 0) {
+            terminal_move_to(ab, blank_from, y);
+            ab_append(ab, "\x1b[K", 3);
+            memset(old_row + blank_from, ' ', back->cols - blank_from);
+            changed_runs++;
+        }
+    }
+
+    return changed_runs;
+}
+
+/// Keeps the cursor inside the viewport
+void terminal_scroll() {
+    t_config.c_params.rx = 0;
+    if (t_config.ptable_buffer && t_config.c_params.x > 0) {
+        PTable* table = t_config.ptable_buffer;
+        PTableIter iter;
+        char c;
+
+        ptable_iter_seek(&iter, table, ptable_line_to_offset(table, t_config.c_params.y));
+        for (int i = 0; i < t_config.c_params.x && ptable_iter_step_byte(&iter, FORWARD, &c); i++) {
+            if (c == '\t') {
+                t_config.c_params.rx = (t_config.c_params.rx / TAB_STOP + 1) * TAB_STOP;
+            } else {
+                t_config.c_params.rx++;
+            }
+        }
+    }
+
+    if (t_config.c_params.y < t_config.rowoff) {
+        t_config.rowoff = t_config.c_params.y;
+    }
+    if (t_config.c_params.y >= t_config.rowoff + t_config.screen_rows) {
+        t_config.rowoff = t_config.c_params.y - t_config.screen_rows + 1;
+    }
+    if (t_config.c_params.rx < t_config.coloff) {
+        t_config.coloff = t_config.c_params.rx;
+    }
+    if (t_config.c_params.rx >= t_config.coloff + t_config.screen_cols) {
+        t_config.coloff = t_config.c_params.rx - t_config.screen_cols + 1;
     }
 }
 
 void terminal_refresh_screen() {
-    struct abuf ab = ABUF_INIT;
+    // Sized for a full redraw so a frame normally needs no growth at all.
+    // The scratch pages stay committed, only the offset moves back.
+    ArenaTemp scratch = scratch_begin(NULL, 0);
+    size_t cells = (size_t) t_config.screen_rows * t_config.screen_cols;
+    struct abuf frame;
+    struct abuf* ab = &frame;
+    ab_init(ab, scratch.arena, cells * ABUF_BYTES_PER_CELL + ABUF_FRAME_SLACK);
+
+    terminal_scroll();
+
+    terminal_draw_rows();
+
+    // First frame or after a resize, nothing on screen can be trusted
+    if (!t_config.front_valid) {
+        ab_append(ab, "\x1b[2J\x1b[H", 7);
+        memset(t_config.front.cells, ' ', (size_t) t_config.front.rows * t_config.front.cols);
+        t_config.term_x = 0;
+        t_config.term_y = 0;
+        t_config.front_valid = 1;
+    }
 
-    ab_append(&ab, "\x1b[?25l", 6);
-    ab_append(&ab, "\x1b[H", 3);
+    ab_append(ab, "\x1b[?25l", 6);
+    size_t hidden_len = ab->len;
 
-    terminal_draw_rows(&ab);
+    uint32_t changed_runs = terminal_diff_rows(ab);
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", t_config.c_params.y + 1, t_config.c_params.x + 1);
-    ab_append(&ab, buf, strlen(buf));
-    ab_append(&ab, "\x1b[?25h", 6);
+    if (changed_runs == 0) {
+        // Only the cursor may have moved, no need to hide it
+        ab->len = hidden_len - 6;
+    }
+
+    terminal_move_to(ab, t_config.c_params.rx - t_config.coloff, (int32_t) (t_config.c_params.y - t_config.rowoff));
+    if (changed_runs > 0) ab_append(ab, "\x1b[?25h", 6);
+
+    ab_flush(ab);
 
-    write(STDOUT_FILENO, ab.b, ab.len);
+    struct frame_stats* stats = &t_config.frame_stats;
+    stats->frames++;
+    stats->allocs_last_frame = ab->allocs;
+    stats->allocs_total += ab->allocs;
+    stats->bytes_last_frame = ab->len;
 
-    ab_free(&ab);
+    scratch_end(scratch);
+}
+
+/* editing */
+
+static size_t terminal_line_count() {
+    return t_config.ptable_buffer ? ptable_line_count(t_config.ptable_buffer) : 0;
+}
+
+/// Length of the line in bytes, without its line feed. Columns are int,
+/// longer lines are cut short at INT32_MAX.
+static int32_t terminal_line_length(size_t line) {
+    PTable* table = t_config.ptable_buffer;
+    if (!table || line >= terminal_line_count()) return 0;
+
+    size_t start = ptable_line_to_offset(table, line);
+    size_t end = ptable_line_to_offset(table, line + 1);
+    if (line + 1 < ptable_line_count(table)) end--;
+
+    return (int32_t) min(end - start, (size_t) INT32_MAX);
+}
+
+static size_t terminal_cursor_offset() {
+    PTable* table = t_config.ptable_buffer;
+    size_t start = ptable_line_to_offset(table, t_config.c_params.y);
+    int32_t x = min(t_config.c_params.x, terminal_line_length(t_config.c_params.y));
+
+    return start + (size_t) x;
+}
+
+static void terminal_cursor_to_offset(size_t offset) {
+    size_t line, column;
+    ptable_offset_to_line(t_config.ptable_buffer, offset, &line, &column);
+
+    t_config.c_params.y = line;
+    t_config.c_params.x = (int) column;
+}
+
+void terminal_insert_text(const char* text) {
+    if (!t_config.ptable_buffer) return;
+
+    size_t offset = terminal_cursor_offset();
+    if (ptable_insert(t_config.ptable_buffer, offset, text) != 0) return;
+    terminal_cursor_to_offset(offset + strlen(text));
+    lua_hooks_push(&t_config.hooks, LUA_EVENT_EDIT, 0, offset, strlen(text));
+}
+
+/// Inserts the collected paste as one edit. Terminals send line breaks
+/// in pastes as carriage returns, they become line feeds here.
+void terminal_insert_paste() {
+    struct abuf* paste = &t_config.paste;
+    if (!t_config.ptable_buffer || paste->len == 0) return;
+
+    size_t len = 0;
+    for (size_t i = 0; i < paste->len; i++) {
+        char c = paste->b[i];
+        if (c == '\r') {
+            if (i + 1 < paste->len && paste->b[i + 1] == '\n') continue;
+            c = '\n';
+        }
+        paste->b[len++] = c;
+    }
+
+    size_t offset = terminal_cursor_offset();
+    if (ptable_insert_len(t_config.ptable_buffer, offset, paste->b, len) != 0) return;
+    terminal_cursor_to_offset(offset + len);
+    lua_hooks_push(&t_config.hooks, LUA_EVENT_EDIT, 0, offset, len);
+}
+
+void terminal_delete_char(uint32_t key) {
+    if (!t_config.ptable_buffer) return;
+
+    size_t offset = terminal_cursor_offset();
+    if (key == DEL_KEY) {
+        if (offset >= ptable_get_length(t_config.ptable_buffer)) return;
+        ptable_delete(t_config.ptable_buffer, offset, 1);
+    } else if (offset > 0) {
+        ptable_delete(t_config.ptable_buffer, --offset, 1);
+        terminal_cursor_to_offset(offset);
+    } else {
+        return;
+    }
+
+    lua_hooks_push(&t_config.hooks, LUA_EVENT_EDIT, 0, offset, -1);
+}
+
+/// Steps the history back (or forward on redo) and puts the cursor where
+/// the step's edit happened
+void terminal_undo(uint8_t redo) {
+    if (!t_config.ptable_buffer) return;
+
+    size_t offset = 0;
+    int32_t stepped = redo ? ptable_redo(t_config.ptable_buffer, &offset)
+                           : ptable_undo(t_config.ptable_buffer, &offset);
+    if (stepped) terminal_cursor_to_offset(min(offset, ptable_get_length(t_config.ptable_buffer)));
 }
 
 /* input */
 
 void terminal_move_cursor(uint32_t key) {
+    int32_t line_len = terminal_line_length(t_config.c_params.y);
+
     switch (key) {
         case ARROW_LEFT:
-            if (t_config.c_params.x != 0) t_config.c_params.x--;
+            if (t_config.c_params.x != 0) {
+                t_config.c_params.x--;
+            } else if (t_config.c_params.y > 0) {
+                t_config.c_params.y--;
+                t_config.c_params.x = terminal_line_length(t_config.c_params.y);
+            }
             break;
         case ARROW_RIGHT:
-            if (t_config.c_params.x != t_config.screen_cols - 1) t_config.c_params.x++;
+            if (t_config.c_params.x < line_len) {
+                t_config.c_params.x++;
+            } else if (t_config.c_params.y + 1 < terminal_line_count()) {
+                t_config.c_params.y++;
+                t_config.c_params.x = 0;
+            }
             break;
         case ARROW_DOWN:
-            if (t_config.c_params.y != t_config.screen_rows - 1) t_config.c_params.y++;
+            if (t_config.c_params.y + 1 < terminal_line_count()) t_config.c_params.y++;
             break;
         case ARROW_UP:
             if (t_config.c_params.y != 0) t_config.c_params.y--;
             break;
     }
+
+    line_len = terminal_line_length(t_config.c_params.y);
+    if (t_config.c_params.x > line_len) t_config.c_params.x = line_len;
 }
 
-uint32_t terminal_process_keypress() {
-    uint32_t c = terminal_read_key();
+uint32_t terminal_process_key(uint32_t c) {
     switch (c) {
         case CTRL_KEY('q'):
             return 0;
+        case CTRL_KEY('s'):
+            terminal_save();
+            break;
+        case CTRL_KEY('z'):
+            terminal_undo(0);
+            break;
+        case CTRL_KEY('y'):
+            terminal_undo(1);
+            break;
         case HOME_KEY:
             t_config.c_params.x = 0;
             break;
         case END_KEY:
-            t_config.c_params.x = t_config.screen_cols - 1;
+            t_config.c_params.x = terminal_line_length(t_config.c_params.y);
             break;
         case ARROW_LEFT:
         case ARROW_RIGHT:
@@ -317,6 +949,23 @@ uint32_t terminal_process_keypress() {
                 terminal_move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
             }
         } break;
+        case '\r':
+            terminal_insert_text("\n");
+            break;
+        case PASTE_KEY:
+            terminal_insert_paste();
+            break;
+        case 127:
+        case CTRL_KEY('h'):
+        case DEL_KEY:
+            terminal_delete_char(c);
+            break;
+        default:
+            if (c == '\t' || (c >= ' ' && c < 127)) {
+                char text[2] = { (char) c, '\0' };
+                terminal_insert_text(text);
+            }
+            break;
     }
 
     return 1;
@@ -327,31 +976,299 @@ uint32_t terminal_process_keypress() {
 void terminal_init() {
     t_config.c_params.x = 0;
     t_config.c_params.y = 0;
+    t_config.c_params.rx = 0;
     t_config.numrows = 0;
+    t_config.rowoff = 0;
+    t_config.coloff = 0;
+    t_config.rendered_coloff = 0;
     t_config.ptable_buffer = NULL;
+    t_config.filename = NULL;
+    t_config.decoder.state = DECODE_GROUND;
+    t_config.escape_deadline_ms = 0;
+    t_config.winch_fd = -1;
+    t_config.watch_fd = -1;
 
     t_config.add_buffer.elems = malloc(sizeof(char) * EDITOR_BUFFER_MAX_SIZE);
     t_config.add_buffer.len = EDITOR_BUFFER_MAX_SIZE;
 
     if (get_window_size(&t_config.screen_rows, &t_config.screen_cols) == -1) critical_die("get_window_size");
+
+    terminal_resize_grids();
+
+    // A paste spans reads and frames, it cannot live in scratch
+    if (arena_reserve(&t_config.paste_arena, PASTE_RESERVE) != 0) critical_die("arena_reserve");
+    ab_init(&t_config.paste, &t_config.paste_arena, PASTE_INIT_SIZE);
+    memset(&t_config.frame_stats, 0, sizeof(struct frame_stats));
+
+    if (job_pool_init(&t_config.jobs, 0) != 0) critical_die("job_pool_init");
+}
+
+
+/* Event handling */
+
+static uint64_t terminal_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// What a frame shows besides the document text
+struct view_state {
+    struct cursor_params cursor;
+    size_t rowoff;
+    int32_t coloff;
+};
+
+static struct view_state terminal_view_state() {
+    struct view_state view = { t_config.c_params, t_config.rowoff, t_config.coloff };
+    return view;
+}
+
+/// Whether something since `before` needs a frame: an edit to the document
+/// or a moved cursor or viewport
+static uint8_t terminal_view_changed(struct view_state* before) {
+    if (t_config.ptable_buffer && ptable_has_dirty_lines(t_config.ptable_buffer)) return 1;
+
+    return before->cursor.x != t_config.c_params.x || before->cursor.y != t_config.c_params.y ||
+           before->rowoff != t_config.rowoff || before->coloff != t_config.coloff;
+}
+
+static void terminal_dispatch_keys(uint32_t* keys, uint32_t count) {
+    for (uint32_t k = 0; k < count && t_config.running; k++) {
+        lua_hooks_push(&t_config.hooks, LUA_EVENT_KEY, keys[k], 0, 0);
+        if (!terminal_process_key(keys[k])) t_config.running = 0;
+        t_config.frame_stats.keys++;
+        t_config.needs_redraw = 1;
+    }
+}
+
+static inline void terminal_begin_edits() {
+    if (t_config.ptable_buffer) ptable_begin_group(t_config.ptable_buffer);
+}
+
+/// Closes the input batch and hands a fragmented table to the job pool
+/// for compaction
+static inline void terminal_end_edits() {
+    PTable* table = t_config.ptable_buffer;
+    if (!table) return;
+
+    ptable_end_group(table);
+    if (ptable_compaction_wanted(table) & PTABLE_COMPACT_MERGE) ptable_compact_background(table, &t_config.jobs);
+}
+
+/// Drains everything the terminal has sent in one read, a burst of typing
+/// or key repeat becomes a single batch and a single redraw
+static void terminal_on_input(EventLoop* loop, int fd, uint32_t events, void* user) {
+    unused(loop);
+    unused(events);
+    unused(user);
+
+    char buf[INPUT_READ_SIZE];
+    ssize_t nread = read(fd, buf, sizeof(buf));
+
+    // End of input or a hung up terminal (EPOLLHUP comes in as a read),
+    // epoll would keep reporting the descriptor and the loop would spin
+    if (nread == 0 || (nread == -1 && errno == EIO)) {
+        t_config.running = 0;
+        return;
+    }
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) critical_die("read");
+
+    // Everything in one read undoes as one step
+    terminal_begin_edits();
+
+    uint32_t keys[2];
+    for (ssize_t i = 0; i < nread && t_config.running; i++) {
+        if (t_config.decoder.state == DECODE_PASTE) {
+            uint8_t done = 0;
+            i += key_decoder_paste(&t_config.decoder, buf + i, nread - i, &done) - 1;
+            if (done) {
+                keys[0] = PASTE_KEY;
+                terminal_dispatch_keys(keys, 1);
+            }
+            continue;
+        }
+
+        uint32_t count = key_decoder_feed(&t_config.decoder, buf[i], keys);
+        terminal_dispatch_keys(keys, count);
+    }
+
+    // Every read restarts the wait, the sequence is still coming in
+    t_config.escape_deadline_ms = key_decoder_pending(&t_config.decoder) ? terminal_now_ms() + ESCAPE_TIMEOUT_MS : 0;
+
+    terminal_end_edits();
+}
+
+static void terminal_on_resize(EventLoop* loop, int fd, uint32_t events, void* user) {
+    unused(loop);
+    unused(events);
+    unused(user);
+
+    event_signal_drain(fd);
+
+    int32_t rows, cols;
+    if (get_window_size(&rows, &cols) == -1) return;
+    if (rows == t_config.screen_rows && cols == t_config.screen_cols) return;
+
+    t_config.screen_rows = rows;
+    t_config.screen_cols = cols;
+    terminal_resize_grids();
+    lua_hooks_push(&t_config.hooks, LUA_EVENT_RESIZE, 0, rows, cols);
+    t_config.needs_redraw = 1;
 }
 
+static void terminal_on_file_change(EventLoop* loop, int fd, uint32_t events, void* user) {
+    unused(loop);
+    unused(events);
+    unused(user);
+
+    event_watch_drain(fd);
+
+    // The document must not keep following the file from here on
+    if (t_config.ptable_buffer) ptable_detach_original(t_config.ptable_buffer);
+    t_config.file_changed = 1;
+    t_config.needs_redraw = 1;
+}
+
+PTable* terminal_table() {
+    return t_config.ptable_buffer;
+}
+
+/// Writes the document back to its file. The save replaces the file with
+/// a new inode, so the watch is moved over to it and our own write is not
+/// reported as an outside change.
+void terminal_save() {
+    if (!t_config.ptable_buffer || !t_config.filename) return;
+    if (ptable_save(t_config.ptable_buffer, t_config.filename) != 0) return;
+
+    if (t_config.watch_fd != -1) {
+        event_loop_remove(&t_config.events, t_config.watch_fd);
+        close(t_config.watch_fd);
+    }
+
+    t_config.watch_fd = event_watch_file(t_config.filename);
+    if (t_config.watch_fd != -1) {
+        event_loop_add(&t_config.events, t_config.watch_fd, EVENT_READ, terminal_on_file_change, NULL);
+    }
+
+    t_config.file_changed = 0;
+    lua_hooks_push(&t_config.hooks, LUA_EVENT_SAVE, 0, 0, 0);
+}
+
+static void terminal_events_init() {
+    if (event_loop_init(&t_config.events) != 0) critical_die("event_loop_init");
+    if (event_loop_add(&t_config.events, STDIN_FILENO, EVENT_READ, terminal_on_input, NULL) != 0) critical_die("event_loop_add");
+
+    // Background work reports back through the same loop
+    if (job_pool_attach(&t_config.jobs, &t_config.events) != 0) critical_die("job_pool_attach");
+
+    t_config.winch_fd = event_signal_fd(SIGWINCH);
+    if (t_config.winch_fd != -1) {
+        event_loop_add(&t_config.events, t_config.winch_fd, EVENT_READ, terminal_on_resize, NULL);
+    }
+
+    t_config.watch_fd = t_config.filename ? event_watch_file(t_config.filename) : -1;
+    if (t_config.watch_fd != -1) {
+        event_loop_add(&t_config.events, t_config.watch_fd, EVENT_READ, terminal_on_file_change, NULL);
+    }
+}
+
+static void terminal_events_release() {
+    if (t_config.winch_fd != -1) close(t_config.winch_fd);
+    if (t_config.watch_fd != -1) close(t_config.watch_fd);
+    job_pool_release(&t_config.jobs);
+    event_loop_release(&t_config.events);
+}
 
 /* Main Loop */
 int32_t terminal_loop(lua_State* L) {
-    unused(L);
-
     enable_raw_mode();
     terminal_init();
     if (terminal_open("test.lua") < 0) return -1;
+    terminal_events_init();
+
+    // Without the hooks module the editor runs on, pushes are then ignored
+    if (L) {
+        lua_hooks_init(&t_config.hooks, L);
+        lua_sched_init(&t_config.sched, L, &t_config.jobs);
+        // No worker thread starts before a plugin's first workers.call,
+        // which also loads the plugin's module on the workers
+        if (lua_workers_init(&t_config.workers, L, &t_config.sched, 0, NULL, terminal_table) == 0) {
+            lua_workers_attach(&t_config.workers, &t_config.events);
+        }
+    }
 
-    do {
-        terminal_refresh_screen();
-    } while (terminal_process_keypress());
+    t_config.running = 1;
+    terminal_refresh_screen();
+
+    while (t_config.running) {
+        // Sleep until something happens, a half read escape sequence only
+        // waits long enough to tell it apart from a lone escape key
+        int32_t timeout = -1;
+        if (t_config.escape_deadline_ms) {
+            uint64_t now = terminal_now_ms();
+            timeout = now < t_config.escape_deadline_ms ? (int32_t) (t_config.escape_deadline_ms - now) : 0;
+        }
+        int32_t tasks = lua_sched_timeout(&t_config.sched);
+        if (tasks != -1 && (timeout == -1 || tasks < timeout)) timeout = tasks;
+        if (event_loop_wait(&t_config.events, timeout) == -1) critical_die("epoll_wait");
+
+        // Task wakeups end the wait early too, only the deadline itself
+        // turns the pending bytes into keys
+        if (t_config.escape_deadline_ms && terminal_now_ms() >= t_config.escape_deadline_ms) {
+            uint32_t keys[2];
+            t_config.escape_deadline_ms = 0;
+            terminal_dispatch_keys(keys, key_decoder_flush(&t_config.decoder, keys));
+        }
+
+        if (t_config.running && t_config.needs_redraw) {
+            // Everything queued since the last frame goes to Lua in one call
+            lua_hooks_push(&t_config.hooks, LUA_EVENT_FRAME, 0, t_config.frame_stats.frames, 0);
+            lua_hooks_flush(&t_config.hooks);
+        }
+
+        // Plugin tasks get a bounded slice, input above and the frame below
+        // never wait on them longer than the budget. A task busy with its
+        // own work does not cost a frame on every pass.
+        if (t_config.running) {
+            struct view_state before = terminal_view_state();
+            if (lua_sched_run(&t_config.sched) > 0 && terminal_view_changed(&before)) t_config.needs_redraw = 1;
+        }
+
+        if (t_config.running && t_config.needs_redraw) {
+            terminal_refresh_screen();
+            t_config.needs_redraw = 0;
+        }
+    }
 
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
 
+#ifdef DEBUG
+    struct frame_stats* stats = &t_config.frame_stats;
+    fprintf(stderr, "Frames: %llu Keys: %llu Frame buffer growths: %llu (last frame %u, %zu bytes, %u rows rendered)\n",
+            (unsigned long long) stats->frames, (unsigned long long) stats->keys,
+            (unsigned long long) stats->allocs_total,
+            stats->allocs_last_frame, stats->bytes_last_frame, stats->rows_rendered_last_frame);
+    fprintf(stderr, "Lua hooks: %llu events in %llu calls, %.0f ns per event\n",
+            (unsigned long long) t_config.hooks.stats.events, (unsigned long long) t_config.hooks.stats.flushes,
+            lua_hooks_ns_per_event(&t_config.hooks));
+    fprintf(stderr, "Lua tasks: %llu resumes, %llu preempted, longest run %.2f ms\n",
+            (unsigned long long) t_config.sched.stats.resumes, (unsigned long long) t_config.sched.stats.preempted,
+            t_config.sched.stats.max_run_ns / 1e6);
+    fprintf(stderr, "Lua workers: %llu calls, %llu failed\n",
+            (unsigned long long) t_config.workers.stats.calls, (unsigned long long) t_config.workers.stats.errors);
+#endif
+
+    lua_hooks_release(&t_config.hooks);
+    lua_workers_release(&t_config.workers);
+    lua_sched_release(&t_config.sched);
+    terminal_events_release();
+    arena_release(&t_config.paste_arena);
+    arena_scratch_release();
+    free(t_config.front.cells);
+    free(t_config.back.cells);
+    free(t_config.row_states);
 
     return 0;
 }
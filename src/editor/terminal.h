@@ -4,6 +4,11 @@
 #include <stdint.h>
 #include <lua.h>
 
+#include "../ptable/ptable.h"
+
 int32_t terminal_loop(lua_State* L);
+/// Table of the open document, NULL before one is opened. Exported for
+/// scripts going through the FFI.
+PTable* terminal_table();
 
 #endif // TERMINAL_H_
@@ -0,0 +1,294 @@
+#include "cache.h"
+
+#include "../base/base.h"
+
+#include <lauxlib.h>
+#include <luajit.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LUA_CACHE_REGISTRY_KEY "lumerie.cache"
+#define LUA_CACHE_INIT_DUMP_SIZE (16 * 1024)
+
+/// Followed by the source path (path_len bytes) and then the bytecode
+struct cache_header {
+    char magic[4];
+    uint32_t version;
+    // Bytecode differs between LuaJIT releases and GC64 builds
+    uint32_t luajit_version;
+    uint32_t pointer_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint32_t path_len;
+    uint32_t reserved;
+};
+
+struct dump_buf {
+    char* b;
+    size_t len;
+    size_t cap;
+    uint8_t failed;
+};
+
+static int32_t cache_mkdirs(char* path) {
+    for (char* p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        int32_t result = mkdir(path, 0700);
+        *p = '/';
+        if (result != 0 && errno != EEXIST) return -1;
+    }
+
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+int32_t lua_cache_dir(char* out, size_t len) {
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    int32_t written;
+
+    if (xdg && *xdg) {
+        written = snprintf(out, len, "%s/%s", xdg, LUA_CACHE_SUBDIR);
+    } else if (home && *home) {
+        written = snprintf(out, len, "%s/.cache/%s", home, LUA_CACHE_SUBDIR);
+    } else {
+        return -1;
+    }
+
+    if (written < 0 || (size_t) written >= len) return -1;
+    return cache_mkdirs(out);
+}
+
+LuaCache* lua_cache_get(lua_State* L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_CACHE_REGISTRY_KEY);
+    LuaCache* cache = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return cache;
+}
+
+/* Cache files */
+
+/// FNV-1a, only has to spread paths over file names
+static uint64_t cache_hash(const char* s) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *s; s++) {
+        hash ^= (uint8_t) *s;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void cache_header_init(struct cache_header* header, const struct stat* source, size_t path_len) {
+    memset(header, 0, sizeof(struct cache_header));
+    memcpy(header->magic, LUA_CACHE_MAGIC, 4);
+    header->version = LUA_CACHE_VERSION;
+    header->luajit_version = LUAJIT_VERSION_NUM;
+    header->pointer_size = sizeof(void*);
+    header->mtime_sec = source->st_mtim.tv_sec;
+    header->mtime_nsec = source->st_mtim.tv_nsec;
+    header->size = source->st_size;
+    header->path_len = path_len;
+}
+
+/// Pushes the cached chunk and returns 0, or returns -1 with the stack
+/// untouched when there is no valid entry
+static int32_t cache_read(lua_State* L, const char* cache_path, const char* path, const struct stat* source) {
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        return -1;
+    }
+
+    const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    size_t path_len = strlen(path);
+    struct cache_header expected;
+    cache_header_init(&expected, source, path_len);
+
+    int32_t result = -1;
+    size_t header_len = sizeof(struct cache_header) + path_len;
+    if ((size_t) st.st_size > header_len &&
+        memcmp(data, &expected, sizeof(struct cache_header)) == 0 &&
+        memcmp(data + sizeof(struct cache_header), path, path_len) == 0) {
+
+        // Chunk names keep pointing at the source for error messages
+        lua_pushfstring(L, "@%s", path);
+        result = luaL_loadbuffer(L, data + header_len, st.st_size - header_len, lua_tostring(L, -1));
+        // Leaves the chunk (or the error) where the name was
+        lua_remove(L, -2);
+        if (result != 0) {
+            lua_pop(L, 1);
+            result = -1;
+        }
+    }
+
+    munmap((void*) data, st.st_size);
+    return result;
+}
+
+static int cache_dump_writer(lua_State* L, const void* p, size_t size, void* user) {
+    unused(L);
+    struct dump_buf* buf = user;
+
+    if (buf->len + size > buf->cap) {
+        size_t new_cap = buf->cap ? buf->cap * 2 : LUA_CACHE_INIT_DUMP_SIZE;
+        while (new_cap < buf->len + size) new_cap *= 2;
+
+        char* b = realloc(buf->b, new_cap);
+        if (!b) {
+            buf->failed = 1;
+            return 1;
+        }
+        buf->b = b;
+        buf->cap = new_cap;
+    }
+
+    memcpy(buf->b + buf->len, p, size);
+    buf->len += size;
+    return 0;
+}
+
+static int32_t cache_write_full(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/// Dumps the chunk on top of the stack. Best effort, a failed write only
+/// costs the next start a parse.
+static void cache_write(lua_State* L, const char* cache_path, const char* path, const struct stat* source) {
+    struct dump_buf buf = {0};
+    if (lua_dump(L, cache_dump_writer, &buf) != 0 || buf.failed) {
+        free(buf.b);
+        return;
+    }
+
+    // Written aside and renamed, readers never see half a file
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", cache_path) >= (int) sizeof(tmp_path)) {
+        free(buf.b);
+        return;
+    }
+
+    int fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        free(buf.b);
+        return;
+    }
+
+    size_t path_len = strlen(path);
+    struct cache_header header;
+    cache_header_init(&header, source, path_len);
+
+    int32_t ok = cache_write_full(fd, &header, sizeof(header)) == 0 &&
+                 cache_write_full(fd, path, path_len) == 0 &&
+                 cache_write_full(fd, buf.b, buf.len) == 0;
+    close(fd);
+    free(buf.b);
+
+    if (!ok || rename(tmp_path, cache_path) != 0) unlink(tmp_path);
+}
+
+int32_t lua_cache_load(lua_State* L, const char* path) {
+    LuaCache* cache = lua_cache_get(L);
+    if (!cache) return luaL_loadfile(L, path);
+
+    char real[PATH_MAX];
+    struct stat source;
+    if (!realpath(path, real) || stat(real, &source) != 0) return luaL_loadfile(L, path);
+
+    char cache_path[PATH_MAX];
+    int32_t written = snprintf(cache_path, sizeof(cache_path), "%s/%016llx.lbc",
+                               cache->dir, (unsigned long long) cache_hash(real));
+    if (written < 0 || (size_t) written >= sizeof(cache_path)) return luaL_loadfile(L, path);
+
+    if (cache_read(L, cache_path, real, &source) == 0) {
+        cache->hits++;
+        return 0;
+    }
+
+    cache->misses++;
+    int32_t result = luaL_loadfile(L, path);
+    if (result == 0) cache_write(L, cache_path, real, &source);
+
+    return result;
+}
+
+/* Loader */
+
+/// package.loaders entry: returns the chunk for `name`, or nothing when
+/// there is no such file. The source loader right after it looks in the
+/// same places and reports them, saying it twice would double the list.
+static int cache_loader(lua_State* L) {
+    const char* name = luaL_checkstring(L, 1);
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchpath");
+    if (!lua_isfunction(L, -1)) {
+        lua_pushliteral(L, "\n\tno package.searchpath for the bytecode cache");
+        return 1;
+    }
+
+    lua_pushstring(L, name);
+    lua_getfield(L, -3, "path");
+    lua_call(L, 2, 2);
+    if (lua_isnil(L, -2)) return 0;
+
+    const char* path = lua_tostring(L, -2);
+    if (lua_cache_load(L, path) != 0) {
+        return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", name, path, lua_tostring(L, -1));
+    }
+
+    return 1;
+}
+
+int32_t lua_cache_install(lua_State* L, const char* dir) {
+    if (strlen(dir) >= PATH_MAX) return -1;
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaders");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        error_print("package.loaders missing, bytecode cache disabled");
+        return -1;
+    }
+
+    LuaCache* cache = lua_newuserdata(L, sizeof(LuaCache));
+    memset(cache, 0, sizeof(LuaCache));
+    strcpy(cache->dir, dir);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_CACHE_REGISTRY_KEY);
+
+    // Slot 1 is the preload loader, the cache goes ahead of the source one
+    int32_t count = lua_objlen(L, -1);
+    for (int32_t i = count; i >= 2; i--) {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushcfunction(L, cache_loader);
+    lua_rawseti(L, -2, 2);
+
+    lua_pop(L, 2);
+    return 0;
+}
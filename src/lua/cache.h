@@ -0,0 +1,43 @@
+#ifndef LUA_CACHE_H_
+#define LUA_CACHE_H_
+
+#include <lua.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#define LUA_CACHE_MAGIC "LMBC"
+#define LUA_CACHE_VERSION 1
+#define LUA_CACHE_SUBDIR "lumerie/lua"
+
+/// Bytecode cache
+/// --------------
+///
+/// Scripts are compiled once and the bytecode (lua_dump) is kept in a
+/// cache directory, one file per script named after a hash of its real
+/// path. A header records the path, mtime, size and the LuaJIT build, a
+/// cached chunk is only used while all of them still match. Hits are
+/// mapped and handed to luaL_loadbuffer, nothing is parsed.
+///
+/// LuaJIT follows Lua 5.1, modules are found through package.loaders. The
+/// cache loader goes in right before the source loader and resolves names
+/// with package.searchpath, so package.path keeps working as before.
+
+typedef struct lua_cache {
+    char dir[PATH_MAX];
+    uint32_t hits;
+    uint32_t misses;
+} LuaCache;
+
+/// $XDG_CACHE_HOME/lumerie/lua, or ~/.cache/lumerie/lua, created when
+/// missing. Returns -1 when there is no usable directory.
+int32_t lua_cache_dir(char* out, size_t len);
+/// Puts the cache loader into package.loaders. The state keeps its own
+/// LuaCache, see lua_cache_get.
+int32_t lua_cache_install(lua_State* L, const char* dir);
+/// luaL_loadfile through the cache, plain luaL_loadfile when the state has
+/// no cache installed. Same results as luaL_loadfile.
+int32_t lua_cache_load(lua_State* L, const char* path);
+LuaCache* lua_cache_get(lua_State* L);
+
+#endif // LUA_CACHE_H_
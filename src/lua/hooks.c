@@ -0,0 +1,115 @@
+#include "hooks.h"
+
+#include "../base/base.h"
+
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t hooks_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int32_t lua_hooks_init(LuaHooks* hooks, lua_State* L) {
+    memset(hooks, 0, sizeof(LuaHooks));
+    hooks->dispatch_ref = LUA_NOREF;
+    hooks->handlers_ref = LUA_NOREF;
+
+    hooks->events = malloc(sizeof(LuaEvent) * LUA_HOOKS_QUEUE_SIZE);
+    if (!hooks->events) {
+        perror("Failed to allocate event queue");
+        return -1;
+    }
+
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "hooks");
+    if (lua_pcall(L, 1, 1, 0) != 0) {
+        fprintf(stderr, "Error loading hooks: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        lua_hooks_release(hooks);
+        return -1;
+    }
+
+    lua_getfield(L, -1, "dispatch");
+    lua_getfield(L, -2, "handlers");
+    if (!lua_isfunction(L, -2) || !lua_istable(L, -1)) {
+        error_print("hooks module lacks dispatch or handlers");
+        lua_pop(L, 3);
+        lua_hooks_release(hooks);
+        return -1;
+    }
+
+    // luaL_ref pops, handlers first
+    hooks->handlers_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    hooks->dispatch_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+
+    hooks->L = L;
+    return 0;
+}
+
+void lua_hooks_release(LuaHooks* hooks) {
+    if (hooks->L) {
+        luaL_unref(hooks->L, LUA_REGISTRYINDEX, hooks->dispatch_ref);
+        luaL_unref(hooks->L, LUA_REGISTRYINDEX, hooks->handlers_ref);
+    }
+
+    free(hooks->events);
+    hooks->events = NULL;
+    hooks->L = NULL;
+}
+
+void lua_hooks_push(LuaHooks* hooks, LuaEventType type, uint32_t key, double a, double b) {
+    if (!hooks->L) return;
+    if (hooks->tail - hooks->head == LUA_HOOKS_QUEUE_SIZE) lua_hooks_flush(hooks);
+
+    LuaEvent* event = &hooks->events[hooks->tail & LUA_HOOKS_QUEUE_MASK];
+    event->type = type;
+    event->key = key;
+    event->a = a;
+    event->b = b;
+    hooks->tail++;
+}
+
+/// The queued range may wrap around the ring, the dispatcher gets it as
+/// two runs so nothing is copied
+int32_t lua_hooks_flush(LuaHooks* hooks) {
+    uint32_t count = hooks->tail - hooks->head;
+    if (!hooks->L || count == 0) return 0;
+
+    lua_State* L = hooks->L;
+    uint32_t first = hooks->head & LUA_HOOKS_QUEUE_MASK;
+    uint32_t first_count = min(count, LUA_HOOKS_QUEUE_SIZE - first);
+    uint64_t start = hooks_now_ns();
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, hooks->dispatch_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, hooks->handlers_ref);
+    lua_pushlightuserdata(L, &hooks->events[first]);
+    lua_pushinteger(L, first_count);
+    lua_pushlightuserdata(L, hooks->events);
+    lua_pushinteger(L, count - first_count);
+
+    int32_t result = lua_pcall(L, 5, 0, 0);
+    hooks->head = hooks->tail;
+
+    if (result != 0) {
+        fprintf(stderr, "Error in event hooks: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return -1;
+    }
+
+    hooks->stats.flushes++;
+    hooks->stats.events += count;
+    hooks->stats.ns += hooks_now_ns() - start;
+
+    return count;
+}
+
+double lua_hooks_ns_per_event(LuaHooks* hooks) {
+    if (hooks->stats.events == 0) return 0.0;
+    return (double) hooks->stats.ns / hooks->stats.events;
+}
@@ -0,0 +1,75 @@
+#ifndef LUA_HOOKS_H_
+#define LUA_HOOKS_H_
+
+#include <lua.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define LUA_HOOKS_QUEUE_SIZE 1024
+#define LUA_HOOKS_QUEUE_MASK (LUA_HOOKS_QUEUE_SIZE - 1)
+
+/// Event hooks
+/// -----------
+///
+/// Events are queued in a ring buffer on the C side and handed to Lua once
+/// per frame. The dispatcher (scripts/hooks.lua) and its handler table are
+/// resolved once at init and kept as registry references, so a frame costs
+/// a single pcall however many events it carries. Lua reads the events in
+/// place through the FFI as LuaEvent structs.
+
+/// Mirrored in scripts/hooks.lua
+typedef enum lua_event_type {
+LUA_EVENT_KEY,
+LUA_EVENT_EDIT,
+LUA_EVENT_SAVE,
+LUA_EVENT_RESIZE,
+LUA_EVENT_FRAME,
+LUA_EVENT_COUNT
+} LuaEventType;
+
+/// KEY: key = key code. EDIT: a = offset, b = bytes inserted (negative when
+/// deleted). RESIZE: a = rows, b = columns. FRAME: a = frame number.
+/// `a` and `b` are doubles so Lua reads them as plain numbers, 64 bit
+/// integer fields would box every access into a cdata. Offsets are exact
+/// up to 2^53.
+typedef struct lua_event {
+    uint32_t type;
+    uint32_t key;
+    double a;
+    double b;
+} LuaEvent;
+
+typedef struct lua_hook_stats {
+    uint64_t flushes;
+    uint64_t events;
+    uint64_t ns;
+} LuaHookStats;
+
+typedef struct lua_hooks {
+    lua_State* L;
+    int dispatch_ref;
+    int handlers_ref;
+
+    // Events [head, tail) are queued, both only ever count up
+    LuaEvent* events;
+    uint32_t head;
+    uint32_t tail;
+
+    LuaHookStats stats;
+} LuaHooks;
+
+/// Loads the `hooks` module through require. Returns -1 when it is missing
+/// or broken, the hooks then stay disabled and pushes are ignored.
+int32_t lua_hooks_init(LuaHooks* hooks, lua_State* L);
+void lua_hooks_release(LuaHooks* hooks);
+
+/// Queues an event, a full queue is delivered straight away
+void lua_hooks_push(LuaHooks* hooks, LuaEventType type, uint32_t key, double a, double b);
+/// Delivers everything queued in one call. Returns how many events went
+/// out, -1 when a handler raised an error (the batch is dropped).
+int32_t lua_hooks_flush(LuaHooks* hooks);
+
+/// Mean time spent in Lua per delivered event
+double lua_hooks_ns_per_event(LuaHooks* hooks);
+
+#endif // LUA_HOOKS_H_
@@ -1,4 +1,5 @@
 #include "lua.h"
+#include "cache.h"
 
 #include <lualib.h>
 #include <lauxlib.h>
@@ -11,6 +12,10 @@ lua_State* lua_init() {
     lua_State* L = luaL_newstate();
     luaL_openlibs(L);
 
+    // Without a cache directory scripts are just parsed every start
+    char dir[PATH_MAX];
+    if (lua_cache_dir(dir, sizeof(dir)) == 0) lua_cache_install(L, dir);
+
     return L;
 }
 
@@ -21,7 +26,7 @@ void lua_shutdown(lua_State* L) {
 int32_t lua_load_file(lua_State* L, const char* script) {
     int result = 0;
 
-    int status = luaL_loadfile(L, script);
+    int status = lua_cache_load(L, script);
 
     if (status) {
         fprintf(stderr, "Error loading lua script: %s\n", lua_tostring(L, -1));
@@ -0,0 +1,474 @@
+#include "sched.h"
+
+#include "../base/base.h"
+
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LUA_SCHED_REGISTRY_KEY "lumerie.sched"
+#define LUA_SCHED_READ_SIZE (64 * 1024)
+
+/// Job awaited by a task, found again by id since the task array moves
+struct sched_job {
+    LuaScheduler* sched;
+    uint64_t task;
+    job_func* run;
+    lua_sched_results* results;
+    void* data;
+};
+
+struct sched_read {
+    char* path;
+    char* data;
+    size_t len;
+    int err;
+};
+
+// Scheduler inside lua_sched_run, for the hook which gets no user data
+static LuaScheduler* sched_active;
+
+static uint64_t sched_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int32_t sched_find(LuaScheduler* sched, uint64_t id) {
+    for (uint32_t i = 0; i < sched->count; i++) {
+        if (sched->tasks[i].id == id && sched->tasks[i].state != LUA_TASK_DEAD) return i;
+    }
+    return -1;
+}
+
+/// Task running on `L`, -1 when `L` is not a task being resumed
+static int32_t sched_current(LuaScheduler* sched, lua_State* L) {
+    if (sched->current < 0 || sched->tasks[sched->current].co != L) return -1;
+    return sched->current;
+}
+
+static LuaScheduler* sched_upvalue(lua_State* L) {
+    return lua_touserdata(L, lua_upvalueindex(1));
+}
+
+static int32_t sched_check_task(lua_State* L, LuaScheduler* sched, const char* func) {
+    int32_t index = sched_current(sched, L);
+    if (index < 0) return luaL_error(L, "sched.%s called outside a task", func);
+    return index;
+}
+
+/* Preemption */
+
+/// Yielding through a C frame would raise an error in the task instead
+static uint8_t sched_can_yield(lua_State* L) {
+    lua_Debug ar;
+    for (int32_t level = 0; lua_getstack(L, level, &ar); level++) {
+        lua_getinfo(L, "S", &ar);
+        if (ar.what[0] == 'C') return 0;
+    }
+    return 1;
+}
+
+static void sched_hook(lua_State* L, lua_Debug* ar) {
+    unused(ar);
+    LuaScheduler* sched = sched_active;
+    if (!sched || sched_current(sched, L) < 0) return;
+    if (sched_now_ns() < sched->deadline_ns || !sched_can_yield(L)) return;
+
+    sched->stats.preempted++;
+    lua_yield(L, 0);
+}
+
+/* Tasks */
+
+static void sched_resume(LuaScheduler* sched, uint32_t index) {
+    LuaTask* task = &sched->tasks[index];
+    lua_State* co = task->co;
+    int32_t nargs = task->nargs;
+
+    task->state = LUA_TASK_RUNNING;
+    task->nargs = 0;
+    sched->current = index;
+    sched->stats.resumes++;
+
+    // LuaJIT keeps one hook for the whole VM, PUC Lua one per thread
+    lua_sethook(co, sched_hook, LUA_MASKCOUNT, LUA_SCHED_HOOK_COUNT);
+    int32_t status = lua_resume(co, nargs);
+    sched->current = -1;
+
+    // Spawns during the resume may have moved the array
+    task = &sched->tasks[index];
+    if (status == LUA_YIELD) {
+        // Anything passed to a bare coroutine.yield is dropped
+        lua_settop(co, 0);
+        if (task->state == LUA_TASK_RUNNING) task->state = LUA_TASK_READY;
+        return;
+    }
+
+    if (status != 0) {
+        lua_State* L = sched->L;
+        luaL_traceback(L, co, lua_tostring(co, -1), 0);
+        fprintf(stderr, "Error in Lua task %llu: %s\n", (unsigned long long) task->id, lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    task->state = LUA_TASK_DEAD;
+}
+
+static void sched_wake(LuaScheduler* sched, uint64_t now) {
+    for (uint32_t i = 0; i < sched->count; i++) {
+        LuaTask* task = &sched->tasks[i];
+        if (task->state == LUA_TASK_SLEEPING && task->wake_ns <= now) task->state = LUA_TASK_READY;
+    }
+}
+
+/// Drops dead tasks, keeping the order so the round robin stays fair
+static void sched_compact(LuaScheduler* sched) {
+    uint32_t kept = 0;
+    uint32_t next = sched->next;
+
+    for (uint32_t i = 0; i < sched->count; i++) {
+        LuaTask* task = &sched->tasks[i];
+        if (task->state == LUA_TASK_DEAD) {
+            luaL_unref(sched->L, LUA_REGISTRYINDEX, task->ref);
+            if (i < sched->next) next--;
+            continue;
+        }
+        sched->tasks[kept++] = *task;
+    }
+
+    sched->count = kept;
+    sched->next = next;
+}
+
+uint32_t lua_sched_run(LuaScheduler* sched) {
+    if (!sched->L || sched->count == 0) return 0;
+
+    uint64_t start = sched_now_ns();
+    sched_wake(sched, start);
+    sched->deadline_ns = start + sched->budget_ns;
+    sched_active = sched;
+
+    // One pass at most, a task that yields waits for the next frame
+    uint32_t resumes = 0;
+    for (uint32_t seen = 0; seen < sched->count; seen++) {
+        if (sched->next >= sched->count) sched->next = 0;
+        uint32_t index = sched->next++;
+        if (sched->tasks[index].state != LUA_TASK_READY) continue;
+
+        sched_resume(sched, index);
+        resumes++;
+        if (sched_now_ns() >= sched->deadline_ns) break;
+    }
+
+    lua_sethook(sched->L, NULL, 0, 0);
+    sched_active = NULL;
+    sched_compact(sched);
+
+    uint64_t elapsed = sched_now_ns() - start;
+    sched->stats.runs++;
+    sched->stats.max_run_ns = max(sched->stats.max_run_ns, elapsed);
+
+    return resumes;
+}
+
+int32_t lua_sched_timeout(LuaScheduler* sched) {
+    if (!sched->L) return -1;
+
+    uint64_t wake = UINT64_MAX;
+    for (uint32_t i = 0; i < sched->count; i++) {
+        LuaTask* task = &sched->tasks[i];
+        if (task->state == LUA_TASK_READY) return 0;
+        if (task->state == LUA_TASK_SLEEPING) wake = min(wake, task->wake_ns);
+    }
+
+    if (wake == UINT64_MAX) return -1;
+
+    uint64_t now = sched_now_ns();
+    if (wake <= now) return 0;
+    // Rounded up, waking early would only spin the loop once more
+    uint64_t ms = (wake - now + 999999) / 1000000;
+    return min(ms, (uint64_t) INT32_MAX);
+}
+
+/* Jobs */
+
+static void sched_job_run(void* data, JobCancel* cancel) {
+    struct sched_job* job = data;
+    job->run(job->data, cancel);
+}
+
+static void sched_job_done(void* data, uint8_t cancelled) {
+    struct sched_job* job = data;
+    lua_sched_complete(job->sched, job->task, job->results, job->data, cancelled);
+    free(job);
+}
+
+static LuaScheduler* sched_registry(lua_State* L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_SCHED_REGISTRY_KEY);
+    LuaScheduler* sched = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return sched;
+}
+
+uint64_t lua_sched_suspend(lua_State* L) {
+    LuaScheduler* sched = sched_registry(L);
+    int32_t index = sched ? sched_current(sched, L) : -1;
+    if (index < 0) return 0;
+
+    sched->tasks[index].state = LUA_TASK_WAITING;
+    return sched->tasks[index].id;
+}
+
+void lua_sched_complete(LuaScheduler* sched, uint64_t task, lua_sched_results* results, void* data, uint8_t cancelled) {
+    int32_t index = sched->L ? sched_find(sched, task) : -1;
+    if (index < 0 || sched->tasks[index].state != LUA_TASK_WAITING) {
+        results(NULL, data, 1);
+        return;
+    }
+
+    LuaTask* waiting = &sched->tasks[index];
+    waiting->nargs = results(waiting->co, data, cancelled);
+    waiting->state = LUA_TASK_READY;
+}
+
+int32_t lua_sched_await_job(lua_State* L, job_func* run, lua_sched_results* results, void* data) {
+    LuaScheduler* sched = sched_registry(L);
+    if (!sched || sched_current(sched, L) < 0) {
+        results(NULL, data, 1);
+        return luaL_error(L, "awaiting a job outside a task");
+    }
+
+    struct sched_job* job = malloc(sizeof(struct sched_job));
+    if (!job) {
+        results(NULL, data, 1);
+        return luaL_error(L, "out of memory");
+    }
+
+    job->sched = sched;
+    job->task = sched->tasks[sched->current].id;
+    job->run = run;
+    job->results = results;
+    job->data = data;
+
+    if (job_submit(sched->pool, sched_job_run, sched_job_done, job, &sched->cancel) != 0) {
+        free(job);
+        results(NULL, data, 1);
+        return luaL_error(L, "could not queue job");
+    }
+
+    lua_sched_suspend(L);
+    return lua_yield(L, 0);
+}
+
+/* File reads */
+
+static void sched_read_run(void* data, JobCancel* cancel) {
+    struct sched_read* read_job = data;
+    if (job_cancelled(cancel)) return;
+
+    int fd = open(read_job->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        read_job->err = errno;
+        return;
+    }
+
+    struct stat st;
+    size_t capacity = fstat(fd, &st) == 0 && st.st_size > 0 ? (size_t) st.st_size + 1 : LUA_SCHED_READ_SIZE;
+    read_job->data = malloc(capacity);
+
+    while (read_job->data) {
+        if (read_job->len == capacity) {
+            capacity *= 2;
+            char* grown = realloc(read_job->data, capacity);
+            if (!grown) break;
+            read_job->data = grown;
+        }
+
+        ssize_t nread = read(fd, read_job->data + read_job->len, capacity - read_job->len);
+        if (nread == 0) break;
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            read_job->err = errno;
+            break;
+        }
+        read_job->len += nread;
+    }
+
+    if (!read_job->data) read_job->err = ENOMEM;
+    close(fd);
+}
+
+static int32_t sched_read_results(lua_State* co, void* data, uint8_t cancelled) {
+    struct sched_read* read_job = data;
+    int32_t nresults = 0;
+
+    if (co) {
+        if (cancelled) {
+            lua_pushnil(co);
+            lua_pushstring(co, "cancelled");
+            nresults = 2;
+        } else if (read_job->err) {
+            lua_pushnil(co);
+            lua_pushfstring(co, "%s: %s", read_job->path, strerror(read_job->err));
+            nresults = 2;
+        } else {
+            lua_pushlstring(co, read_job->data, read_job->len);
+            nresults = 1;
+        }
+    }
+
+    free(read_job->path);
+    free(read_job->data);
+    free(read_job);
+    return nresults;
+}
+
+/* Lua functions */
+
+static int sched_lua_spawn(lua_State* L) {
+    LuaScheduler* sched = sched_upvalue(L);
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    int32_t nargs = lua_gettop(L) - 1;
+
+    if (sched->count == sched->capacity) {
+        LuaTask* tasks = realloc(sched->tasks, sizeof(LuaTask) * sched->capacity * 2);
+        if (!tasks) return luaL_error(L, "out of memory");
+        sched->tasks = tasks;
+        sched->capacity *= 2;
+    }
+
+    // The function and its arguments move over, the thread is left for
+    // luaL_ref to pop
+    lua_State* co = lua_newthread(L);
+    lua_insert(L, 1);
+    lua_xmove(L, co, nargs + 1);
+
+    LuaTask* task = &sched->tasks[sched->count++];
+    task->id = ++sched->next_id;
+    task->co = co;
+    task->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    task->state = LUA_TASK_READY;
+    task->nargs = nargs;
+    task->wake_ns = 0;
+
+    lua_pushnumber(L, (lua_Number) task->id);
+    return 1;
+}
+
+static int sched_lua_cancel(lua_State* L) {
+    LuaScheduler* sched = sched_upvalue(L);
+    int32_t index = sched_find(sched, (uint64_t) luaL_checknumber(L, 1));
+
+    // Unreferenced at the end of the next run, a pending job finds no task
+    if (index >= 0) sched->tasks[index].state = LUA_TASK_DEAD;
+    lua_pushboolean(L, index >= 0);
+    return 1;
+}
+
+static int sched_lua_yield(lua_State* L) {
+    sched_check_task(L, sched_upvalue(L), "yield");
+    return lua_yield(L, 0);
+}
+
+static int sched_lua_check(lua_State* L) {
+    LuaScheduler* sched = sched_upvalue(L);
+    sched_check_task(L, sched, "check");
+    if (sched_now_ns() < sched->deadline_ns) return 0;
+
+    sched->stats.preempted++;
+    return lua_yield(L, 0);
+}
+
+static int sched_lua_sleep(lua_State* L) {
+    LuaScheduler* sched = sched_upvalue(L);
+    int32_t index = sched_check_task(L, sched, "sleep");
+    lua_Number ms = luaL_checknumber(L, 1);
+
+    LuaTask* task = &sched->tasks[index];
+    task->state = LUA_TASK_SLEEPING;
+    task->wake_ns = sched_now_ns() + (uint64_t) (max(ms, 0) * 1e6);
+    return lua_yield(L, 0);
+}
+
+static int sched_lua_read_file(lua_State* L) {
+    const char* path = luaL_checkstring(L, 1);
+
+    struct sched_read* read_job = calloc(1, sizeof(struct sched_read));
+    if (!read_job || !(read_job->path = strdup(path))) {
+        free(read_job);
+        return luaL_error(L, "out of memory");
+    }
+
+    return lua_sched_await_job(L, sched_read_run, sched_read_results, read_job);
+}
+
+static const luaL_Reg sched_functions[] = {
+    { "spawn", sched_lua_spawn },
+    { "cancel", sched_lua_cancel },
+    { "yield", sched_lua_yield },
+    { "check", sched_lua_check },
+    { "sleep", sched_lua_sleep },
+    { "read_file", sched_lua_read_file },
+    { NULL, NULL },
+};
+
+int32_t lua_sched_init(LuaScheduler* sched, lua_State* L, JobPool* pool) {
+    memset(sched, 0, sizeof(LuaScheduler));
+    sched->current = -1;
+    sched->budget_ns = LUA_SCHED_BUDGET_NS;
+    job_cancel_init(&sched->cancel);
+
+    sched->tasks = malloc(sizeof(LuaTask) * LUA_SCHED_INIT_TASKS);
+    if (!sched->tasks) {
+        perror("Failed to allocate task list");
+        return -1;
+    }
+    sched->capacity = LUA_SCHED_INIT_TASKS;
+
+    lua_pushlightuserdata(L, sched);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_SCHED_REGISTRY_KEY);
+
+    // Every function carries the scheduler as its upvalue
+    lua_newtable(L);
+    for (const luaL_Reg* reg = sched_functions; reg->name; reg++) {
+        lua_pushlightuserdata(L, sched);
+        lua_pushcclosure(L, reg->func, 1);
+        lua_setfield(L, -2, reg->name);
+    }
+
+    // require("sched") finds it without a script behind it
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaded");
+    lua_pushvalue(L, -3);
+    lua_setfield(L, -2, "sched");
+    lua_pop(L, 3);
+
+    sched->L = L;
+    sched->pool = pool;
+    return 0;
+}
+
+void lua_sched_release(LuaScheduler* sched) {
+    if (sched->L) {
+        job_cancel(&sched->cancel);
+        for (uint32_t i = 0; i < sched->count; i++) {
+            luaL_unref(sched->L, LUA_REGISTRYINDEX, sched->tasks[i].ref);
+        }
+
+        lua_pushnil(sched->L);
+        lua_setfield(sched->L, LUA_REGISTRYINDEX, LUA_SCHED_REGISTRY_KEY);
+    }
+
+    free(sched->tasks);
+    sched->tasks = NULL;
+    sched->count = 0;
+    sched->L = NULL;
+}
@@ -0,0 +1,121 @@
+#ifndef LUA_SCHED_H_
+#define LUA_SCHED_H_
+
+#include <lua.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../base/job.h"
+
+// Time plugin tasks get per loop iteration, what is left of a 60 Hz frame
+// after input handling and drawing
+#define LUA_SCHED_BUDGET_NS (4 * 1000000ULL)
+// VM instructions between clock checks while a task runs
+#define LUA_SCHED_HOOK_COUNT 1000
+#define LUA_SCHED_INIT_TASKS 16
+
+/// Plugin tasks
+/// ------------
+///
+/// Plugins run as coroutines resumed from the main loop, which stops
+/// handing out time once the frame budget is spent. A count hook checks
+/// the clock every LUA_SCHED_HOOK_COUNT instructions and yields the
+/// running task when it overruns, so a busy plugin is spread over frames
+/// instead of stalling input. The hook only yields where the coroutine
+/// can be resumed: not while a C function (pcall, a sort comparator) is
+/// on the task's stack. Code running inside a JIT compiled trace does
+/// not see hooks at all, and LuaJIT compiles most hot loops, string and
+/// table work included: long loops should call sched.check.
+///
+/// The `sched` module (package.loaded, no script behind it):
+///
+///   sched.spawn(fn, ...)     runs fn(...) as a task, returns its id
+///   sched.cancel(id)         drops a task wherever it is parked
+///   sched.yield()            gives up the rest of the frame
+///   sched.check()            yields only when the budget is spent
+///   sched.sleep(ms)          parks the task, woken from the loop timeout
+///   sched.read_file(path)    reads on the job pool, returns the contents
+///                            or nil and a message
+///
+/// Everything here runs on the main thread.
+
+typedef enum lua_task_state {
+LUA_TASK_READY,
+LUA_TASK_RUNNING,
+LUA_TASK_SLEEPING,
+LUA_TASK_WAITING,
+LUA_TASK_DEAD,
+} LuaTaskState;
+
+typedef struct lua_task {
+    uint64_t id;
+    lua_State* co;
+    // Keeps the coroutine alive, the registry holds the thread
+    int ref;
+    LuaTaskState state;
+    // Values on the coroutine's stack handed to the next resume
+    int32_t nargs;
+    uint64_t wake_ns;
+} LuaTask;
+
+typedef struct lua_sched_stats {
+    uint64_t resumes;
+    // Yields forced by the hook or sched.check
+    uint64_t preempted;
+    uint64_t runs;
+    // Longest lua_sched_run, the delay plugins add to a frame
+    uint64_t max_run_ns;
+} LuaSchedStats;
+
+typedef struct lua_scheduler {
+    lua_State* L;
+    JobPool* pool;
+    JobCancel cancel;
+
+    LuaTask* tasks;
+    uint32_t count;
+    uint32_t capacity;
+    // Round robin position, the next frame starts where this one stopped
+    uint32_t next;
+    // Index of the task being resumed, -1 outside of lua_sched_run
+    int32_t current;
+    uint64_t next_id;
+
+    uint64_t budget_ns;
+    uint64_t deadline_ns;
+
+    LuaSchedStats stats;
+} LuaScheduler;
+
+/// Runs on the main thread once the job finished. Pushes what the awaiting
+/// task gets back onto `co` and returns how many values that was. `co` is
+/// NULL when the task is gone, only `data` needs freeing then.
+typedef int32_t lua_sched_results(lua_State* co, void* data, uint8_t cancelled);
+
+/// Registers the `sched` module with `L`. Jobs awaited by tasks go to
+/// `pool`, which the LuaScheduler itself has to outlive: completions that
+/// arrive after lua_sched_release only free their data.
+int32_t lua_sched_init(LuaScheduler* sched, lua_State* L, JobPool* pool);
+void lua_sched_release(LuaScheduler* sched);
+
+/// Resumes ready tasks until all of them yielded or the budget ran out.
+/// Returns how many resumes happened.
+uint32_t lua_sched_run(LuaScheduler* sched);
+/// Milliseconds the loop may sleep before lua_sched_run has work again:
+/// 0 when a task is ready, -1 when nothing is due at all
+int32_t lua_sched_timeout(LuaScheduler* sched);
+
+/// For C functions bound into Lua: `return lua_sched_await_job(L, ...);`
+/// parks the calling task until `run` finished on the pool, the call then
+/// returns the values pushed by `results`. Raises an error outside a task.
+int32_t lua_sched_await_job(lua_State* L, job_func* run, lua_sched_results* results, void* data);
+
+/// For work finished by something other than the job pool: marks the task
+/// running on `L` as waiting and returns its id, the bound function then
+/// returns lua_yield(L, 0). Returns 0 outside a task.
+uint64_t lua_sched_suspend(lua_State* L);
+/// Hands a parked task the values `results` pushes and makes it ready.
+/// When the task is gone `results` only gets to free `data`.
+void lua_sched_complete(LuaScheduler* sched, uint64_t task, lua_sched_results* results, void* data, uint8_t cancelled);
+
+#endif // LUA_SCHED_H_
@@ -0,0 +1,817 @@
+#define _GNU_SOURCE
+
+#include "workers.h"
+
+#include "lua.h"
+#include "../base/base.h"
+#include "../base/job.h"
+
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+typedef enum message_tag {
+MESSAGE_NIL,
+MESSAGE_FALSE,
+MESSAGE_TRUE,
+MESSAGE_NUMBER,
+MESSAGE_STRING,
+MESSAGE_TABLE,
+MESSAGE_TABLE_END,
+MESSAGE_SNAPSHOT,
+} MessageTag;
+
+/* Shared snapshots */
+
+static void shared_push(lua_State* L, PTableSnapshot* snapshot) {
+    PTableSnapshot** handle = lua_newuserdata(L, sizeof(PTableSnapshot*));
+    *handle = snapshot;
+    luaL_getmetatable(L, LUA_SHARED_SNAPSHOT);
+    lua_setmetatable(L, -2);
+}
+
+/// The handle at `index`, NULL when it is some other value
+static PTableSnapshot** shared_test(lua_State* L, int32_t index) {
+    if (!lua_getmetatable(L, index)) return NULL;
+
+    luaL_getmetatable(L, LUA_SHARED_SNAPSHOT);
+    int32_t shared = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+
+    return shared ? lua_touserdata(L, index) : NULL;
+}
+
+static PTableSnapshot* shared_check(lua_State* L, int32_t index) {
+    PTableSnapshot** handle = shared_test(L, index);
+    if (!handle) luaL_typerror(L, index, "shared snapshot");
+    if (!*handle) luaL_error(L, "shared snapshot already released");
+    return *handle;
+}
+
+static int shared_release(lua_State* L) {
+    PTableSnapshot** handle = shared_test(L, 1);
+    if (handle && *handle) {
+        ptable_snapshot_release(*handle);
+        *handle = NULL;
+    }
+    return 0;
+}
+
+/// For ffi.cast on the Lua side, see ptable.shared
+static int shared_pointer(lua_State* L) {
+    lua_pushlightuserdata(L, shared_check(L, 1));
+    return 1;
+}
+
+static int shared_length(lua_State* L) {
+    lua_pushnumber(L, (lua_Number) ptable_snapshot_length(shared_check(L, 1)));
+    return 1;
+}
+
+static void shared_register(lua_State* L) {
+    if (!luaL_newmetatable(L, LUA_SHARED_SNAPSHOT)) {
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_pushcfunction(L, shared_release);
+    lua_setfield(L, -2, "__gc");
+
+    lua_newtable(L);
+    lua_pushcfunction(L, shared_pointer);
+    lua_setfield(L, -2, "pointer");
+    lua_pushcfunction(L, shared_length);
+    lua_setfield(L, -2, "length");
+    lua_pushcfunction(L, shared_release);
+    lua_setfield(L, -2, "release");
+    lua_setfield(L, -2, "__index");
+
+    lua_pop(L, 1);
+}
+
+/* Messages */
+
+static int32_t message_reserve(LuaMessage* message, size_t size) {
+    if (message->len + size <= message->capacity) return 0;
+
+    size_t capacity = message->capacity ? message->capacity * 2 : LUA_MESSAGE_INIT_SIZE;
+    while (capacity < message->len + size) capacity *= 2;
+
+    char* data = realloc(message->data, capacity);
+    if (!data) return -1;
+
+    message->data = data;
+    message->capacity = capacity;
+    return 0;
+}
+
+static int32_t message_put(LuaMessage* message, const void* data, size_t size) {
+    if (message_reserve(message, size) != 0) return -1;
+    memcpy(message->data + message->len, data, size);
+    message->len += size;
+    return 0;
+}
+
+static int32_t message_put_tag(LuaMessage* message, MessageTag tag) {
+    uint8_t byte = tag;
+    return message_put(message, &byte, 1);
+}
+
+static int32_t message_get(LuaMessage* message, size_t* pos, void* out, size_t size) {
+    if (message->len - *pos < size) return -1;
+    memcpy(out, message->data + *pos, size);
+    *pos += size;
+    return 0;
+}
+
+/// Releases the snapshots in [from, len), which were written but never
+/// read, and cuts the message back to `from`
+static void message_truncate(LuaMessage* message, size_t from) {
+    size_t pos = from;
+    while (message->snapshots > 0 && pos < message->len) {
+        uint8_t tag = message->data[pos++];
+        uint64_t size = 0;
+
+        switch (tag) {
+            case MESSAGE_NUMBER:
+                pos += sizeof(lua_Number);
+                break;
+            case MESSAGE_STRING:
+                message_get(message, &pos, &size, sizeof(size));
+                pos += size;
+                break;
+            case MESSAGE_SNAPSHOT: {
+                PTableSnapshot* snapshot = NULL;
+                message_get(message, &pos, &snapshot, sizeof(snapshot));
+                if (snapshot) {
+                    ptable_snapshot_release(snapshot);
+                    message->snapshots--;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    message->len = from;
+}
+
+static const char* message_type_error(int32_t type) {
+    switch (type) {
+        case LUA_TFUNCTION: return "functions cannot be sent";
+        case LUA_TTHREAD: return "coroutines cannot be sent";
+        case LUA_TUSERDATA:
+        case LUA_TLIGHTUSERDATA: return "userdata other than shared snapshots cannot be sent";
+        default: return "cdata cannot be sent, convert it to a number or string first";
+    }
+}
+
+static int32_t message_write_value(lua_State* L, LuaMessage* message, int32_t index, uint32_t depth, const char** error) {
+    int32_t type = lua_type(L, index);
+    *error = "out of memory";
+
+    switch (type) {
+        case LUA_TNIL:
+            return message_put_tag(message, MESSAGE_NIL);
+        case LUA_TBOOLEAN:
+            return message_put_tag(message, lua_toboolean(L, index) ? MESSAGE_TRUE : MESSAGE_FALSE);
+        case LUA_TNUMBER: {
+            lua_Number number = lua_tonumber(L, index);
+            if (message_put_tag(message, MESSAGE_NUMBER) != 0) return -1;
+            return message_put(message, &number, sizeof(number));
+        }
+        case LUA_TSTRING: {
+            size_t len;
+            const char* s = lua_tolstring(L, index, &len);
+            uint64_t size = len;
+            if (message_put_tag(message, MESSAGE_STRING) != 0) return -1;
+            if (message_put(message, &size, sizeof(size)) != 0) return -1;
+            return message_put(message, s, len);
+        }
+        case LUA_TTABLE:
+            break;
+        case LUA_TUSERDATA: {
+            PTableSnapshot** handle = shared_test(L, index);
+            if (!handle) break;
+            if (!*handle) {
+                *error = "shared snapshot already released";
+                return -1;
+            }
+
+            // The message holds its own reference, the sender keeps theirs
+            PTableSnapshot* snapshot = ptable_snapshot_clone(*handle);
+            if (!snapshot) return -1;
+            if (message_put_tag(message, MESSAGE_SNAPSHOT) != 0 ||
+                message_put(message, &snapshot, sizeof(snapshot)) != 0) {
+                ptable_snapshot_release(snapshot);
+                return -1;
+            }
+            message->snapshots++;
+            return 0;
+        }
+        default:
+            break;
+    }
+
+    if (type != LUA_TTABLE) {
+        *error = message_type_error(type);
+        return -1;
+    }
+
+    if (depth >= LUA_MESSAGE_MAX_DEPTH) {
+        *error = "tables nested too deep, or cyclic";
+        return -1;
+    }
+    if (!lua_checkstack(L, 2) || message_put_tag(message, MESSAGE_TABLE) != 0) return -1;
+
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+        int32_t top = lua_gettop(L);
+        if (message_write_value(L, message, top - 1, depth + 1, error) != 0 ||
+            message_write_value(L, message, top, depth + 1, error) != 0) {
+            lua_pop(L, 2);
+            return -1;
+        }
+        lua_pop(L, 1);
+    }
+
+    *error = "out of memory";
+    return message_put_tag(message, MESSAGE_TABLE_END);
+}
+
+int32_t lua_message_write(lua_State* L, LuaMessage* message, int32_t first, int32_t last, const char** error) {
+    size_t start = message->len;
+
+    for (int32_t index = first; index <= last; index++) {
+        if (message_write_value(L, message, index, 0, error) != 0) {
+            message_truncate(message, start);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int32_t message_read_value(lua_State* L, LuaMessage* message, size_t* pos, uint32_t depth) {
+    uint8_t tag;
+    if (message_get(message, pos, &tag, 1) != 0 || !lua_checkstack(L, 3)) return -1;
+
+    switch (tag) {
+        case MESSAGE_NIL:
+            lua_pushnil(L);
+            return 0;
+        case MESSAGE_FALSE:
+        case MESSAGE_TRUE:
+            lua_pushboolean(L, tag == MESSAGE_TRUE);
+            return 0;
+        case MESSAGE_NUMBER: {
+            lua_Number number;
+            if (message_get(message, pos, &number, sizeof(number)) != 0) return -1;
+            lua_pushnumber(L, number);
+            return 0;
+        }
+        case MESSAGE_STRING: {
+            uint64_t size;
+            if (message_get(message, pos, &size, sizeof(size)) != 0 || message->len - *pos < size) return -1;
+            lua_pushlstring(L, message->data + *pos, size);
+            *pos += size;
+            return 0;
+        }
+        case MESSAGE_SNAPSHOT: {
+            size_t at = *pos;
+            PTableSnapshot* snapshot;
+            if (message_get(message, pos, &snapshot, sizeof(snapshot)) != 0 || !snapshot) return -1;
+
+            // The reader owns it from here, the message forgets it
+            shared_push(L, snapshot);
+            memset(message->data + at, 0, sizeof(snapshot));
+            message->snapshots--;
+            return 0;
+        }
+        case MESSAGE_TABLE:
+            break;
+        default:
+            return -1;
+    }
+
+    if (depth >= LUA_MESSAGE_MAX_DEPTH) return -1;
+
+    lua_newtable(L);
+    while (*pos < message->len && (uint8_t) message->data[*pos] != MESSAGE_TABLE_END) {
+        if (message_read_value(L, message, pos, depth + 1) != 0) return -1;
+        if (message_read_value(L, message, pos, depth + 1) != 0) return -1;
+        lua_rawset(L, -3);
+    }
+
+    if (*pos == message->len) return -1;
+    (*pos)++;
+    return 0;
+}
+
+int32_t lua_message_read(lua_State* L, LuaMessage* message) {
+    int32_t base = lua_gettop(L);
+    size_t pos = 0;
+
+    while (pos < message->len) {
+        if (message_read_value(L, message, &pos, 0) != 0) {
+            lua_settop(L, base);
+            return -1;
+        }
+    }
+
+    return lua_gettop(L) - base;
+}
+
+void lua_message_release(LuaMessage* message) {
+    message_truncate(message, 0);
+    free(message->data);
+    memset(message, 0, sizeof(LuaMessage));
+}
+
+/* Calls */
+
+static void workers_call_free(LuaWorkerCall* call) {
+    lua_message_release(&call->request);
+    lua_message_release(&call->response);
+    free(call);
+}
+
+static void workers_queue_init(LuaWorkerQueue* queue) {
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->ready, NULL);
+    queue->head = NULL;
+    queue->tail = NULL;
+}
+
+static void workers_queue_release(LuaWorkerQueue* queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->ready);
+}
+
+static void workers_queue_push(LuaWorkerQueue* queue, LuaWorkerCall* call) {
+    call->next = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail) {
+        queue->tail->next = call;
+    } else {
+        queue->head = call;
+    }
+    queue->tail = call;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/// Everything queued, oldest first
+static LuaWorkerCall* workers_queue_take_all(LuaWorkerQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    LuaWorkerCall* call = queue->head;
+    queue->head = NULL;
+    queue->tail = NULL;
+    pthread_mutex_unlock(&queue->lock);
+
+    return call;
+}
+
+/// Blocks for the next call, NULL once the pool stops
+static LuaWorkerCall* workers_take(LuaWorkerPool* pool) {
+    LuaWorkerQueue* queue = &pool->requests;
+    LuaWorkerCall* call = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->head && !atomic_load(&pool->stop)) {
+        pthread_cond_wait(&queue->ready, &queue->lock);
+    }
+
+    if (!atomic_load(&pool->stop)) {
+        call = queue->head;
+        queue->head = call->next;
+        if (!queue->head) queue->tail = NULL;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return call;
+}
+
+/* Worker VMs */
+
+// Pool of the worker VM running on this thread, for the stop hook
+static _Thread_local LuaWorkerPool* worker_pool;
+
+static void workers_register(lua_State* L, LuaWorkerPool* pool, int32_t worker);
+
+/// Ends a running call once the pool is stopping, the error unwinds to the
+/// pcall in worker_run
+static void worker_stop_hook(lua_State* L, lua_Debug* ar) {
+    unused(ar);
+    if (worker_pool && atomic_load(&worker_pool->stop)) luaL_error(L, "Lua worker pool stopped");
+}
+
+/// Turns the error on top of the stack into the call's response
+static void worker_fail(lua_State* L, LuaWorkerCall* call, int32_t base) {
+    if (!lua_isstring(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushliteral(L, "error object is not a string");
+    }
+
+    const char* error;
+    message_truncate(&call->response, 0);
+    if (lua_message_write(L, &call->response, lua_gettop(L), lua_gettop(L), &error) != 0) {
+        // Nothing to say it with, an empty error still fails the call
+        message_truncate(&call->response, 0);
+    }
+
+    call->status = -1;
+    lua_settop(L, base);
+}
+
+/// require(module)[function], raises when there is no such function. Runs
+/// under lua_pcall, a module returning something other than a table must
+/// not reach the panic handler.
+static int worker_resolve(lua_State* L) {
+    const char* module = lua_tostring(L, 1);
+    const char* name = lua_tostring(L, 2);
+
+    // Modules load once per VM, later calls find them in package.loaded
+    lua_getglobal(L, "require");
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 1);
+    if (!lua_istable(L, -1)) return luaL_error(L, "module %s did not return a table", module);
+
+    lua_getfield(L, -1, name);
+    if (!lua_isfunction(L, -1)) return luaL_error(L, "%s.%s is not a function", module, name);
+    return 1;
+}
+
+/// Pushes the request's values. Runs under lua_pcall too, running out of
+/// memory halfway through a message fails the call like a bad one.
+static int worker_read(lua_State* L) {
+    LuaWorkerCall* call = lua_touserdata(L, 1);
+    lua_pop(L, 1);
+
+    int32_t count = lua_message_read(L, &call->request);
+    if (count < 0) return luaL_error(L, "malformed call");
+    return count;
+}
+
+/// Runs require(module)[function](arguments...) and serializes what it
+/// returns
+static void worker_run(lua_State* L, LuaWorkerCall* call) {
+    int32_t base = lua_gettop(L);
+
+    lua_pushcfunction(L, worker_read);
+    lua_pushlightuserdata(L, call);
+    int32_t status = lua_pcall(L, 1, LUA_MULTRET, 0);
+    // Snapshots the read did not get to are released with it
+    lua_message_release(&call->request);
+    if (status != 0) {
+        worker_fail(L, call, base);
+        return;
+    }
+
+    int32_t count = lua_gettop(L) - base;
+    if (count < 2 || lua_type(L, base + 1) != LUA_TSTRING || lua_type(L, base + 2) != LUA_TSTRING) {
+        lua_settop(L, base);
+        lua_pushliteral(L, "malformed call");
+        worker_fail(L, call, base);
+        return;
+    }
+
+    lua_pushcfunction(L, worker_resolve);
+    lua_pushvalue(L, base + 1);
+    lua_pushvalue(L, base + 2);
+    if (lua_pcall(L, 2, 1, 0) != 0) {
+        worker_fail(L, call, base);
+        return;
+    }
+
+    // Function where the module name was, arguments right after it
+    lua_replace(L, base + 1);
+    lua_remove(L, base + 2);
+
+    if (lua_pcall(L, count - 2, LUA_MULTRET, 0) != 0) {
+        worker_fail(L, call, base);
+        return;
+    }
+
+    const char* error;
+    if (lua_message_write(L, &call->response, base + 1, lua_gettop(L), &error) != 0) {
+        lua_pushfstring(L, "results: %s", error);
+        worker_fail(L, call, base);
+        return;
+    }
+
+    call->status = 0;
+    lua_settop(L, base);
+}
+
+static void worker_setup(LuaWorkerPool* pool, lua_State* L, uint32_t index) {
+    lua_getglobal(L, "package");
+    lua_pushstring(L, pool->path);
+    lua_setfield(L, -2, "path");
+    lua_pop(L, 1);
+
+    workers_register(L, pool, index);
+
+    for (uint32_t i = 0; i < pool->module_count; i++) {
+        lua_getglobal(L, "require");
+        lua_pushstring(L, pool->modules[i]);
+        if (lua_pcall(L, 1, 0, 0) != 0) {
+            fprintf(stderr, "Error loading %s in Lua worker %u: %s\n", pool->modules[i], index, lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+}
+
+static void* worker_main(void* arg) {
+    LuaWorker* self = arg;
+    LuaWorkerPool* pool = self->pool;
+
+    event_block_signals();
+    // Same nice value as the job workers, input stays ahead
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), JOB_WORKER_NICE);
+
+    lua_State* L = lua_init();
+    worker_pool = pool;
+    lua_sethook(L, worker_stop_hook, LUA_MASKCOUNT, LUA_WORKER_HOOK_COUNT);
+    worker_setup(pool, L, self->index);
+
+    LuaWorkerCall* call;
+    while ((call = workers_take(pool))) {
+        worker_run(L, call);
+
+        workers_queue_push(&pool->done, call);
+        uint64_t one = 1;
+        while (write(pool->done_fd, &one, sizeof(one)) == -1 && errno == EINTR) {}
+    }
+
+    // Finalizers run at close must not be stopped halfway
+    lua_sethook(L, NULL, 0, 0);
+    lua_shutdown(L);
+    return NULL;
+}
+
+/* Main VM */
+
+static int32_t workers_call_results(lua_State* co, void* data, uint8_t cancelled) {
+    LuaWorkerCall* call = data;
+    int32_t nresults = 0;
+
+    if (co && lua_checkstack(co, 2)) {
+        int32_t count = cancelled ? -1 : lua_message_read(co, &call->response);
+        if (count >= 0) {
+            lua_pushboolean(co, call->status == 0);
+            lua_insert(co, -count - 1);
+            nresults = count + 1;
+        } else {
+            lua_pushboolean(co, 0);
+            lua_pushstring(co, cancelled ? "cancelled" : "malformed results");
+            nresults = 2;
+        }
+    }
+
+    workers_call_free(call);
+    return nresults;
+}
+
+static LuaWorkerPool* workers_upvalue(lua_State* L) {
+    return lua_touserdata(L, lua_upvalueindex(1));
+}
+
+/// Starts the worker threads. Put off until the first call, a session
+/// whose plugins never use the workers never pays for their VMs.
+static int32_t workers_start(LuaWorkerPool* pool) {
+    for (uint32_t i = 0; i < pool->worker_count; i++) {
+        LuaWorker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i + 1;
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            error_print("Failed to start Lua worker %u", i);
+            break;
+        }
+        pool->started++;
+    }
+
+    // Fewer workers than asked for still take calls
+    return pool->started > 0 ? 0 : -1;
+}
+
+static int workers_lua_call(lua_State* L) {
+    LuaWorkerPool* pool = workers_upvalue(L);
+    luaL_checkstring(L, 1);
+    luaL_checkstring(L, 2);
+    if (!pool->workers) return luaL_error(L, "workers.call: the worker pool is gone");
+    if (pool->started == 0 && workers_start(pool) != 0) return luaL_error(L, "workers.call: no Lua worker could start");
+
+    LuaWorkerCall* call = calloc(1, sizeof(LuaWorkerCall));
+    if (!call) return luaL_error(L, "out of memory");
+
+    const char* error;
+    if (lua_message_write(L, &call->request, 1, lua_gettop(L), &error) != 0) {
+        workers_call_free(call);
+        return luaL_error(L, "workers.call: %s", error);
+    }
+
+    call->task = lua_sched_suspend(L);
+    if (!call->task) {
+        workers_call_free(call);
+        return luaL_error(L, "workers.call called outside a task");
+    }
+
+    pool->stats.calls++;
+    workers_queue_push(&pool->requests, call);
+    return lua_yield(L, 0);
+}
+
+/// Shared snapshot of the open document, nil when there is none
+static int workers_lua_snapshot(lua_State* L) {
+    LuaWorkerPool* pool = workers_upvalue(L);
+    PTable* table = pool->table ? pool->table() : NULL;
+    PTableSnapshot* snapshot = table ? ptable_snapshot(table) : NULL;
+
+    if (snapshot) {
+        shared_push(L, snapshot);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/// `worker` is 0 on the main VM, the 1 based index on workers
+static void workers_register(lua_State* L, LuaWorkerPool* pool, int32_t worker) {
+    shared_register(L);
+
+    lua_newtable(L);
+    if (worker == 0) {
+        lua_pushlightuserdata(L, pool);
+        lua_pushcclosure(L, workers_lua_call, 1);
+        lua_setfield(L, -2, "call");
+        lua_pushlightuserdata(L, pool);
+        lua_pushcclosure(L, workers_lua_snapshot, 1);
+        lua_setfield(L, -2, "snapshot");
+    } else {
+        lua_pushinteger(L, worker);
+        lua_setfield(L, -2, "worker");
+    }
+    lua_pushinteger(L, pool->worker_count);
+    lua_setfield(L, -2, "count");
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaded");
+    lua_pushvalue(L, -3);
+    lua_setfield(L, -2, "workers");
+    lua_pop(L, 3);
+}
+
+/* Pool */
+
+int32_t lua_workers_init(LuaWorkerPool* pool, lua_State* L, LuaScheduler* sched, uint32_t worker_count,
+                         const char* const* modules, lua_workers_table_func* table) {
+    memset(pool, 0, sizeof(LuaWorkerPool));
+
+    if (worker_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cores > 1 ? (uint32_t) cores - 1 : 1;
+    }
+
+    pool->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->done_fd == -1) {
+        perror("Failed to create Lua worker completion fd");
+        return -1;
+    }
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "path");
+    pool->path = strdup(lua_isstring(L, -1) ? lua_tostring(L, -1) : "");
+    lua_pop(L, 2);
+
+    while (modules && modules[pool->module_count]) pool->module_count++;
+    pool->modules = calloc(pool->module_count + 1, sizeof(char*));
+    pool->workers = calloc(worker_count, sizeof(LuaWorker));
+
+    int32_t failed = !pool->path || !pool->modules || !pool->workers;
+    for (uint32_t i = 0; !failed && i < pool->module_count; i++) {
+        pool->modules[i] = strdup(modules[i]);
+        failed = !pool->modules[i];
+    }
+
+    if (failed) {
+        perror("Failed to allocate Lua workers");
+        for (uint32_t i = 0; pool->modules && i < pool->module_count; i++) free(pool->modules[i]);
+        free(pool->path);
+        free(pool->modules);
+        free(pool->workers);
+        close(pool->done_fd);
+        pool->workers = NULL;
+        return -1;
+    }
+
+    atomic_init(&pool->stop, 0);
+    workers_queue_init(&pool->requests);
+    workers_queue_init(&pool->done);
+    pool->worker_count = worker_count;
+    pool->L = L;
+    pool->sched = sched;
+    pool->table = table;
+
+    workers_register(L, pool, 0);
+    return 0;
+}
+
+void lua_workers_release(LuaWorkerPool* pool) {
+    if (!pool->workers) return;
+
+    pthread_mutex_lock(&pool->requests.lock);
+    atomic_store(&pool->stop, 1);
+    pthread_cond_broadcast(&pool->requests.ready);
+    pthread_mutex_unlock(&pool->requests.lock);
+
+    // The stop hook ends running calls, except inside JIT compiled traces
+    // which never call hooks. Workers stuck there are left behind.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += LUA_WORKER_STOP_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (LUA_WORKER_STOP_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    uint32_t stuck = 0;
+    for (uint32_t i = 0; i < pool->started; i++) {
+        if (pthread_timedjoin_np(pool->workers[i].thread, NULL, &deadline) != 0) {
+            pthread_detach(pool->workers[i].thread);
+            stuck++;
+        }
+    }
+
+    if (stuck > 0) {
+        // Their queues and completion fd stay, the calls are never delivered
+        error_print("%u Lua workers did not stop in time, leaving them running", stuck);
+        pool->workers = NULL;
+        pool->worker_count = 0;
+        pool->started = 0;
+        return;
+    }
+
+    // Calls no worker took never run, finished ones are still delivered
+    LuaWorkerCall* call = workers_queue_take_all(&pool->requests);
+    while (call) {
+        LuaWorkerCall* next = call->next;
+        lua_sched_complete(pool->sched, call->task, workers_call_results, call, 1);
+        call = next;
+    }
+    lua_workers_complete(pool);
+
+    workers_queue_release(&pool->requests);
+    workers_queue_release(&pool->done);
+    close(pool->done_fd);
+
+    for (uint32_t i = 0; i < pool->module_count; i++) free(pool->modules[i]);
+    free(pool->modules);
+    free(pool->path);
+    free(pool->workers);
+
+    pool->workers = NULL;
+    pool->modules = NULL;
+    pool->path = NULL;
+    pool->worker_count = 0;
+    pool->started = 0;
+}
+
+uint32_t lua_workers_complete(LuaWorkerPool* pool) {
+    uint64_t count;
+    while (read(pool->done_fd, &count, sizeof(count)) == -1 && errno == EINTR) {}
+
+    uint32_t completed = 0;
+    LuaWorkerCall* call = workers_queue_take_all(&pool->done);
+    while (call) {
+        LuaWorkerCall* next = call->next;
+        if (call->status != 0) pool->stats.errors++;
+        lua_sched_complete(pool->sched, call->task, workers_call_results, call, 0);
+        call = next;
+        completed++;
+    }
+
+    return completed;
+}
+
+static void workers_on_done(EventLoop* loop, int fd, uint32_t events, void* user) {
+    unused(loop);
+    unused(fd);
+    unused(events);
+
+    lua_workers_complete(user);
+}
+
+int32_t lua_workers_attach(LuaWorkerPool* pool, EventLoop* loop) {
+    return event_loop_add(loop, pool->done_fd, EVENT_READ, workers_on_done, pool);
+}
@@ -0,0 +1,139 @@
+#ifndef LUA_WORKERS_H_
+#define LUA_WORKERS_H_
+
+#include <lua.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "sched.h"
+#include "../base/event.h"
+#include "../ptable/ptable.h"
+
+// Nesting allowed in a message, deeper tables are taken for cycles
+#define LUA_MESSAGE_MAX_DEPTH 32
+#define LUA_MESSAGE_INIT_SIZE 256
+#define LUA_SHARED_SNAPSHOT "lumerie.shared_snapshot"
+// VM instructions between checks for a stopping pool
+#define LUA_WORKER_HOOK_COUNT 1000
+// How long release waits for running calls to notice the stop
+#define LUA_WORKER_STOP_TIMEOUT_MS 500
+
+/// Worker VMs
+/// ----------
+///
+/// A pool of threads, each with its own lua_State set up like the main one
+/// (same package.path, bytecode cache, preloaded plugin modules). Workers
+/// share nothing with the main VM, calls and results travel as messages:
+/// values serialized into a flat buffer (nil, booleans, numbers, strings,
+/// tables without cycles) plus shared snapshots, which carry a reference
+/// to a document version rather than its text.
+///
+/// From a task on the main VM:
+///
+///   local workers = require("workers")
+///   local ok, count = workers.call("wordcount", "count", workers.snapshot())
+///
+/// parks the task until a worker ran require("wordcount").count(snapshot)
+/// and resumes it with true and the results, or false and the error. The
+/// worker gets the snapshot as a handle for ptable.shared. Results come
+/// back through an eventfd on the EventLoop, like job completions.
+///
+/// require("workers").worker is the worker's index on a worker VM and nil
+/// on the main one.
+
+typedef PTable* lua_workers_table_func();
+
+/// Serialized values
+typedef struct lua_message {
+    char* data;
+    size_t len;
+    size_t capacity;
+    // Snapshots written and not yet read back, released with the message
+    uint32_t snapshots;
+} LuaMessage;
+
+typedef struct lua_worker_call {
+    uint64_t task;
+    // Module, function and arguments
+    LuaMessage request;
+    // Results, or the error message when status is -1
+    LuaMessage response;
+    int32_t status;
+
+    struct lua_worker_call* next;
+} LuaWorkerCall;
+
+typedef struct lua_worker_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    LuaWorkerCall* head;
+    LuaWorkerCall* tail;
+} LuaWorkerQueue;
+
+typedef struct lua_worker_pool LuaWorkerPool;
+
+typedef struct lua_worker {
+    LuaWorkerPool* pool;
+    pthread_t thread;
+    uint32_t index;
+} LuaWorker;
+
+typedef struct lua_worker_stats {
+    uint64_t calls;
+    uint64_t errors;
+} LuaWorkerStats;
+
+struct lua_worker_pool {
+    LuaWorker* workers;
+    uint32_t worker_count;
+    uint32_t started;
+    atomic_uint stop;
+
+    // Copied out of the main VM, workers set themselves up from these
+    char* path;
+    char** modules;
+    uint32_t module_count;
+
+    LuaWorkerQueue requests;
+    LuaWorkerQueue done;
+    int done_fd;
+
+    lua_State* L;
+    LuaScheduler* sched;
+    lua_workers_table_func* table;
+
+    LuaWorkerStats stats;
+};
+
+/// Sets up `worker_count` VMs (0: one less than the online cores) that each
+/// require `modules` (NULL terminated, may be NULL) before taking calls.
+/// Their threads only start with the first workers.call.
+/// Registers the `workers` module with `L`, calls park tasks of `sched`.
+/// `table` gives workers.snapshot the open document, it may be NULL.
+int32_t lua_workers_init(LuaWorkerPool* pool, lua_State* L, LuaScheduler* sched, uint32_t worker_count,
+                         const char* const* modules, lua_workers_table_func* table);
+/// Stops and joins the workers. Running calls are ended by a count hook
+/// with an error. Code inside JIT compiled traces does not see the hook:
+/// workers still busy after LUA_WORKER_STOP_TIMEOUT_MS are detached and
+/// left to finish, their pool state is then never freed and `pool` must
+/// stay valid until the process exits. Otherwise calls still queued or
+/// finished but not delivered complete as cancelled.
+void lua_workers_release(LuaWorkerPool* pool);
+
+/// Registers the completion fd with `loop`
+int32_t lua_workers_attach(LuaWorkerPool* pool, EventLoop* loop);
+/// Hands every finished call back to its task, returns how many
+uint32_t lua_workers_complete(LuaWorkerPool* pool);
+
+/// Serializes the values at stack slots [first, last] and appends them to
+/// `message`. Returns -1 with `error` set for values that cannot be sent.
+int32_t lua_message_write(lua_State* L, LuaMessage* message, int32_t first, int32_t last, const char** error);
+/// Pushes every value of `message`, returns how many or -1 when it is
+/// malformed or the stack cannot grow. Snapshots move to the reader.
+int32_t lua_message_read(lua_State* L, LuaMessage* message);
+/// Frees the buffer and any snapshot that was never read
+void lua_message_release(LuaMessage* message);
+
+#endif // LUA_WORKERS_H_
@@ -1,264 +1,1398 @@
  #include "ptable.h"
 
 #include "../base/base.h"
+#include "../base/util.h"
+#include "../base/bytes.h"
+#include "../base/job.h"
 
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
-#define PTABLE_INIT_ADD_SIZE 1024
-#define PTABLE_INIT_NODE_SIZE 128
-#define FORWARD 1
-#define BACKWARD 0
+#define PTABLE_ADD_INIT_CHUNKS 16
+#define PTABLE_WRITE_BATCH 1024
+#define PTABLE_INIT_LINE_INDEX_SIZE 64
+#define PTABLE_LINE_CHUNK_SIZE ((size_t) 4 << 20)
+#define PTABLE_INIT_BATCH_PIECES 256
 
+/* Line index */
 
+static int32_t line_index_reserve(PTableLineIndex* index, size_t extra) {
+    if (index->count + extra <= index->capacity) return 0;
+
+    size_t new_capacity = index->capacity ? index->capacity * 2 : PTABLE_INIT_LINE_INDEX_SIZE;
+    if (new_capacity < index->count + extra) new_capacity = index->count + extra;
+
+    size_t* new_feeds = index->arena
+        ? arena_resize(index->arena, index->line_feeds, index->capacity * sizeof(size_t), new_capacity * sizeof(size_t))
+        : realloc(index->line_feeds, new_capacity * sizeof(size_t));
+    if (!new_feeds) {
+        perror("Failed to grow line index");
+        return -1;
+    }
+    index->line_feeds = new_feeds;
+    index->capacity = new_capacity;
+
+    return 0;
+}
+
+/// Records every line feed of buf[0, len) at `base` + its offset
+static void line_index_scan(PTableLineIndex* index, const char* buf, size_t len, size_t base) {
+    size_t count = bytes_count(buf, len, '\n');
+    if (count == 0 || line_index_reserve(index, count) != 0) return;
+
+    index->count += bytes_positions(buf, len, '\n', base, index->line_feeds + index->count);
+}
+
+/// One slice of a parallel index build. Chunks are counted first, the
+/// prefix sums of the counts then tell each chunk where its positions go.
+struct line_chunk {
+    const char* buf;
+    size_t start;
+    size_t len;
+    size_t count;
+    size_t* out;
+};
+
+static void line_chunk_count(void* data, JobCancel* cancel) {
+    unused(cancel);
+    struct line_chunk* chunk = data;
+    chunk->count = bytes_count(chunk->buf + chunk->start, chunk->len, '\n');
+}
+
+static void line_chunk_fill(void* data, JobCancel* cancel) {
+    unused(cancel);
+    struct line_chunk* chunk = data;
+    bytes_positions(chunk->buf + chunk->start, chunk->len, '\n', chunk->start, chunk->out);
+}
+
+static void line_chunks_run(JobPool* pool, struct line_chunk* chunks, size_t chunk_count, job_func* run) {
+    JobCounter counter;
+    job_counter_init(&counter, chunk_count);
+
+    for (size_t i = 0; i < chunk_count; i++) {
+        if (job_submit_counted(pool, &counter, run, &chunks[i], NULL) != 0) {
+            run(&chunks[i], NULL);
+        }
+    }
+
+    job_wait(pool, &counter);
+}
+
+/// Indexes buf[0, len) into an empty index, split across the pool when
+/// the buffer is large enough to be worth it
+static void line_index_build(PTableLineIndex* index, const char* buf, size_t len, JobPool* pool) {
+    size_t chunk_count = (len + PTABLE_LINE_CHUNK_SIZE - 1) / PTABLE_LINE_CHUNK_SIZE;
+    struct line_chunk* chunks = NULL;
+
+    if (pool && chunk_count > 1) {
+        chunks = malloc(chunk_count * sizeof(struct line_chunk));
+    }
+    if (!chunks) {
+        line_index_scan(index, buf, len, 0);
+        return;
+    }
+
+    for (size_t i = 0; i < chunk_count; i++) {
+        chunks[i].buf = buf;
+        chunks[i].start = i * PTABLE_LINE_CHUNK_SIZE;
+        chunks[i].len = min(PTABLE_LINE_CHUNK_SIZE, len - chunks[i].start);
+    }
+
+    line_chunks_run(pool, chunks, chunk_count, line_chunk_count);
+
+    size_t total = 0;
+    for (size_t i = 0; i < chunk_count; i++) {
+        total += chunks[i].count;
+    }
+
+    if (total > 0 && line_index_reserve(index, total) == 0) {
+        size_t* out = index->line_feeds;
+        for (size_t i = 0; i < chunk_count; i++) {
+            chunks[i].out = out;
+            out += chunks[i].count;
+        }
+
+        line_chunks_run(pool, chunks, chunk_count, line_chunk_fill);
+        index->count = total;
+    }
+
+    free(chunks);
+}
+
+/// Index of the first recorded line feed at or past `offset`
+static size_t line_index_lower_bound(const PTableLineIndex* index, size_t offset) {
+    size_t lo = 0;
+    size_t hi = index->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->line_feeds[mid] < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static inline size_t line_index_count(const PTableLineIndex* index, size_t start, size_t end) {
+    return line_index_lower_bound(index, end) - line_index_lower_bound(index, start);
+}
+
+/* Tree primitives */
+
+static inline int32_t node_height(PTableNode* node) {
+    return node ? node->height : 0;
+}
+
+static inline size_t node_length(PTableNode* node) {
+    return node ? node->subtree_length : 0;
+}
+
+static inline size_t node_lf(PTableNode* node) {
+    return node ? node->subtree_lf : 0;
+}
+
+static inline size_t node_add(PTableNode* node) {
+    return node ? node->subtree_add : 0;
+}
+
+static void node_update(PTableNode* node) {
+    node->height = max(node_height(node->left), node_height(node->right)) + 1;
+    node->subtree_length = node_length(node->left) + node->length + node_length(node->right);
+    node->subtree_lf = node_lf(node->left) + node->lf_count + node_lf(node->right);
+    node->subtree_add = node_add(node->left) + (node->node_type == ADDITION ? node->length : 0) + node_add(node->right);
+}
+
+static inline PTableLineIndex* ptable_lines(PTable* table, PTableNodeType type) {
+    return type == ORIGINAL ? &table->original.lines : &table->add.lines;
+}
+
+/// Line feeds in a piece, zero for original text until the index exists
+static size_t piece_lf(PTable* table, PTableNodeType type, size_t start, size_t length) {
+    if (type == ORIGINAL && !table->lines_ready) return 0;
+    return line_index_count(ptable_lines(table, type), start, start + length);
+}
+
+/// Touches no table state, so background jobs can build nodes too.
+/// Aborts on allocation failure like node_own, a half split tree
+/// can't be unwound.
+static PTableNode* node_alloc(PTableNodeType type, size_t start, size_t length, size_t lf_count) {
+    PTableNode* node = malloc(sizeof(PTableNode));
+    if (!node) {
+        perror("Failed to allocate piece table node");
+        abort();
+    }
+
+    node->node_type = type;
+    node->start = start;
+    node->length = length;
+    node->lf_count = lf_count;
+    node->left = NULL;
+    node->right = NULL;
+    atomic_init(&node->refs, 1);
+    node_update(node);
+
+    return node;
+}
+
+static PTableNode* node_create(PTable* table, PTableNodeType type, size_t start, size_t length) {
+    PTableNode* node = node_alloc(type, start, length, piece_lf(table, type, start, length));
+    table->stats.nodes_created++;
+    return node;
+}
+
+static inline void node_ref(PTableNode* node) {
+    if (node) atomic_fetch_add_explicit(&node->refs, 1, memory_order_relaxed);
+}
+
+/// Drops one reference, frees the node and unreferences its children
+/// once nothing points at it. Safe from any thread.
+static void node_unref(PTableNode* node) {
+    if (!node) return;
+    if (atomic_fetch_sub_explicit(&node->refs, 1, memory_order_acq_rel) != 1) return;
+
+    node_unref(node->left);
+    node_unref(node->right);
+    free(node);
+}
+
+static size_t node_piece_count(PTableNode* node) {
+    if (!node) return 0;
+    return 1 + node_piece_count(node->left) + node_piece_count(node->right);
+}
+
+/// Returns a node the caller may change in place, copying `node` when
+/// anything else still references it. The caller's reference moves to
+/// the returned node. Only ever called top down, so the parent of a
+/// shared node has already been copied and holds its own reference.
+static PTableNode* node_own(PTable* table, PTableNode* node) {
+    if (!node || atomic_load_explicit(&node->refs, memory_order_acquire) == 1) return node;
+
+    PTableNode* copy = malloc(sizeof(PTableNode));
+    if (!copy) {
+        perror("Failed to copy piece table node");
+        abort();
+    }
+
+    copy->node_type = node->node_type;
+    copy->start = node->start;
+    copy->length = node->length;
+    copy->lf_count = node->lf_count;
+    copy->left = node->left;
+    copy->right = node->right;
+    copy->subtree_length = node->subtree_length;
+    copy->subtree_lf = node->subtree_lf;
+    copy->subtree_add = node->subtree_add;
+    copy->height = node->height;
+    atomic_init(&copy->refs, 1);
+
+    node_ref(copy->left);
+    node_ref(copy->right);
+    node_unref(node);
+    table->stats.nodes_copied++;
+
+    return copy;
+}
+
+static PTableNode* node_rotate_left(PTable* table, PTableNode* node) {
+    node = node_own(table, node);
+    PTableNode* pivot = node_own(table, node->right);
+    node->right = pivot->left;
+    pivot->left = node;
+    node_update(node);
+    node_update(pivot);
+    return pivot;
+}
+
+static PTableNode* node_rotate_right(PTable* table, PTableNode* node) {
+    node = node_own(table, node);
+    PTableNode* pivot = node_own(table, node->left);
+    node->left = pivot->right;
+    pivot->right = node;
+    node_update(node);
+    node_update(pivot);
+    return pivot;
+}
+
+/// `node` must already be owned
+static PTableNode* node_balance(PTable* table, PTableNode* node) {
+    node_update(node);
+    int32_t factor = node_height(node->left) - node_height(node->right);
+
+    if (factor > 1) {
+        if (node_height(node->left->left) < node_height(node->left->right)) {
+            node->left = node_rotate_left(table, node->left);
+        }
+        return node_rotate_right(table, node);
+    } else if (factor < -1) {
+        if (node_height(node->right->right) < node_height(node->right->left)) {
+            node->right = node_rotate_right(table, node->right);
+        }
+        return node_rotate_left(table, node);
+    }
+
+    return node;
+}
+
+/// Joins two trees around a detached middle node. Every piece in `left`
+/// precedes `mid` and every piece in `right` follows it. O(|h(l) - h(r)|)
+/// Takes over the references to all three, `mid` must be owned.
+static PTableNode* node_join(PTable* table, PTableNode* left, PTableNode* mid, PTableNode* right) {
+    int32_t lh = node_height(left);
+    int32_t rh = node_height(right);
+
+    if (lh > rh + 1) {
+        left = node_own(table, left);
+        left->right = node_join(table, left->right, mid, right);
+        return node_balance(table, left);
+    } else if (rh > lh + 1) {
+        right = node_own(table, right);
+        right->left = node_join(table, left, mid, right->left);
+        return node_balance(table, right);
+    }
+
+    mid->left = left;
+    mid->right = right;
+    node_update(mid);
+    return mid;
+}
+
+static PTableNode* node_detach_last(PTable* table, PTableNode* node, PTableNode** last) {
+    node = node_own(table, node);
+    if (!node->right) {
+        *last = node;
+        return node->left;
+    }
+
+    node->right = node_detach_last(table, node->right, last);
+    return node_balance(table, node);
+}
+
+/// Joins two trees without a middle node
+static PTableNode* node_join2(PTable* table, PTableNode* left, PTableNode* right) {
+    if (!left) return right;
+    if (!right) return left;
+
+    PTableNode* last = NULL;
+    left = node_detach_last(table, left, &last);
+    return node_join(table, left, last, right);
+}
+
+/// Splits the tree so that `out_left` holds document bytes [0, pos) and
+/// `out_right` the rest. A piece straddling `pos` is cut in two.
+static void node_split(PTable* table, PTableNode* node, size_t pos, PTableNode** out_left, PTableNode** out_right) {
+    if (!node) {
+        *out_left = NULL;
+        *out_right = NULL;
+        return;
+    }
+
+    // The node is reused as a join middle, its child references move here
+    node = node_own(table, node);
+    PTableNode* left = node->left;
+    PTableNode* right = node->right;
+    size_t left_len = node_length(left);
+
+    if (pos < left_len) {
+        PTableNode* split_right = NULL;
+        node_split(table, left, pos, out_left, &split_right);
+        *out_right = node_join(table, split_right, node, right);
+    } else if (pos == left_len) {
+        *out_left = left;
+        *out_right = node_join(table, NULL, node, right);
+    } else if (pos < left_len + node->length) {
+        size_t offset = pos - left_len;
+        PTableNode* tail = node_create(table, node->node_type, node->start + offset, node->length - offset);
+        table->node_count++;
+        node->length = offset;
+        node->lf_count -= tail->lf_count;
+
+        *out_left = node_join(table, left, node, NULL);
+        *out_right = node_join(table, NULL, tail, right);
+    } else {
+        PTableNode* split_left = NULL;
+        node_split(table, right, pos - left_len - node->length, &split_left, out_right);
+        *out_left = node_join(table, left, node, split_left);
+    }
+}
+
+/// Whether the piece ending exactly at `pos` is an addition piece that also
+/// ends at `add_start`, the old tail of the add buffer, so typing there can
+/// grow it instead of adding a piece
+static int32_t node_can_extend(PTableNode* node, size_t pos, size_t add_start) {
+    while (node) {
+        size_t left_len = node_length(node->left);
+        size_t node_end = left_len + node->length;
+
+        if (pos <= left_len) {
+            node = node->left;
+        } else if (pos < node_end) {
+            return 0;
+        } else if (pos == node_end) {
+            // The extension must also stay inside the piece's chunk
+            return node->node_type == ADDITION && node->start + node->length == add_start && (add_start & PTABLE_ADD_CHUNK_MASK) != 0;
+        } else {
+            pos -= node_end;
+            node = node->right;
+        }
+    }
+
+    return 0;
+}
+
+/// Grows the piece found by node_can_extend by `len` bytes. Only lengths
+/// change, so the path is owned on the way down, aggregates are refreshed
+/// on the way back up and no rebalancing is needed.
+static void node_extend(PTable* table, PTableNode** link, size_t pos, size_t len, size_t lf) {
+    PTableNode* path[PTABLE_MAX_HEIGHT];
+    int32_t depth = 0;
+
+    for (;;) {
+        PTableNode* node = node_own(table, *link);
+        *link = node;
+        path[depth++] = node;
+
+        size_t left_len = node_length(node->left);
+        size_t node_end = left_len + node->length;
+
+        if (pos <= left_len) {
+            link = &node->left;
+        } else if (pos == node_end) {
+            node->length += len;
+            node->lf_count += lf;
+            break;
+        } else {
+            pos -= node_end;
+            link = &node->right;
+        }
+    }
+
+    while (depth > 0) {
+        node_update(path[--depth]);
+    }
+}
+
+/// Address of byte `at` of the piece
+static inline const char* view_piece_ptr(const PTableView* view, PTableNode* node, size_t at) {
+    size_t offset = node->start + at;
+
+    switch (node->node_type) {
+        case ORIGINAL: return view->original + offset;
+        case ADDITION: return view->chunks[offset >> PTABLE_ADD_CHUNK_SHIFT] + (offset & PTABLE_ADD_CHUNK_MASK);
+    }
+
+    return NULL;
+}
+
+static inline const char* ptable_piece_ptr(PTable* table, PTableNode* node, size_t at) {
+    size_t offset = node->start + at;
+
+    switch (node->node_type) {
+        case ORIGINAL: return table->original.buffer + offset;
+        case ADDITION: return table->add.chunks[offset >> PTABLE_ADD_CHUNK_SHIFT] + (offset & PTABLE_ADD_CHUNK_MASK);
+    }
+
+    return NULL;
+}
+
+static inline const PTableLineIndex* view_lines(const PTableView* view, PTableNodeType type) {
+    return type == ORIGINAL ? &view->original_lines : &view->add_lines;
+}
+
+static PTableView ptable_view(PTable* table) {
+    PTableView view = {
+        .root = table->root,
+        .original = table->original.buffer,
+        .chunks = table->add.chunks,
+        .original_lines = table->original.lines,
+        .add_lines = table->add.lines,
+        .lines_ready = table->lines_ready,
+    };
+
+    return view;
+}
+
+/* Add buffer */
+
+static char* add_buffer_new_chunk(PTableAddBuffer* add) {
+    if (!add->arena.buf && arena_reserve(&add->arena, PTABLE_ADD_RESERVE) != 0) {
+        return NULL;
+    }
+
+    // Every byte of a chunk is written before any piece can reference it
+    char* chunk = arena_alloc_nz(&add->arena, PTABLE_ADD_CHUNK_SIZE);
+    if (!chunk) {
+        fprintf(stderr, "Add buffer reserve of %zu bytes exhausted\n", (size_t) PTABLE_ADD_RESERVE);
+        return NULL;
+    }
+
+    // Only the directory moves when it grows, the chunks stay put. Older
+    // directories stay in the arena for snapshots still using them.
+    if (add->chunk_count == add->chunk_capacity) {
+        size_t new_capacity = add->chunk_capacity ? add->chunk_capacity * 2 : PTABLE_ADD_INIT_CHUNKS;
+        char** new_chunks = arena_resize(&add->arena, add->chunks, add->chunk_capacity * sizeof(char*), new_capacity * sizeof(char*));
+        if (!new_chunks) {
+            perror("Failed to grow add buffer chunk list");
+            return NULL;
+        }
+        add->chunks = new_chunks;
+        add->chunk_capacity = new_capacity;
+    }
+
+    add->chunks[add->chunk_count++] = chunk;
+    return chunk;
+}
+
+/// Opens chunks until `len` more bytes fit, so the appends that follow
+/// can't fail half way through. Returns 0 on success.
+static int32_t add_buffer_reserve(PTableAddBuffer* add, size_t len) {
+    while (add->chunk_count * PTABLE_ADD_CHUNK_SIZE - add->offset < len) {
+        if (!add_buffer_new_chunk(add)) return -1;
+    }
+    return 0;
+}
+
+/// Appends as much of `text` as fits in the current chunk, opening a new
+/// chunk when every reserved one is full. Returns the number of bytes written.
+static size_t add_buffer_append(PTableAddBuffer* add, const char* text, size_t len) {
+    size_t chunk_pos = add->offset & PTABLE_ADD_CHUNK_MASK;
+
+    if (add->offset == add->chunk_count * PTABLE_ADD_CHUNK_SIZE) {
+        if (!add_buffer_new_chunk(add)) return 0;
+        chunk_pos = 0;
+    }
+
+    size_t written = min(len, PTABLE_ADD_CHUNK_SIZE - chunk_pos);
+    memcpy(add->chunks[add->offset >> PTABLE_ADD_CHUNK_SHIFT] + chunk_pos, text, written);
+    line_index_scan(&add->lines, text, written, add->offset);
+    add->offset += written;
+
+    return written;
+}
+
+/// The chunk directory and the line index live in the arena as well
+static void add_buffer_release(PTableAddBuffer* add) {
+    arena_release(&add->arena);
+}
+
+typedef void ptable_walk_func(PTable* table, PTableNode* node, void* user);
+
+/// In-order walk over the pieces under `root` without recursion
+static void node_walk(PTable* table, PTableNode* root, ptable_walk_func* func, void* user) {
+    PTableNode* stack[PTABLE_MAX_HEIGHT];
+    int32_t depth = 0;
+    PTableNode* cursor = root;
+
+    while (cursor || depth > 0) {
+        while (cursor) {
+            stack[depth++] = cursor;
+            cursor = cursor->left;
+        }
+
+        cursor = stack[--depth];
+        func(table, cursor, user);
+        cursor = cursor->right;
+    }
+}
+
+static inline void ptable_walk(PTable* table, ptable_walk_func* func, void* user) {
+    node_walk(table, table->root, func, user);
+}
+
+/* PTable manipulation */
+
+/// Records that an edit at `pos` changed the document. Line numbers are
+/// only known once the line index is built, before that the whole
+/// document is reported.
+static void ptable_mark_dirty(PTable* table, size_t pos, size_t lf_before) {
+    size_t first = 0;
+    size_t last = SIZE_MAX;
+
+    if (table->lines_ready) {
+        ptable_offset_to_line(table, pos, &first, NULL);
+        if (node_lf(table->root) == lf_before) last = first;
+    }
+
+    if (table->dirty) {
+        first = min(first, table->dirty_first_line);
+        last = max(last, table->dirty_last_line);
+    }
+
+    table->dirty = 1;
+    table->dirty_first_line = first;
+    table->dirty_last_line = last;
+}
+
+uint8_t ptable_has_dirty_lines(PTable* table) {
+    return table->dirty;
+}
+
+int32_t ptable_take_dirty_lines(PTable* table, size_t* first_line, size_t* last_line) {
+    if (!table->dirty) return 0;
+
+    *first_line = table->dirty_first_line;
+    *last_line = table->dirty_last_line;
+    table->dirty = 0;
+
+    return 1;
+}
 
 PTable* ptable_create(const char* buff) {
-    size_t len = strlen(buff);
-    PTableCBuffer original = { .buffer = (char* ) buff, .size = len, .offset = len - 1 };
+    return ptable_create_len(buff, strlen(buff), BUFFER_OWNED);
+}
+
+/// The buffer needs no terminator and may hold any bytes. It is used in
+/// place as the original text and released according to `owner`.
+PTable* ptable_create_len(const char* buff, size_t len, PTableBufferOwner owner) {
+    PTableCBuffer original = { .buffer = (char* ) buff, .size = len, .offset = len, .owner = owner };
+
+    PTable* table = malloc(sizeof(PTable));
+    table->root = NULL;
+    table->node_count = 0;
+    table->lines_ready = 0;
+    table->dirty = 0;
+    table->dirty_first_line = 0;
+    table->dirty_last_line = 0;
+    memset(&table->stats, 0, sizeof(PTableStats));
+    memset(&table->history, 0, sizeof(PTableHistory));
+    table->compacting = 0;
+    table->compacted_pieces = 0;
+    atomic_init(&table->refs, 1);
+    table->original = original;
+    memset(&table->add, 0, sizeof(PTableAddBuffer));
+    table->add.lines.arena = &table->add.arena;
+
+    if (len > 0) {
+        table->root = node_create(table, ORIGINAL, 0, len);
+        table->node_count = 1;
+    }
+
+    return table;
+}
+
+PTable* ptable_open(const char* path) {
+    file_buff_t file = {0};
+    if (map_full_file(path, &file) != 0) {
+        return NULL;
+    }
+
+    return ptable_create_len(file.buff, file.length, BUFFER_MAPPED);
+}
+
+/// The copy lands at the same address, snapshots read on other threads
+/// keep their pointers
+int32_t ptable_detach_original(PTable* table) {
+    PTableCBuffer* original = &table->original;
+    if (original->owner != BUFFER_MAPPED) return 0;
+
+    file_buff_t file = { .buff = original->buffer, .length = original->size };
+    if (copy_mapped_file(&file) != 0) {
+        perror("Failed to copy mapped file");
+        return -1;
+    }
+
+    original->owner = BUFFER_DETACHED;
+    return 0;
+}
+
+/* History */
+
+static int32_t version_push(PTableVersionStack* stack, PTableVersion version) {
+    if (stack->count == stack->capacity) {
+        size_t new_capacity = stack->capacity ? stack->capacity * 2 : PTABLE_INIT_HISTORY_SIZE;
+        PTableVersion* versions = realloc(stack->versions, new_capacity * sizeof(PTableVersion));
+        if (!versions) {
+            perror("Failed to grow undo history");
+            return -1;
+        }
+        stack->versions = versions;
+        stack->capacity = new_capacity;
+    }
+
+    stack->versions[stack->count++] = version;
+    return 0;
+}
+
+static void version_stack_clear(PTableVersionStack* stack) {
+    for (size_t i = 0; i < stack->count; i++) {
+        node_unref(stack->versions[i].root);
+    }
+    stack->count = 0;
+}
+
+static void version_stack_release(PTableVersionStack* stack) {
+    version_stack_clear(stack);
+    free(stack->versions);
+    stack->versions = NULL;
+    stack->capacity = 0;
+}
+
+/// Runs before every edit. Keeps the current root as an undo step, unless
+/// the open group already did, and forgets whatever could be redone.
+static void ptable_history_save(PTable* table, size_t pos) {
+    PTableHistory* history = &table->history;
+    if (history->group_depth > 0 && history->group_saved) return;
+
+    PTableVersion version = { table->root, table->node_count, pos, table->lines_ready };
+    node_ref(table->root);
+    if (version_push(&history->undo, version) != 0) {
+        node_unref(table->root);
+        return;
+    }
+
+    history->group_saved = history->group_depth > 0;
+    version_stack_clear(&history->redo);
+}
+
+void ptable_begin_group(PTable* table) {
+    if (table->history.group_depth++ == 0) table->history.group_saved = 0;
+}
+
+void ptable_end_group(PTable* table) {
+    if (table->history.group_depth > 0) table->history.group_depth--;
+}
+
+int32_t ptable_insert(PTable* table, size_t pos, const char* text) {
+    return ptable_insert_len(table, pos, text, strlen(text));
+}
+
+/// Inserts `text_len` bytes, which may include zeros, as one edit. The
+/// add buffer space is reserved before the undo step is taken, a failed
+/// insert leaves both the text and the history alone.
+int32_t ptable_insert_len(PTable* table, size_t pos, const char* text, size_t text_len) {
+    size_t doc_len = ptable_get_length(table);
+
+    if (pos > doc_len) {
+        fprintf(stderr, "Insertion pos %zu out of bounds (doc length %zu).\n", pos, doc_len);
+        return -1;
+    }
+    if (text_len == 0) return 0;
+    if (add_buffer_reserve(&table->add, text_len) != 0) return -1;
+
+    ptable_history_save(table, pos);
+    table->stats.inserts++;
+    size_t edit_pos = pos;
+    size_t lf_before = node_lf(table->root);
+
+    while (text_len > 0) {
+        size_t add_lf_before = table->add.lines.count;
+        size_t add_start = table->add.offset;
+        size_t written = add_buffer_append(&table->add, text, text_len);
+
+        size_t lf_count = table->add.lines.count - add_lf_before;
+        text += written;
+        text_len -= written;
+
+        // Typing right after the last insert extends its piece in place
+        if (node_can_extend(table->root, pos, add_start)) {
+            node_extend(table, &table->root, pos, written, lf_count);
+            table->stats.coalesced_inserts++;
+        } else {
+            PTableNode* addition = node_create(table, ADDITION, add_start, written);
+            table->node_count++;
+
+            PTableNode* left = NULL;
+            PTableNode* right = NULL;
+            node_split(table, table->root, pos, &left, &right);
+            table->root = node_join(table, left, addition, right);
+        }
+
+        pos += written;
+    }
+
+    ptable_mark_dirty(table, edit_pos, lf_before);
+    return 0;
+}
+
+static char view_index(const PTableView* view, size_t at) {
+    PTableNode* cursor = view->root;
+
+    while (cursor) {
+        size_t left_len = node_length(cursor->left);
+
+        if (at < left_len) {
+            cursor = cursor->left;
+        } else if (at < left_len + cursor->length) {
+            return *view_piece_ptr(view, cursor, at - left_len);
+        } else {
+            at -= left_len + cursor->length;
+            cursor = cursor->right;
+        }
+    }
+
+    return '\0';
+}
+
+char ptable_index(PTable* table, size_t at) {
+    PTableView view = ptable_view(table);
+    return view_index(&view, at);
+}
+
+void ptable_delete(PTable* table, size_t pos, size_t len) {
+    size_t doc_len = ptable_get_length(table);
+    if (pos >= doc_len || len == 0) return;
+    if (len > doc_len - pos) len = doc_len - pos;
+    ptable_history_save(table, pos);
+    table->stats.deletes++;
+    size_t lf_before = node_lf(table->root);
+
+    // N: |--left--|--removed--|--right--|
+    PTableNode* left = NULL;
+    PTableNode* rest = NULL;
+    PTableNode* removed = NULL;
+    PTableNode* right = NULL;
 
-    char* a_buff = malloc(sizeof(char) * PTABLE_INIT_ADD_SIZE);
-    PTableCBuffer addition = { .buffer = a_buff, .size = PTABLE_INIT_ADD_SIZE, .offset = 0 };
+    node_split(table, table->root, pos, &left, &rest);
+    node_split(table, rest, len, &removed, &right);
+
+    table->node_count -= node_piece_count(removed);
+    node_unref(removed);
+    table->root = node_join2(table, left, right);
+
+    ptable_mark_dirty(table, pos, lf_before);
+}
+
+/* Batches */
+
+struct batch_piece {
+    PTableNodeType type;
+    size_t start;
+    size_t length;
+    size_t lf_count;
+};
+
+/// Builds a new piece sequence while walking an old one in order
+struct batch_merge {
+    PTable* table;
+    const PTableEdit* edits;
+    size_t count;
+    size_t next;
+
+    // Document offset of the next old byte, and old bytes still to drop
+    size_t pos;
+    size_t skip;
+
+    // Inserted text goes here, the table's own add buffer for batches
+    PTableAddBuffer* add;
+
+    // Pieces live in a scratch arena of the thread doing the merge
+    Arena* scratch;
+    struct batch_piece* pieces;
+    size_t piece_count;
+    size_t capacity;
+    uint8_t failed;
+};
+
+static void batch_emit(struct batch_merge* merge, PTableNodeType type, size_t start, size_t length, size_t lf_count) {
+    if (length == 0 || merge->failed) return;
+
+    // Neighbours that meet in their buffer become one piece again, as long
+    // as the result stays inside one add chunk
+    if (merge->piece_count > 0) {
+        struct batch_piece* last = &merge->pieces[merge->piece_count - 1];
+        uint8_t same_chunk = type == ORIGINAL || (last->start >> PTABLE_ADD_CHUNK_SHIFT) == ((start + length - 1) >> PTABLE_ADD_CHUNK_SHIFT);
+        if (last->type == type && last->start + last->length == start && same_chunk) {
+            last->length += length;
+            last->lf_count += lf_count;
+            return;
+        }
+    }
+
+    if (merge->piece_count == merge->capacity) {
+        size_t new_capacity = merge->capacity ? merge->capacity * 2 : PTABLE_INIT_BATCH_PIECES;
+        struct batch_piece* pieces = arena_resize(merge->scratch, merge->pieces, merge->capacity * sizeof(struct batch_piece),
+                                                  new_capacity * sizeof(struct batch_piece));
+        if (!pieces) {
+            perror("Failed to grow batch pieces");
+            merge->failed = 1;
+            return;
+        }
+        merge->pieces = pieces;
+        merge->capacity = new_capacity;
+    }
+
+    merge->pieces[merge->piece_count++] = (struct batch_piece) { type, start, length, lf_count };
+}
+
+static void batch_emit_text(struct batch_merge* merge, const char* text, size_t len) {
+    PTableAddBuffer* add = merge->add;
+
+    while (len > 0) {
+        size_t lf_before = add->lines.count;
+        size_t add_start = add->offset;
+        size_t written = add_buffer_append(add, text, len);
+        if (written == 0) {
+            merge->failed = 1;
+            return;
+        }
+
+        batch_emit(merge, ADDITION, add_start, written, add->lines.count - lf_before);
+        text += written;
+        len -= written;
+    }
+}
+
+/// Emits the part of a piece that is kept, whole pieces keep their count
+static void batch_emit_part(struct batch_merge* merge, PTableNode* node, size_t offset, size_t length) {
+    if (length == 0) return;
+
+    size_t lf_count = node->lf_count;
+    if (length != node->length) lf_count = piece_lf(merge->table, node->node_type, node->start + offset, length);
+    batch_emit(merge, node->node_type, node->start + offset, length, lf_count);
+}
+
+static void batch_merge_piece(PTable* table, PTableNode* node, void* user) {
+    unused(table);
+    struct batch_merge* merge = user;
+    size_t offset = 0;
+
+    while (offset < node->length) {
+        size_t rest = node->length - offset;
+
+        if (merge->skip > 0) {
+            size_t dropped = min(merge->skip, rest);
+            merge->skip -= dropped;
+            merge->pos += dropped;
+            offset += dropped;
+            continue;
+        }
+
+        // Edits at the end of the piece are handled by the next one
+        if (merge->next == merge->count || merge->edits[merge->next].pos >= merge->pos + rest) {
+            batch_emit_part(merge, node, offset, rest);
+            merge->pos += rest;
+            break;
+        }
+
+        const PTableEdit* edit = &merge->edits[merge->next++];
+        size_t keep = edit->pos - merge->pos;
+        batch_emit_part(merge, node, offset, keep);
+        offset += keep;
+        merge->pos += keep;
+
+        batch_emit_text(merge, edit->text, edit->text_len);
+        merge->skip = edit->delete_len;
+    }
+}
+
+/// Balanced tree over pieces[lo, hi) in O(hi - lo)
+static PTableNode* batch_build(const struct batch_piece* pieces, size_t lo, size_t hi) {
+    if (lo >= hi) return NULL;
+
+    size_t mid = lo + (hi - lo) / 2;
+    PTableNode* node = node_alloc(pieces[mid].type, pieces[mid].start, pieces[mid].length, pieces[mid].lf_count);
+
+    node->left = batch_build(pieces, lo, mid);
+    node->right = batch_build(pieces, mid + 1, hi);
+    node_update(node);
+
+    return node;
+}
+
+/// Swaps in the tree built from the merged pieces
+static void batch_install(PTable* table, PTableNode* root, size_t piece_count) {
+    node_unref(table->root);
+    table->root = root;
+    table->node_count = piece_count;
+    table->stats.nodes_created += piece_count;
+}
+
+/// Large batches are merged with the piece sequence in one pass and the
+/// tree is rebuilt from the result, O(pieces + edits). Small ones go
+/// back to front through split and join, which keeps earlier offsets
+/// valid and costs O(edits * log pieces).
+int32_t ptable_apply_batch(PTable* table, const PTableEdit* edits, size_t count) {
+    size_t doc_len = ptable_get_length(table);
+    size_t text_len = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t end = edits[i].pos + edits[i].delete_len;
+        text_len += edits[i].text_len;
+        if (edits[i].pos > doc_len || edits[i].delete_len > doc_len - edits[i].pos) {
+            fprintf(stderr, "Batch edit %zu out of bounds (doc length %zu).\n", i, doc_len);
+            return -1;
+        }
+        if (i + 1 < count && end > edits[i + 1].pos) {
+            fprintf(stderr, "Batch edit %zu overlaps or is out of order.\n", i);
+            return -1;
+        }
+    }
+    if (count == 0) return 0;
+
+    // With the text's room taken up front neither path can fail half way
+    if (add_buffer_reserve(&table->add, text_len) != 0) return -1;
+
+    if (count * PTABLE_BATCH_SPLIT_COST < table->node_count) {
+        ptable_begin_group(table);
+        for (size_t i = count; i-- > 0;) {
+            ptable_delete(table, edits[i].pos, edits[i].delete_len);
+            ptable_insert_len(table, edits[i].pos, edits[i].text, edits[i].text_len);
+        }
+        ptable_end_group(table);
+        return 0;
+    }
+
+    ArenaTemp scratch = scratch_begin(NULL, 0);
+    struct batch_merge merge = { .table = table, .edits = edits, .count = count, .add = &table->add, .scratch = scratch.arena };
+    ptable_walk(table, batch_merge_piece, &merge);
+
+    // Whatever is left sits at the very end of the document
+    while (merge.next < count) {
+        const PTableEdit* edit = &merge.edits[merge.next++];
+        batch_emit_text(&merge, edit->text, edit->text_len);
+    }
 
-    PTableNode first = {.node_type = ORIGINAL, .length = len, .start = 0};
+    if (merge.failed) {
+        scratch_end(scratch);
+        return -1;
+    }
 
-    PTableNode* nodes = malloc(sizeof(PTableNode) * PTABLE_INIT_NODE_SIZE);
-    nodes[0] = first;
+    ptable_history_save(table, edits[0].pos);
+    size_t lf_before = node_lf(table->root);
 
-    PTable* table = malloc(sizeof(PTable));
-    table->nodes = nodes;
-    table->node_count = 1;
-    table->original = original;
-    table->add = addition;
+    batch_install(table, batch_build(merge.pieces, 0, merge.piece_count), merge.piece_count);
+    scratch_end(scratch);
 
-    return table;
+    ptable_mark_dirty(table, edits[0].pos, lf_before);
+    return 0;
 }
 
-void ptable_insert(PTable* table, size_t pos, const char* text) {
-    size_t text_len = strlen(text);
+/* Compaction */
 
-    if (table->add.offset + text_len > table->add.size) {
-        // Reallocate
-        table->add.size = (table->add.offset + text_len + 1) * 2;
-        char* new_add_buffer = (char*) realloc(table->add.buffer, table->add.size);
-        if (!new_add_buffer) {
-            perror("Failed to realloc add buffer size");
-            return;
-        }
-        table->add.buffer = new_add_buffer;
-    }
-    strcpy(table->add.buffer + table->add.offset, text);
-    size_t add_start = table->add.offset;
-    table->add.offset += text_len;
-
-    PTableNode addition = {.node_type = ADDITION, .length = text_len, .start = add_start};
-    size_t node_offset_pos = 0;
-
-    for (size_t i = 0; i < table->node_count; i++) {
-        PTableNode* cursor = &table->nodes[i];
-        size_t c_start = node_offset_pos;
-        size_t c_end = node_offset_pos + cursor->length;
-
-        if (pos >= c_start && pos <= c_end) {
-            size_t offset = pos - c_start;
-            if (offset == 0) {
-                // Insert before node
-                memmove(&table->nodes[i + 1], &table->nodes[i], (table->node_count - i) * sizeof(PTableNode));
-                table->nodes[i] = addition;
-                table->node_count++;
-            } else if (offset == cursor->length) {
-                // Insert after node
-                memmove(&table->nodes[i + 2], &table->nodes[i + 1], (table->node_count - (i + 1)) * sizeof(PTableNode));
-                table->nodes[i+1] = addition;
-                table->node_count++;
-            }  else {
-                // Split node
-                // Move next nodes as if inserting after
-                memmove(&table->nodes[i + 3], &table->nodes[i + 1], (table->node_count - (i + 1)) * sizeof(PTableNode));
-                table->nodes[i+1] = addition;
-                table->node_count++;
-
-                // Adjust the "current node"
-                PTableNode node_a = *cursor;
-                node_a.length = offset;
-
-                PTableNode node_b = *cursor;
-                node_b.start = node_a.start + node_a.length;
-                //node_b.length = c_end - node_b.start;
-                node_b.length = cursor->length - node_a.length;
-
-                table->nodes[i] = node_a;
-                table->nodes[i+2] = node_b;
-                table->node_count++;
-            }
+void ptable_fragmentation(PTable* table, PTableFragmentation* out) {
+    out->pieces = table->node_count;
+    out->live_bytes = node_length(table->root);
+    out->add_bytes = table->add.offset;
+    out->add_live_bytes = node_add(table->root);
+    out->add_dead_bytes = out->add_bytes - min(out->add_live_bytes, out->add_bytes);
+}
 
-            return;
-        }
+uint32_t ptable_compaction_wanted(PTable* table) {
+    PTableFragmentation frag;
+    ptable_fragmentation(table, &frag);
+    uint32_t flags = 0;
 
-        node_offset_pos += cursor->length;
+    // Pieces that did not merge last time are not retried until the count doubles
+    if (frag.pieces >= PTABLE_COMPACT_MIN_PIECES && frag.live_bytes / frag.pieces < PTABLE_COMPACT_SMALL_PIECE &&
+        frag.pieces >= table->compacted_pieces * 2) {
+        flags |= PTABLE_COMPACT_MERGE;
     }
 
-    // End of table
-    if (pos == node_offset_pos) {
-        // TODO: Ensure capacity
-        table->nodes[table->node_count] = addition;
-        table->node_count++;
+    if (frag.add_dead_bytes >= PTABLE_COMPACT_MIN_DEAD && frag.add_dead_bytes > frag.add_live_bytes) {
+        flags |= PTABLE_COMPACT_ADD;
+    }
+
+    return flags;
+}
+
+static void ptable_compact_done(PTable* table, PTableNode* root, size_t piece_count) {
+    batch_install(table, root, piece_count);
+    table->compacted_pieces = piece_count;
+    table->stats.compactions++;
+}
+
+static void compact_add_piece(PTable* table, PTableNode* node, void* user) {
+    struct batch_merge* merge = user;
+
+    if (node->node_type == ORIGINAL) {
+        batch_emit(merge, ORIGINAL, node->start, node->length, node->lf_count);
     } else {
-        // TODO: Ensure bounds
-        fprintf(stderr, "Insertion pos %zu out of bounds (doc length %zu).\n", pos, node_offset_pos);
+        batch_emit_text(merge, ptable_piece_ptr(table, node, 0), node->length);
     }
 }
 
-char ptable_index(PTable* table, size_t at) {
-    size_t logical_pos = 0;
-    size_t to_find_idx = at;
-
-    for (size_t i = 0; i < table->node_count; i++) {
-        PTableNode* cursor = &table->nodes[i];
-        if (logical_pos < cursor->length) {
-            const char* source_buffer_ptr = NULL;
-            switch (cursor->node_type) {
-                case ORIGINAL: {
-                    source_buffer_ptr = table->original.buffer;
-                } break;
-                case ADDITION: {
-                    source_buffer_ptr = table->add.buffer;
-                } break;
-            }
-
-            // TODO Possible bound check placemenet
-
-            size_t actual_buffer_offset = cursor->start + to_find_idx;
-            return source_buffer_ptr[actual_buffer_offset];
-        } else {
-            to_find_idx -= cursor->length;
-        }
+/// Copies the added text the document still uses into a fresh buffer,
+/// merging pieces on the way. Undo history and snapshots point into the
+/// old buffer, the history goes and snapshots must be gone.
+static int32_t ptable_compact_add(PTable* table) {
+    if (atomic_load_explicit(&table->refs, memory_order_acquire) > 1) {
+        error_print("Add buffer is still shared with snapshots");
+        return -1;
     }
 
-    return '\0';
+    PTableAddBuffer fresh;
+    memset(&fresh, 0, sizeof(PTableAddBuffer));
+    fresh.lines.arena = &fresh.arena;
+
+    ArenaTemp scratch = scratch_begin(NULL, 0);
+    struct batch_merge merge = { .table = table, .add = &fresh, .scratch = scratch.arena };
+    ptable_walk(table, compact_add_piece, &merge);
+    if (merge.failed) {
+        add_buffer_release(&fresh);
+        scratch_end(scratch);
+        return -1;
+    }
+
+    version_stack_clear(&table->history.undo);
+    version_stack_clear(&table->history.redo);
+    table->history.group_saved = 0;
+
+    ptable_compact_done(table, batch_build(merge.pieces, 0, merge.piece_count), merge.piece_count);
+    scratch_end(scratch);
+
+    add_buffer_release(&table->add);
+    table->add = fresh;
+    table->add.lines.arena = &table->add.arena;
+
+    return 0;
 }
 
-void ptable_delete(PTable* table, size_t pos, size_t len) {
-    // Basically shift offset to the left and add entry
-    //ptable_insert(table, at, NULL, -len);
-
-
-    size_t pos_end = pos + len;
-    size_t cursor_doc_offset = 0;
-
-
-    // New order nodes
-    PTableNode* no_nodes = (PTableNode*) malloc((table->node_count + 1) * sizeof(PTableNode));
-    size_t no_nodes_count = 0;
-
-
-    // Find begin - end nodes
-    for (size_t i = 0; i < table->node_count; i++) {
-        PTableNode cursor = table->nodes[i];
-
-        size_t c_start = cursor_doc_offset;
-        size_t c_end = cursor_doc_offset + cursor.length;
-
-        //printf("pos: %zu pos_end: %zu c_start: %zu c_end: %zu\n", pos, pos_end, c_start, c_end);
-        if (pos_end <= c_start) {
-            /// Include
-            // N: |----|
-            // D:        |----|
-            no_nodes[no_nodes_count++] = cursor;
-        } else if (pos >= c_end) {
-            /// Include
-            // N:        |----|
-            // D: |----|
-            no_nodes[no_nodes_count++] = cursor;
-        } else if (pos >= c_start && pos_end <= c_end) {
-             /// transform
-            // N: |-----|
-            // D:  |---|
-            // ----OR----
-            // N: |-----|
-            // D: |-----|
-            PTableNode part_a = cursor;
-            part_a.length  = pos - c_start;
-            if (part_a.length > 0) {
-                no_nodes[no_nodes_count++] = part_a;
-            }
-
-            PTableNode part_b = cursor;
-            part_b.start = cursor.start + (pos_end - c_start);
-            part_b.length = c_end - pos_end;
-            if (part_b.length > 0) {
-                no_nodes[no_nodes_count++] = part_b;
-            }
-        }else if (pos <= c_start && pos_end >= c_end) {
-            /// completely ignore
-            // N:  |---|
-            // D: |-----|
-        } else if (pos > c_start && pos < c_end && pos_end >= c_end) {
-             /// Include / transform
-            // N: |----|
-            // D:    |----|
-            PTableNode node = cursor;
-            node.length = pos - c_start;
-            if (node.length > 0) {
-                no_nodes[no_nodes_count++] = node;
-            }
-        } else if (pos_end < c_end && pos_end > c_start && pos <= c_start) {
-            /// Include / transform
-            // N:   |----|
-            // D: |----|
-            PTableNode node = cursor;
-            node.start = cursor.start + (pos_end - c_start);
-            node.length = cursor.length - (pos_end - c_start);
-            if (node.length > 0) {
-                no_nodes[no_nodes_count++] = node;
-            }
-        }
-
-        cursor_doc_offset += cursor.length;
-    }
-
-    free(table->nodes);
-    table->nodes = (PTableNode*) malloc(PTABLE_INIT_NODE_SIZE * sizeof(PTableNode));
-    memcpy(table->nodes, no_nodes, no_nodes_count * sizeof(PTableNode));
-    table->node_count = no_nodes_count;
+/// Neither pass changes the text, so no undo step is recorded
+int32_t ptable_compact(PTable* table, uint32_t flags) {
+    if (flags & PTABLE_COMPACT_ADD) return ptable_compact_add(table);
+    if (!(flags & PTABLE_COMPACT_MERGE)) return 0;
 
+    ArenaTemp scratch = scratch_begin(NULL, 0);
+    struct batch_merge merge = { .table = table, .add = &table->add, .scratch = scratch.arena };
+    ptable_walk(table, batch_merge_piece, &merge);
+    if (merge.failed) {
+        scratch_end(scratch);
+        return -1;
+    }
+
+    ptable_compact_done(table, batch_build(merge.pieces, 0, merge.piece_count), merge.piece_count);
+    scratch_end(scratch);
 
+    return 0;
 }
 
-void ptable_release(PTable* table) {
-    free(table->nodes);
-    free(table->original.buffer);
-    free(table->add.buffer);
+struct compact_job {
+    PTable* table;
+    PTableSnapshot* snapshot;
+    struct batch_merge merge;
+    PTableNode* root;
+};
+
+/// Only reads the snapshot. Whole pieces keep their line feed counts, so
+/// the table's line index is never consulted.
+static void compact_job_run(void* data, JobCancel* cancel) {
+    struct compact_job* job = data;
+    if (job_cancelled(cancel)) return;
+
+    // The pieces only live as long as the run, done just needs the count
+    ArenaTemp scratch = scratch_begin(NULL, 0);
+    job->merge.scratch = scratch.arena;
+    node_walk(job->table, job->snapshot->view.root, batch_merge_piece, &job->merge);
+    if (!job->merge.failed) job->root = batch_build(job->merge.pieces, 0, job->merge.piece_count);
+
+    scratch_end(scratch);
+    job->merge.pieces = NULL;
+}
+
+static void compact_job_done(void* data, uint8_t cancelled) {
+    struct compact_job* job = data;
+    PTable* table = job->table;
+    table->compacting = 0;
+
+    // The snapshot keeps its root alive, so an equal root is the same version
+    if (!cancelled && job->root && table->root == job->snapshot->view.root) {
+        ptable_compact_done(table, job->root, job->merge.piece_count);
+        job->root = NULL;
+    }
+
+    node_unref(job->root);
+    ptable_snapshot_release(job->snapshot);
+    free(job);
+}
+
+int32_t ptable_compact_background(PTable* table, JobPool* pool) {
+    if (table->compacting) return 0;
+
+    struct compact_job* job = calloc(1, sizeof(struct compact_job));
+    if (!job) {
+        perror("Failed to allocate compaction");
+        return -1;
+    }
+
+    job->table = table;
+    job->snapshot = ptable_snapshot(table);
+    job->merge.table = table;
+    if (!job->snapshot) {
+        free(job);
+        return -1;
+    }
+
+    if (job_submit(pool, compact_job_run, compact_job_done, job, NULL) != 0) {
+        ptable_snapshot_release(job->snapshot);
+        free(job);
+        return -1;
+    }
+
+    table->compacting = 1;
+    return 0;
+}
+
+/// Frees the buffers once neither the table nor any snapshot uses them
+static void ptable_unref(PTable* table) {
+    if (atomic_fetch_sub_explicit(&table->refs, 1, memory_order_acq_rel) != 1) return;
+
+    switch (table->original.owner) {
+        case BUFFER_OWNED: {
+            free(table->original.buffer);
+        } break;
+        case BUFFER_MAPPED:
+        case BUFFER_DETACHED: {
+            file_buff_t file = { .buff = table->original.buffer, .length = table->original.size };
+            unmap_full_file(&file);
+        } break;
+        case BUFFER_BORROWED: break;
+    }
+    free(table->original.lines.line_feeds);
+    add_buffer_release(&table->add);
     free(table);
 }
 
+void ptable_release(PTable* table) {
+    version_stack_release(&table->history.undo);
+    version_stack_release(&table->history.redo);
+    node_unref(table->root);
+    table->root = NULL;
+    ptable_unref(table);
+}
+
 size_t ptable_get_length(PTable* table) {
+    return node_length(table->root);
+}
+
+/// Snapshots taken before the index existed keep their zero counts, shared
+/// nodes are copied before they are touched
+static void node_recount_lf(PTable* table, PTableNode** link) {
+    if (!*link) return;
+
+    PTableNode* node = node_own(table, *link);
+    *link = node;
+
+    node_recount_lf(table, &node->left);
+    node_recount_lf(table, &node->right);
+    if (node->node_type == ORIGINAL) {
+        node->lf_count = line_index_count(&table->original.lines, node->start, node->start + node->length);
+    }
+    node_update(node);
+}
+
+void ptable_build_line_index(PTable* table) {
+    ptable_build_line_index_jobs(table, NULL);
+}
+
+/// Same as ptable_build_line_index with the scan of the original text
+/// spread over `pool`, which may be NULL
+void ptable_build_line_index_jobs(PTable* table, JobPool* pool) {
+    if (table->lines_ready) return;
 
-    size_t result = 0;
-    for (size_t i = 0; i < table->node_count; i++) {
-        result += table->nodes[i].length;
+    PTableCBuffer* original = &table->original;
+    if (original->owner == BUFFER_MAPPED && original->size > 0) {
+        madvise(original->buffer, original->size, MADV_SEQUENTIAL);
     }
 
-    return result;
+    line_index_build(&original->lines, original->buffer, original->size, pool);
+
+    if (original->owner == BUFFER_MAPPED && original->size > 0) {
+        madvise(original->buffer, original->size, MADV_NORMAL);
+    }
+
+    table->lines_ready = 1;
+    node_recount_lf(table, &table->root);
+}
+
+static inline void ptable_ensure_lines(PTable* table) {
+    if (!table->lines_ready) ptable_build_line_index(table);
+}
+
+static size_t view_line_to_offset(const PTableView* view, size_t line) {
+    size_t doc_len = node_length(view->root);
+    if (line == 0) return 0;
+    if (line > node_lf(view->root)) return doc_len;
+
+    // Line `line` starts right after the line-th line feed
+    PTableNode* cursor = view->root;
+    size_t doc_offset = 0;
+    size_t lf_rank = line;
+
+    while (cursor) {
+        size_t left_lf = node_lf(cursor->left);
+
+        if (lf_rank <= left_lf) {
+            cursor = cursor->left;
+        } else if (lf_rank <= left_lf + cursor->lf_count) {
+            const PTableLineIndex* index = view_lines(view, cursor->node_type);
+            size_t first = line_index_lower_bound(index, cursor->start);
+            size_t lf_offset = index->line_feeds[first + (lf_rank - left_lf) - 1];
+
+            return doc_offset + node_length(cursor->left) + (lf_offset - cursor->start) + 1;
+        } else {
+            lf_rank -= left_lf + cursor->lf_count;
+            doc_offset += node_length(cursor->left) + cursor->length;
+            cursor = cursor->right;
+        }
+    }
+
+    return doc_len;
+}
+
+static void view_offset_to_line(const PTableView* view, size_t offset, size_t* line, size_t* column) {
+    size_t doc_len = node_length(view->root);
+    if (offset > doc_len) offset = doc_len;
+
+    // Count the line feeds in [0, offset)
+    PTableNode* cursor = view->root;
+    size_t at = offset;
+    size_t lf_before = 0;
+
+    while (cursor) {
+        size_t left_len = node_length(cursor->left);
+
+        if (at < left_len) {
+            cursor = cursor->left;
+        } else if (at < left_len + cursor->length) {
+            const PTableLineIndex* index = view_lines(view, cursor->node_type);
+            lf_before += node_lf(cursor->left);
+            lf_before += line_index_count(index, cursor->start, cursor->start + (at - left_len));
+            break;
+        } else {
+            lf_before += node_lf(cursor->left) + cursor->lf_count;
+            at -= left_len + cursor->length;
+            cursor = cursor->right;
+        }
+    }
+
+    if (line) *line = lf_before;
+    if (column) *column = offset - view_line_to_offset(view, lf_before);
+}
+
+/// Makes the top of `from` the current version and moves the current one
+/// over to `to`
+static int32_t ptable_history_step(PTable* table, PTableVersionStack* from, PTableVersionStack* to, size_t* pos) {
+    if (from->count == 0) return 0;
+
+    PTableVersion version = from->versions[from->count - 1];
+    PTableVersion current = { table->root, table->node_count, version.pos, table->lines_ready };
+    if (version_push(to, current) != 0) return 0;
+    from->count--;
+
+    table->root = version.root;
+    table->node_count = version.node_count;
+    if (table->lines_ready && !version.lines_ready) node_recount_lf(table, &table->root);
+
+    // Edits still to come in an open group make a step of their own
+    table->history.group_saved = 0;
+
+    // A step may span a whole group of edits, report every line
+    table->dirty = 1;
+    table->dirty_first_line = 0;
+    table->dirty_last_line = SIZE_MAX;
+
+    if (pos) *pos = version.pos;
+    return 1;
+}
+
+int32_t ptable_undo(PTable* table, size_t* pos) {
+    return ptable_history_step(table, &table->history.undo, &table->history.redo, pos);
+}
+
+int32_t ptable_redo(PTable* table, size_t* pos) {
+    return ptable_history_step(table, &table->history.redo, &table->history.undo, pos);
+}
+
+size_t ptable_line_count(PTable* table) {
+    ptable_ensure_lines(table);
+    return node_lf(table->root) + 1;
+}
+
+size_t ptable_line_to_offset(PTable* table, size_t line) {
+    ptable_ensure_lines(table);
+    PTableView view = ptable_view(table);
+    return view_line_to_offset(&view, line);
+}
+
+void ptable_offset_to_line(PTable* table, size_t offset, size_t* line, size_t* column) {
+    ptable_ensure_lines(table);
+    PTableView view = ptable_view(table);
+    view_offset_to_line(&view, offset, line, column);
 }
 
 char* ptable_full_buffer(PTable* table) {
     size_t table_buffer_size = ptable_get_length(table);
     char* buffer = malloc(sizeof(char) * table_buffer_size + 1);
-    for (size_t i = 0; i < table->node_count; i++) {
-        PTableNode* cursor = &table->nodes[i];
+    if (!buffer) return NULL;
 
-        char* buf = NULL;
-        switch (cursor->node_type) {
-            case ORIGINAL: {
-                buf = table->original.buffer;
-            } break;
-            case ADDITION: {
-                buf = table->add.buffer;
-            } break;
-        }
-        memcpy(buffer + cursor->start, buf, sizeof(char) * cursor->length);
+    PTableIter iter;
+    PTableSpan span;
+    char* write_head = buffer;
+
+    ptable_iter_seek(&iter, table, 0);
+    while (ptable_iter_step_span(&iter, FORWARD, &span)) {
+        memcpy(write_head, span.ptr, sizeof(char) * span.len);
+        write_head += span.len;
     }
 
     buffer[table_buffer_size] = '\0';
@@ -266,48 +1400,456 @@ char* ptable_full_buffer(PTable* table) {
     return buffer;
 }
 
-void ptable_print(PTable* table) {
-    for (size_t i = 0; i < table->node_count; i++) {
-        PTableNode* cursor = &table->nodes[i];
+/* Saving */
+
+/// Writes the whole vector, retrying short writes and interrupts
+static int32_t write_iovec_full(int fd, struct iovec* iov, int32_t count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+/// Streams the document into `fd` straight from the piece spans, nothing
+/// is copied and only one batch of iovecs is held at a time.
+int32_t ptable_write(PTable* table, int fd) {
+    struct iovec iov[PTABLE_WRITE_BATCH];
+    int32_t count = 0;
+
+    PTableIter iter;
+    PTableSpan span;
+
+    ptable_iter_seek(&iter, table, 0);
+    while (ptable_iter_step_span(&iter, FORWARD, &span)) {
+        iov[count].iov_base = (void*) span.ptr;
+        iov[count].iov_len = span.len;
+
+        if (++count == PTABLE_WRITE_BATCH) {
+            if (write_iovec_full(fd, iov, count) != 0) return -1;
+            count = 0;
+        }
+    }
+
+    return write_iovec_full(fd, iov, count);
+}
+
+/// Saves to a temporary file next to `path` and renames it over the
+/// original, a crash mid save leaves either the old or the new file.
+/// Symlinks are resolved first so the rename replaces their target.
+/// The mapped original stays readable, the mapping pins the old inode.
+int32_t ptable_save(PTable* table, const char* path) {
+    char* target = realpath(path, NULL);
+    if (!target) {
+        if (errno != ENOENT) {
+            perror("Failed to resolve save path");
+            return -1;
+        }
+        target = strdup(path);
+        if (!target) {
+            perror("Failed to allocate save path");
+            return -1;
+        }
+    }
 
-        char* buffer = NULL;
-        switch (cursor->node_type) {
-            case ORIGINAL: {
-                buffer = table->original.buffer;
-            } break;
-            case ADDITION: {
-                buffer = table->add.buffer;
-            } break;
+    size_t path_len = strlen(target);
+    char* tmp_path = malloc(path_len + sizeof(".XXXXXX"));
+    if (!tmp_path) {
+        perror("Failed to allocate save path");
+        free(target);
+        return -1;
+    }
+    memcpy(tmp_path, target, path_len);
+    memcpy(tmp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    int fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        perror("Failed to create temporary file");
+        free(tmp_path);
+        free(target);
+        return -1;
+    }
+
+    // Keep the owner and permissions of the file being replaced, a new
+    // file gets the mode open(O_CREAT, 0666) would have given it
+    struct stat st;
+    if (stat(target, &st) == 0) {
+        if (fchown(fd, st.st_uid, st.st_gid) != 0) {
+            // Only root can give the file away, keep at least the group
+            (void) fchown(fd, -1, st.st_gid);
+        }
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+
+    size_t length = ptable_get_length(table);
+    if (length > 0) {
+        posix_fallocate(fd, 0, length);
+    }
+
+    if (ptable_write(table, fd) != 0 || fsync(fd) != 0) {
+        perror("Failed to write file");
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        free(target);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp_path, target) != 0) {
+        perror("Failed to replace file");
+        unlink(tmp_path);
+        free(tmp_path);
+        free(target);
+        return -1;
+    }
+
+    // Make the rename itself durable
+    char* slash = strrchr(tmp_path, '/');
+    if (slash) {
+        *(slash == tmp_path ? slash + 1 : slash) = '\0';
+    } else {
+        memcpy(tmp_path, ".", 2);
+    }
+
+    int dir_fd = open(tmp_path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    free(tmp_path);
+    free(target);
+    return 0;
+}
+
+/* Iteration */
+
+static inline PTableNode* iter_node(PTableIter* iter) {
+    return iter->depth > 0 ? iter->path[iter->depth - 1] : NULL;
+}
+
+static void iter_descend(PTableIter* iter, PTableNode* node, PTableNodeStepDirection dir) {
+    while (node) {
+        iter->path[iter->depth++] = node;
+        node = dir == FORWARD ? node->left : node->right;
+    }
+}
+
+/// Moves the path to the in-order neighbour of the current piece, leaves an
+/// empty path when there is none
+static void iter_step_node(PTableIter* iter, PTableNodeStepDirection dir) {
+    PTableNode* node = iter_node(iter);
+    PTableNode* child = dir == FORWARD ? node->right : node->left;
+
+    if (child) {
+        iter_descend(iter, child, dir);
+        return;
+    }
+
+    iter->depth--;
+    while (iter->depth > 0) {
+        PTableNode* parent = iter->path[iter->depth - 1];
+        PTableNode* came_from = dir == FORWARD ? parent->right : parent->left;
+        if (came_from != node) return;
+        node = parent;
+        iter->depth--;
+    }
+}
+
+static void view_iter_seek(PTableIter* iter, const PTableView* view, size_t offset) {
+    size_t doc_len = node_length(view->root);
+    if (offset > doc_len) offset = doc_len;
+
+    iter->view = *view;
+    iter->depth = 0;
+    iter->piece_offset = doc_len;
+    iter->pos = offset;
+
+    // Past the end the path stays empty
+    if (offset == doc_len) return;
+
+    PTableNode* cursor = view->root;
+    size_t at = offset;
+    size_t piece_offset = 0;
+
+    while (cursor) {
+        size_t left_len = node_length(cursor->left);
+        iter->path[iter->depth++] = cursor;
+
+        if (at < left_len) {
+            cursor = cursor->left;
+        } else if (at < left_len + cursor->length) {
+            iter->piece_offset = piece_offset + left_len;
+            return;
+        } else {
+            at -= left_len + cursor->length;
+            piece_offset += left_len + cursor->length;
+            cursor = cursor->right;
+        }
+    }
+}
+
+void ptable_iter_seek(PTableIter* iter, PTable* table, size_t offset) {
+    PTableView view = ptable_view(table);
+    view_iter_seek(iter, &view, offset);
+    iter->table = table;
+}
+
+PTableIter* ptable_iter_create(PTable* table, size_t offset) {
+    PTableIter* iter = malloc(sizeof(PTableIter));
+    if (!iter) {
+        perror("Failed to allocate iterator");
+        return NULL;
+    }
+
+    ptable_iter_seek(iter, table, offset);
+    return iter;
+}
+
+void ptable_iter_release(PTableIter* iter) {
+    free(iter);
+}
+
+int32_t ptable_iter_step_span(PTableIter* iter, PTableNodeStepDirection dir, PTableSpan* out) {
+    PTableNode* node = iter_node(iter);
+
+    if (dir == FORWARD) {
+        if (!node) return 0;
+
+        size_t piece_pos = iter->pos - iter->piece_offset;
+        out->ptr = view_piece_ptr(&iter->view, node, piece_pos);
+        out->len = node->length - piece_pos;
+
+        iter->pos = iter->piece_offset + node->length;
+        iter->piece_offset = iter->pos;
+        iter_step_node(iter, FORWARD);
+
+        return 1;
+    }
+
+    if (iter->pos == 0) return 0;
+
+    // At a piece start (or the end) the span comes from the previous piece
+    if (!node || iter->pos == iter->piece_offset) {
+        if (node) {
+            iter_step_node(iter, BACKWARD);
+        } else {
+            iter_descend(iter, iter->view.root, BACKWARD);
+        }
+        node = iter_node(iter);
+        iter->piece_offset = iter->pos - node->length;
+    }
+
+    size_t piece_pos = iter->pos - iter->piece_offset;
+    out->ptr = view_piece_ptr(&iter->view, node, 0);
+    out->len = piece_pos;
+    iter->pos = iter->piece_offset;
+
+    return 1;
+}
+
+int32_t ptable_iter_step_byte(PTableIter* iter, PTableNodeStepDirection dir, char* out) {
+    PTableNode* node = iter_node(iter);
+
+    if (dir == FORWARD) {
+        if (!node) return 0;
+
+        *out = *view_piece_ptr(&iter->view, node, iter->pos - iter->piece_offset);
+        iter->pos++;
+        if (iter->pos == iter->piece_offset + node->length) {
+            iter->piece_offset = iter->pos;
+            iter_step_node(iter, FORWARD);
+        }
+
+        return 1;
+    }
+
+    if (iter->pos == 0) return 0;
+
+    if (!node || iter->pos == iter->piece_offset) {
+        if (node) {
+            iter_step_node(iter, BACKWARD);
+        } else {
+            iter_descend(iter, iter->view.root, BACKWARD);
         }
+        node = iter_node(iter);
+        iter->piece_offset = iter->pos - node->length;
+    }
+
+    iter->pos--;
+    *out = *view_piece_ptr(&iter->view, node, iter->pos - iter->piece_offset);
+
+    return 1;
+}
+
+/// Forward moves to the start of the next line, backward to the start of
+/// the previous one. Returns 0 when there is no such line.
+int32_t ptable_iter_step_line(PTableIter* iter, PTableNodeStepDirection dir) {
+    // A live table builds its line index on demand
+    if (iter->table && !iter->view.lines_ready) {
+        ptable_ensure_lines(iter->table);
+        iter->view = ptable_view(iter->table);
+    }
+
+    PTableView view = iter->view;
+    size_t line = 0;
+    view_offset_to_line(&view, iter->pos, &line, NULL);
+
+    if (dir == FORWARD) {
+        if (line + 1 > node_lf(view.root)) return 0;
+        view_iter_seek(iter, &view, view_line_to_offset(&view, line + 1));
+    } else {
+        if (line == 0) return 0;
+        view_iter_seek(iter, &view, view_line_to_offset(&view, line - 1));
+    }
+
+    return 1;
+}
+
+/* Snapshots */
+
+/// O(1), the root gains a reference and the next edit copies its path
+PTableSnapshot* ptable_snapshot(PTable* table) {
+    PTableSnapshot* snapshot = malloc(sizeof(PTableSnapshot));
+    if (!snapshot) {
+        perror("Failed to allocate snapshot");
+        return NULL;
+    }
+
+    node_ref(table->root);
+    atomic_fetch_add_explicit(&table->refs, 1, memory_order_relaxed);
+    snapshot->table = table;
+    snapshot->view = ptable_view(table);
+
+    return snapshot;
+}
+
+PTableSnapshot* ptable_snapshot_clone(PTableSnapshot* snapshot) {
+    PTableSnapshot* clone = malloc(sizeof(PTableSnapshot));
+    if (!clone) {
+        perror("Failed to allocate snapshot");
+        return NULL;
+    }
+
+    node_ref(snapshot->view.root);
+    atomic_fetch_add_explicit(&snapshot->table->refs, 1, memory_order_relaxed);
+    *clone = *snapshot;
+
+    return clone;
+}
+
+void ptable_snapshot_release(PTableSnapshot* snapshot) {
+    node_unref(snapshot->view.root);
+    ptable_unref(snapshot->table);
+    free(snapshot);
+}
+
+size_t ptable_snapshot_length(PTableSnapshot* snapshot) {
+    return node_length(snapshot->view.root);
+}
+
+char ptable_snapshot_index(PTableSnapshot* snapshot, size_t at) {
+    return view_index(&snapshot->view, at);
+}
+
+size_t ptable_snapshot_line_count(PTableSnapshot* snapshot) {
+    return node_lf(snapshot->view.root) + 1;
+}
+
+size_t ptable_snapshot_line_to_offset(PTableSnapshot* snapshot, size_t line) {
+    return view_line_to_offset(&snapshot->view, line);
+}
+
+void ptable_snapshot_offset_to_line(PTableSnapshot* snapshot, size_t offset, size_t* line, size_t* column) {
+    view_offset_to_line(&snapshot->view, offset, line, column);
+}
+
+void ptable_snapshot_iter_seek(PTableIter* iter, PTableSnapshot* snapshot, size_t offset) {
+    view_iter_seek(iter, &snapshot->view, offset);
+    iter->table = NULL;
+}
 
-        fwrite(buffer + cursor->start, 1, cursor->length, stdout);
+/// Valid for as long as the snapshot
+PTableIter* ptable_snapshot_iter_create(PTableSnapshot* snapshot, size_t offset) {
+    PTableIter* iter = malloc(sizeof(PTableIter));
+    if (!iter) {
+        perror("Failed to allocate iterator");
+        return NULL;
     }
+
+    ptable_snapshot_iter_seek(iter, snapshot, offset);
+    return iter;
+}
+
+static void ptable_print_node(PTable* table, PTableNode* node, void* user) {
+    unused(user);
+    fwrite(ptable_piece_ptr(table, node, 0), 1, node->length, stdout);
+}
+
+void ptable_print(PTable* table) {
+    ptable_walk(table, ptable_print_node, NULL);
     printf("\n");
 }
 
+static void ptable_print_node_info(PTable* table, PTableNode* node, void* user) {
+    unused(table);
+    unused(user);
+
+    printf("Type: ");
+    switch(node->node_type) {
+        case ORIGINAL: {
+            printf("ORIGINAL ");
+        } break;
+        case ADDITION: {
+            printf("ADDITION ");
+        } break;
+    }
+    printf("Offset: %zu ", node->start);
+    printf("Length: %zu ", node->length);
+    printf("Height: %d\n", node->height);
+}
+
 void ptable_print_node_sequence(PTable* table, uint8_t print_final_string) {
     printf("Original:\n");
     printf("---------\n");
-    printf("%s\n", table->original.buffer);
+    fwrite(table->original.buffer, 1, table->original.size, stdout);
+    printf("\n");
     printf("---------\n");
-    for (size_t i = 0; i < table->node_count; i++) {
-        PTableNode* cursor = &table->nodes[i];
-        printf("Type: ");
-        switch(cursor->node_type) {
-            case ORIGINAL: {
-                printf("ORIGINAL ");
-            } break;
-            case ADDITION: {
-                printf("ADDITION ");
-            } break;
-        }
-        printf("Offset: %zu ", cursor->start);
-        printf("Length: %zu\n", cursor->length);
-
-    }
+    ptable_walk(table, ptable_print_node_info, NULL);
 
     if (print_final_string) {
         ptable_print(table);
     }
     printf("--------------------\n");
 }
+
+void ptable_print_stats(PTable* table) {
+    PTableStats* stats = &table->stats;
+
+    printf("Inserts: %zu ", stats->inserts);
+    printf("Coalesced: %zu ", stats->coalesced_inserts);
+    printf("Deletes: %zu ", stats->deletes);
+    printf("Nodes created: %zu ", stats->nodes_created);
+    printf("Copied: %zu ", stats->nodes_copied);
+    printf("Compactions: %zu ", stats->compactions);
+    printf("Live nodes: %zu\n", table->node_count);
+}
@@ -3,16 +3,96 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
+
+#include "../base/mem.h"
+#include "../base/job.h"
 
 /// Piece Table
 /// -----------
+///
+/// Pieces are kept in a height balanced (AVL) tree ordered by document
+/// position. Every node caches the byte length of its subtree, so insert,
+/// delete and index are O(log n) in the number of pieces and the document
+/// length is read straight off the root.
+///
+/// Each source buffer also records the offsets of its line feeds. Nodes
+/// cache the line feed count of their piece and subtree, which keeps
+/// line <-> offset conversion O(log n) as well.
+///
+/// Added text goes into fixed size chunks carved from a virtual arena. Chunks
+/// never move and a piece never crosses a chunk, so every span handed out
+/// stays valid for the lifetime of the table.
+///
+/// Nodes are reference counted and copied on write. An edit copies the
+/// nodes on its path that are shared and leaves the old ones alone, so a
+/// snapshot is just another reference to the root: O(1) to take and safe
+/// to read from any thread while the table keeps changing. Arrays that
+/// readers index into (the chunk directory, the add line index) grow by
+/// copying inside the add arena, older copies stay valid.
+///
+/// Undo history is a stack of such roots. Since both buffers only ever
+/// grow, a root fully describes its version; a step costs the O(log n)
+/// nodes its edit copied and undo or redo just swaps the root back.
+
+#define PTABLE_MAX_HEIGHT 128
+#define PTABLE_INIT_HISTORY_SIZE 64
+// Batches smaller than node_count / this go through split and join
+#define PTABLE_BATCH_SPLIT_COST 32
+// Piece merging pays off past this many pieces averaging under the size
+#define PTABLE_COMPACT_MIN_PIECES 4096
+#define PTABLE_COMPACT_SMALL_PIECE 64
+// Unreferenced add text worth collecting, when it also outweighs live text
+#define PTABLE_COMPACT_MIN_DEAD ((size_t) 16 << 20)
+#define PTABLE_ADD_CHUNK_SHIFT 16
+#define PTABLE_ADD_CHUNK_SIZE ((size_t) 1 << PTABLE_ADD_CHUNK_SHIFT)
+#define PTABLE_ADD_CHUNK_MASK (PTABLE_ADD_CHUNK_SIZE - 1)
+#define PTABLE_ADD_RESERVE ((size_t) 16 << 30)
+
+typedef struct line_index {
+    size_t* line_feeds;
+    size_t count;
+    size_t capacity;
+
+    // When set the index grows by copy inside the arena and is never freed
+    Arena* arena;
+} PTableLineIndex;
+
+/// BUFFER_MAPPED text is the file itself (see map_full_file): another
+/// process writing the file in place changes the document and every
+/// version in the undo history, truncating it leaves zeros where the cut
+/// text was. Call ptable_detach_original when the file changes to keep
+/// whatever it held at that point.
+typedef enum table_buffer_owner {
+BUFFER_OWNED,
+BUFFER_MAPPED,
+BUFFER_BORROWED,
+// Mapped text copied to private pages by ptable_detach_original
+BUFFER_DETACHED,
+} PTableBufferOwner;
 
 typedef struct string_buffer {
     char* buffer;
     size_t offset;
     size_t size;
+    PTableBufferOwner owner;
+    PTableLineIndex lines;
 } PTableCBuffer;
 
+/// Append only. Offsets are virtual, chunk `offset >> SHIFT` holds the byte
+/// at `offset & MASK`.
+typedef struct add_buffer {
+    char** chunks;
+    size_t chunk_count;
+    size_t chunk_capacity;
+    size_t offset;
+
+    // Reserved on the first chunk, pages are committed as chunks are added
+    Arena arena;
+
+    PTableLineIndex lines;
+} PTableAddBuffer;
+
 typedef enum table_node_type {
 ORIGINAL,
 ADDITION
@@ -27,28 +107,229 @@ typedef struct table_node {
     PTableNodeType node_type;
     size_t start;
     size_t length;
+    size_t lf_count;
+
+    // Tree links and subtree aggregates
+    struct table_node* left;
+    struct table_node* right;
+    size_t subtree_length;
+    size_t subtree_lf;
+    // Add buffer bytes referenced by the subtree
+    size_t subtree_add;
+    int32_t height;
+
+    // Parents and snapshots pointing here, only nodes at 1 change in place
+    atomic_uint refs;
 } PTableNode;
 
+/// Running counters, mostly to see how edits shape the tree
+typedef struct table_stats {
+    size_t inserts;
+    size_t coalesced_inserts;
+    size_t deletes;
+    size_t nodes_created;
+    size_t nodes_copied;
+    size_t compactions;
+} PTableStats;
+
+typedef enum table_compact_flags {
+    // Join neighbouring pieces that point at contiguous bytes
+    PTABLE_COMPACT_MERGE = 1 << 0,
+    // Rewrite the text still in use into a fresh add buffer
+    PTABLE_COMPACT_ADD = 1 << 1,
+} PTableCompactFlags;
+
+/// Shape of the current version. Dead add bytes are not referenced by the
+/// document, though undo history may still need them.
+typedef struct table_fragmentation {
+    size_t pieces;
+    size_t live_bytes;
+    size_t add_bytes;
+    size_t add_live_bytes;
+    size_t add_dead_bytes;
+} PTableFragmentation;
+
+/// Document state before an undo step (or after, on the redo side)
+typedef struct table_version {
+    PTableNode* root;
+    size_t node_count;
+    // Where the step's first edit happened
+    size_t pos;
+    // Roots saved before the line index was built lack line feed counts
+    uint8_t lines_ready;
+} PTableVersion;
+
+typedef struct table_version_stack {
+    PTableVersion* versions;
+    size_t count;
+    size_t capacity;
+} PTableVersionStack;
+
+typedef struct table_history {
+    PTableVersionStack undo;
+    PTableVersionStack redo;
+
+    // Edits inside a group undo as one step
+    uint32_t group_depth;
+    uint8_t group_saved;
+} PTableHistory;
+
 typedef struct piece_table {
     PTableCBuffer original;
-    PTableCBuffer add;
-    PTableNode* nodes;
+    PTableAddBuffer add;
+    PTableNode* root;
     size_t node_count;
+
+    // The original text is only scanned for line feeds on the first line
+    // lookup, until then original pieces carry no line feed counts
+    uint8_t lines_ready;
+
+    // Lines touched by edits since the last ptable_take_dirty_lines
+    uint8_t dirty;
+    size_t dirty_first_line;
+    size_t dirty_last_line;
+
+    PTableStats stats;
+    PTableHistory history;
+
+    // A background compaction is running, and the piece count it left
+    uint8_t compacting;
+    size_t compacted_pieces;
+
+    // The table plus every snapshot still alive, buffers go with the last
+    atomic_uint refs;
 } PTable;
 
+/// One version of the document as readers see it
+typedef struct table_view {
+    PTableNode* root;
+    const char* original;
+    char* const* chunks;
+    PTableLineIndex original_lines;
+    PTableLineIndex add_lines;
+    uint8_t lines_ready;
+} PTableView;
+
+/// Immutable version of a table, released from any thread. Line lookups
+/// need the line index to have been built when the snapshot was taken.
+typedef struct table_snapshot {
+    PTable* table;
+    PTableView view;
+} PTableSnapshot;
+
+/// One edit of a batch: replaces [pos, pos + delete_len) with text. Offsets
+/// are in the document as it was before the batch.
+typedef struct table_edit {
+    size_t pos;
+    size_t delete_len;
+    const char* text;
+    size_t text_len;
+} PTableEdit;
+
+/// Contiguous run of document bytes inside one piece
+typedef struct table_span {
+    const char* ptr;
+    size_t len;
+} PTableSpan;
+
+/// Cursor over the document. Keeps the root to piece path so stepping
+/// to a neighbouring piece is amortised O(1) instead of a fresh descent.
+/// Any edit to the table invalidates the iterator, seek again after one.
+/// Iterators over a snapshot stay valid as long as the snapshot.
+typedef struct table_iter {
+    // NULL when iterating a snapshot
+    PTable* table;
+    PTableView view;
+    PTableNode* path[PTABLE_MAX_HEIGHT];
+    int32_t depth;
+    size_t piece_offset;
+    size_t pos;
+} PTableIter;
+
 // PTable manipulation
 
 PTable* ptable_create(const char*);
-void ptable_insert(PTable* table, size_t pos, const char* text);
+PTable* ptable_create_len(const char* buff, size_t len, PTableBufferOwner owner);
+PTable* ptable_open(const char* path);
+/// Stops a mapped original from following its file, a no-op for other
+/// buffers. Returns 0 on success.
+int32_t ptable_detach_original(PTable* table);
+/// Returns 0 on success, -1 when the position is out of bounds or the
+/// add buffer can't grow. A failed insert changes nothing, not even
+/// the undo history.
+int32_t ptable_insert(PTable* table, size_t pos, const char* text);
+int32_t ptable_insert_len(PTable* table, size_t pos, const char* text, size_t text_len);
 char ptable_index(PTable* table, size_t at);
 void ptable_delete(PTable* table, size_t at, size_t len);
+/// Edits must be sorted by position and must not overlap, inserts at the
+/// same position land in list order. Applied as one undo step. Returns 0
+/// on success, -1 leaves the table untouched.
+int32_t ptable_apply_batch(PTable* table, const PTableEdit* edits, size_t count);
 void ptable_release(PTable* table);
 
+size_t ptable_get_length(PTable* table);
+
+// Undo and redo, both return 0 when there is nothing to do and otherwise
+// report where the step's first edit happened in `pos` (may be NULL)
+void ptable_begin_group(PTable* table);
+void ptable_end_group(PTable* table);
+int32_t ptable_undo(PTable* table, size_t* pos);
+int32_t ptable_redo(PTable* table, size_t* pos);
+
+// Compaction. Metrics are O(1). Collecting the add buffer drops the undo
+// history and fails while snapshots are alive. The background pass only
+// merges pieces and is discarded when the table changed meanwhile.
+void ptable_fragmentation(PTable* table, PTableFragmentation* out);
+uint32_t ptable_compaction_wanted(PTable* table);
+int32_t ptable_compact(PTable* table, uint32_t flags);
+int32_t ptable_compact_background(PTable* table, JobPool* pool);
+
+// Line lookups, lines and columns are zero based
+void ptable_build_line_index(PTable* table);
+void ptable_build_line_index_jobs(PTable* table, JobPool* pool);
+size_t ptable_line_count(PTable* table);
+size_t ptable_line_to_offset(PTable* table, size_t line);
+void ptable_offset_to_line(PTable* table, size_t offset, size_t* line, size_t* column);
+
+/// Inclusive range of lines changed since the previous call, the last line
+/// is SIZE_MAX when lines were added or removed. Returns 0 when clean.
+int32_t ptable_take_dirty_lines(PTable* table, size_t* first_line, size_t* last_line);
+/// Same check without taking the range
+uint8_t ptable_has_dirty_lines(PTable* table);
+
 // buffer views
 char* ptable_full_buffer(PTable* table);
 
+// Saving, both return 0 on success
+int32_t ptable_write(PTable* table, int fd);
+int32_t ptable_save(PTable* table, const char* path);
+
+// Iteration
+void ptable_iter_seek(PTableIter* iter, PTable* table, size_t offset);
+int32_t ptable_iter_step_byte(PTableIter* iter, PTableNodeStepDirection dir, char* out);
+int32_t ptable_iter_step_span(PTableIter* iter, PTableNodeStepDirection dir, PTableSpan* out);
+int32_t ptable_iter_step_line(PTableIter* iter, PTableNodeStepDirection dir);
+// Heap iterators for callers that cannot embed a PTableIter, like the Lua FFI
+PTableIter* ptable_iter_create(PTable* table, size_t offset);
+void ptable_iter_release(PTableIter* iter);
+
+// Snapshots
+PTableSnapshot* ptable_snapshot(PTable* table);
+/// Second handle on the same version, for handing to another owner. Safe
+/// from any thread.
+PTableSnapshot* ptable_snapshot_clone(PTableSnapshot* snapshot);
+void ptable_snapshot_release(PTableSnapshot* snapshot);
+size_t ptable_snapshot_length(PTableSnapshot* snapshot);
+char ptable_snapshot_index(PTableSnapshot* snapshot, size_t at);
+size_t ptable_snapshot_line_count(PTableSnapshot* snapshot);
+size_t ptable_snapshot_line_to_offset(PTableSnapshot* snapshot, size_t line);
+void ptable_snapshot_offset_to_line(PTableSnapshot* snapshot, size_t offset, size_t* line, size_t* column);
+void ptable_snapshot_iter_seek(PTableIter* iter, PTableSnapshot* snapshot, size_t offset);
+PTableIter* ptable_snapshot_iter_create(PTableSnapshot* snapshot, size_t offset);
+
 // Helpers and utils
 void ptable_print(PTable* table);
 void ptable_print_node_sequence(PTable* table, uint8_t print_final_string);
+void ptable_print_stats(PTable* table);
 
 #endif // PTABLE_H_
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+
+#include "search.h"
+
+#include "../base/base.h"
+#include "../base/bytes.h"
+
+#include <string.h>
+#include <regex.h>
+
+// Long spans are fed in slices so cancellation is noticed quickly
+#define SEARCH_FEED_SIZE ((size_t) 1 << 20)
+#define SEARCH_INIT_MATCHES 64
+#define SEARCH_REGEX_FLAGS (REG_EXTENDED | REG_NEWLINE)
+
+struct table_search {
+    PTableSearchMode mode;
+    char* pattern;
+    size_t pattern_len;
+
+    // Taken when the search starts, later edits do not reach the workers
+    PTableSnapshot* snapshot;
+    size_t length;
+
+    JobCancel cancel;
+    size_t outstanding;
+
+    ptable_search_results* on_results;
+    void* user;
+};
+
+struct match_list {
+    PTableMatch* matches;
+    size_t count;
+    size_t capacity;
+    size_t limit;
+};
+
+struct search_chunk {
+    PTableSearch* search;
+    size_t start;
+    size_t end;
+    struct match_list found;
+};
+
+/* Matches */
+
+static void match_push(struct match_list* list, size_t offset, size_t length) {
+    if (list->count == list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : SEARCH_INIT_MATCHES;
+        PTableMatch* matches = realloc(list->matches, new_capacity * sizeof(PTableMatch));
+        if (!matches) {
+            perror("Failed to grow search results");
+            return;
+        }
+        list->matches = matches;
+        list->capacity = new_capacity;
+    }
+
+    list->matches[list->count].offset = offset;
+    list->matches[list->count].length = length;
+    list->count++;
+}
+
+static inline uint8_t match_full(struct match_list* list) {
+    return list->count >= list->limit;
+}
+
+/* Span reader */
+
+/// Walks document bytes in [pos, end) through a table iterator. `cur` is
+/// the unread part of the current slice, `rest` what follows it in the
+/// same span.
+struct span_reader {
+    PTableIter iter;
+
+    const char* cur;
+    size_t cur_len;
+    const char* rest;
+    size_t rest_len;
+    size_t pos;
+    size_t end;
+    JobCancel* cancel;
+};
+
+static void span_reader_table(struct span_reader* reader, PTable* table, size_t pos) {
+    memset(reader, 0, sizeof(*reader));
+    reader->pos = pos;
+    reader->end = ptable_get_length(table);
+    ptable_iter_seek(&reader->iter, table, pos);
+}
+
+static void span_reader_snapshot(struct span_reader* reader, PTableSnapshot* snapshot, size_t pos, size_t end, JobCancel* cancel) {
+    memset(reader, 0, sizeof(*reader));
+    reader->pos = pos;
+    reader->end = min(end, ptable_snapshot_length(snapshot));
+    reader->cancel = cancel;
+    ptable_snapshot_iter_seek(&reader->iter, snapshot, pos);
+}
+
+/// Makes `cur` non empty, returns 0 at the end of the range or once the
+/// search was cancelled
+static int32_t span_reader_fill(struct span_reader* reader) {
+    if (reader->cur_len > 0) return 1;
+    if (reader->pos >= reader->end || job_cancelled(reader->cancel)) return 0;
+
+    if (reader->rest_len == 0) {
+        PTableSpan span;
+        if (!ptable_iter_step_span(&reader->iter, FORWARD, &span)) return 0;
+        reader->rest = span.ptr;
+        reader->rest_len = min(span.len, reader->end - reader->pos);
+    }
+
+    size_t take = min(reader->rest_len, SEARCH_FEED_SIZE);
+    reader->cur = reader->rest;
+    reader->cur_len = take;
+    reader->rest += take;
+    reader->rest_len -= take;
+    return 1;
+}
+
+static inline void span_reader_advance(struct span_reader* reader, size_t count) {
+    reader->cur += count;
+    reader->cur_len -= count;
+    reader->pos += count;
+}
+
+/* Literal */
+
+/// Matches that straddle a span boundary are found by keeping the last
+/// needle_len - 1 bytes in `window` and searching them joined to the
+/// head of the next span
+static void search_literal(struct span_reader* reader, const char* needle, size_t needle_len,
+                           size_t min_start, size_t max_start, struct match_list* out) {
+    size_t keep = needle_len - 1;
+    char* window = keep ? malloc(keep * 2) : NULL;
+    if (keep && !window) {
+        perror("Failed to allocate search window");
+        return;
+    }
+
+    size_t carry_len = 0;
+    size_t carry_pos = 0;
+    // Starts below this were already checked against a full needle
+    size_t decided = 0;
+
+    while (!match_full(out) && span_reader_fill(reader)) {
+        const char* span = reader->cur;
+        size_t len = reader->cur_len;
+        size_t pos = reader->pos;
+
+        // Starts inside the carried tail, the window is carry + span head
+        size_t take = min(keep, len);
+        if (keep) memcpy(window + carry_len, span, take);
+
+        if (carry_len > 0) {
+            const char* hay = window;
+            size_t hay_len = carry_len + take;
+            const char* hit;
+            while (!match_full(out) && (hit = bytes_find(hay, window + hay_len - hay, needle, needle_len)) && (size_t) (hit - window) < carry_len) {
+                size_t at = carry_pos + (hit - window);
+                if (at >= decided && at >= min_start && at < max_start) match_push(out, at, needle_len);
+                hay = hit + 1;
+            }
+        }
+
+        const char* hay = span;
+        const char* hit;
+        while (!match_full(out) && (hit = bytes_find(hay, span + len - hay, needle, needle_len))) {
+            size_t at = pos + (hit - span);
+            if (at >= max_start) break;
+            if (at >= min_start) match_push(out, at, needle_len);
+            hay = hit + 1;
+        }
+
+        // Tail for the next span, it may still include older carry bytes
+        if (keep) {
+            if (pos + len > keep) decided = max(decided, pos + len - keep);
+            if (len >= keep) {
+                memcpy(window, span + len - keep, keep);
+                carry_len = keep;
+                carry_pos = pos + len - keep;
+            } else {
+                // The whole span is already in the window behind the carry
+                size_t joined = carry_len + len;
+                size_t drop = joined > keep ? joined - keep : 0;
+                memmove(window, window + drop, joined - drop);
+                carry_len = joined - drop;
+                carry_pos = pos + len - carry_len;
+            }
+        }
+
+        span_reader_advance(reader, len);
+    }
+
+    free(window);
+}
+
+/* Regex */
+
+struct line_buf {
+    char* b;
+    size_t len;
+    size_t cap;
+};
+
+static int32_t line_buf_append(struct line_buf* line, const char* s, size_t len) {
+    if (line->len + len > line->cap) {
+        size_t new_cap = line->cap ? line->cap * 2 : 256;
+        while (new_cap < line->len + len) new_cap *= 2;
+
+        char* b = realloc(line->b, new_cap);
+        if (!b) {
+            perror("Failed to grow search line");
+            return -1;
+        }
+        line->b = b;
+        line->cap = new_cap;
+    }
+
+    memcpy(line->b + line->len, s, len);
+    line->len += len;
+    return 0;
+}
+
+/// Reads the line starting at the reader position, without its line
+/// feed. Points into the span when the line does not cross one.
+static int32_t span_reader_line(struct span_reader* reader, struct line_buf* line, const char** text, size_t* len) {
+    line->len = 0;
+    uint8_t copied = 0;
+
+    if (!span_reader_fill(reader)) return 0;
+
+    while (span_reader_fill(reader)) {
+        const char* lf = memchr(reader->cur, '\n', reader->cur_len);
+        size_t part = lf ? (size_t) (lf - reader->cur) : reader->cur_len;
+
+        if (lf && !copied) {
+            *text = reader->cur;
+            *len = part;
+            span_reader_advance(reader, part + 1);
+            return 1;
+        }
+
+        if (line_buf_append(line, reader->cur, part) != 0) return 0;
+        copied = 1;
+        span_reader_advance(reader, lf ? part + 1 : part);
+        if (lf) break;
+    }
+
+    *text = line->b;
+    *len = line->len;
+    return 1;
+}
+
+static void search_regex_line(regex_t* regex, const char* text, size_t len, size_t line_pos,
+                              size_t min_start, struct match_list* out) {
+    size_t at = 0;
+    int32_t eflags = 0;
+
+    while (at <= len && !match_full(out)) {
+        regmatch_t match;
+        match.rm_so = at;
+        match.rm_eo = len;
+        if (regexec(regex, text ? text : "", 1, &match, eflags | REG_STARTEND) != 0) break;
+
+        size_t offset = line_pos + match.rm_so;
+        if (offset >= min_start) match_push(out, offset, match.rm_eo - match.rm_so);
+
+        // Empty matches still have to move forward
+        at = match.rm_eo > match.rm_so ? (size_t) match.rm_eo : (size_t) match.rm_so + 1;
+        eflags = REG_NOTBOL;
+    }
+}
+
+/// Every line starting in [line_start, max_start), the reader must sit on
+/// `line_start`, which is a line start
+static void search_regex(struct span_reader* reader, regex_t* regex, size_t line_start,
+                         size_t min_start, size_t max_start, struct match_list* out) {
+    struct line_buf line = {0};
+    const char* text = NULL;
+    size_t len = 0;
+
+    while (line_start < max_start && !match_full(out) && span_reader_line(reader, &line, &text, &len)) {
+        search_regex_line(regex, text, len, line_start, min_start, out);
+        line_start = reader->pos;
+    }
+
+    free(line.b);
+}
+
+/* Synchronous */
+
+int32_t ptable_find(PTable* table, size_t from, const char* pattern, PTableSearchMode mode, PTableMatch* out) {
+    struct match_list found = { .limit = 1 };
+    struct span_reader reader;
+    size_t doc_len = ptable_get_length(table);
+    if (from > doc_len) return 0;
+
+    if (mode == SEARCH_LITERAL) {
+        size_t pattern_len = strlen(pattern);
+        if (pattern_len == 0) return 0;
+
+        span_reader_table(&reader, table, from);
+        search_literal(&reader, pattern, pattern_len, from, SIZE_MAX, &found);
+    } else {
+        regex_t regex;
+        if (regcomp(&regex, pattern, SEARCH_REGEX_FLAGS) != 0) return 0;
+
+        // Start at the line holding `from` so anchors see the real line
+        size_t line = 0;
+        ptable_offset_to_line(table, from, &line, NULL);
+        size_t line_start = ptable_line_to_offset(table, line);
+
+        span_reader_table(&reader, table, line_start);
+        search_regex(&reader, &regex, line_start, from, SIZE_MAX, &found);
+        regfree(&regex);
+    }
+
+    if (found.count == 0) return 0;
+
+    *out = found.matches[0];
+    free(found.matches);
+    return 1;
+}
+
+/* Parallel */
+
+static void search_chunk_run(void* data, JobCancel* cancel) {
+    struct search_chunk* chunk = data;
+    PTableSearch* search = chunk->search;
+    struct span_reader reader;
+
+    if (search->mode == SEARCH_LITERAL) {
+        span_reader_snapshot(&reader, search->snapshot, chunk->start, chunk->end + search->pattern_len - 1, cancel);
+        search_literal(&reader, search->pattern, search->pattern_len, chunk->start, chunk->end, &chunk->found);
+        return;
+    }
+
+    regex_t regex;
+    if (regcomp(&regex, search->pattern, SEARCH_REGEX_FLAGS) != 0) return;
+
+    // Lines belong to the chunk they start in, skip the one running in
+    // from the previous chunk
+    size_t line_start = chunk->start;
+    if (line_start > 0) {
+        span_reader_snapshot(&reader, search->snapshot, line_start - 1, search->length, cancel);
+        while (span_reader_fill(&reader)) {
+            const char* lf = memchr(reader.cur, '\n', reader.cur_len);
+            if (lf) {
+                span_reader_advance(&reader, lf - reader.cur + 1);
+                break;
+            }
+            span_reader_advance(&reader, reader.cur_len);
+        }
+        line_start = reader.pos;
+    } else {
+        span_reader_snapshot(&reader, search->snapshot, 0, search->length, cancel);
+    }
+
+    if (line_start < chunk->end) {
+        search_regex(&reader, &regex, line_start, 0, chunk->end, &chunk->found);
+    }
+    regfree(&regex);
+}
+
+static void search_release(PTableSearch* search) {
+    free(search->pattern);
+    if (search->snapshot) ptable_snapshot_release(search->snapshot);
+    free(search);
+}
+
+static void search_chunk_done(void* data, uint8_t cancelled) {
+    struct search_chunk* chunk = data;
+    PTableSearch* search = chunk->search;
+
+    if (!cancelled && chunk->found.count > 0) {
+        search->on_results(search->user, chunk->found.matches, chunk->found.count, 0);
+    }
+    free(chunk->found.matches);
+    free(chunk);
+
+    if (--search->outstanding == 0) {
+        search->on_results(search->user, NULL, 0, 1);
+        search_release(search);
+    }
+}
+
+PTableSearch* ptable_search_start(PTable* table, JobPool* pool, const char* pattern, PTableSearchMode mode,
+                                  ptable_search_results* on_results, void* user) {
+    size_t pattern_len = strlen(pattern);
+    if (pattern_len == 0) return NULL;
+
+    if (mode == SEARCH_REGEX) {
+        regex_t regex;
+        int32_t result = regcomp(&regex, pattern, SEARCH_REGEX_FLAGS);
+        if (result != 0) {
+            char message[256];
+            regerror(result, &regex, message, sizeof(message));
+            error_print("Invalid search pattern: %s", message);
+            return NULL;
+        }
+        regfree(&regex);
+    }
+
+    PTableSearch* search = calloc(1, sizeof(PTableSearch));
+    if (!search) {
+        perror("Failed to allocate search");
+        return NULL;
+    }
+
+    search->mode = mode;
+    search->pattern = strdup(pattern);
+    search->pattern_len = pattern_len;
+    search->on_results = on_results;
+    search->user = user;
+    job_cancel_init(&search->cancel);
+
+    search->snapshot = ptable_snapshot(table);
+    if (!search->pattern || !search->snapshot) {
+        perror("Failed to prepare search");
+        search_release(search);
+        return NULL;
+    }
+    search->length = ptable_snapshot_length(search->snapshot);
+
+    // An empty document still gets one chunk, so the finishing call
+    // always comes from the event loop
+    size_t chunk_count = max((search->length + PTABLE_SEARCH_CHUNK_SIZE - 1) / PTABLE_SEARCH_CHUNK_SIZE, (size_t) 1);
+    search->outstanding = chunk_count;
+
+    for (size_t i = 0; i < chunk_count; i++) {
+        struct search_chunk* chunk = calloc(1, sizeof(struct search_chunk));
+        if (chunk) {
+            chunk->search = search;
+            chunk->start = i * PTABLE_SEARCH_CHUNK_SIZE;
+            chunk->end = min(chunk->start + PTABLE_SEARCH_CHUNK_SIZE, search->length);
+            chunk->found.limit = SIZE_MAX;
+        }
+
+        if (!chunk || job_submit(pool, search_chunk_run, search_chunk_done, chunk, &search->cancel) != 0) {
+            free(chunk);
+            // Nothing queued yet, nobody else will free the search
+            if (i == 0) {
+                search_release(search);
+                return NULL;
+            }
+            search->outstanding -= chunk_count - i;
+            break;
+        }
+    }
+
+    return search;
+}
+
+void ptable_search_cancel(PTableSearch* search) {
+    job_cancel(&search->cancel);
+}
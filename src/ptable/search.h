@@ -0,0 +1,57 @@
+#ifndef PTABLE_SEARCH_H_
+#define PTABLE_SEARCH_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ptable.h"
+#include "../base/job.h"
+
+#define PTABLE_SEARCH_CHUNK_SIZE ((size_t) 4 << 20)
+
+/// Search
+/// ------
+///
+/// Runs straight over piece spans, the document is never copied. Literal
+/// patterns carry the tail of one span into the next so matches that
+/// straddle a piece boundary are found. Regex patterns (POSIX extended)
+/// match line by line, a line only gets copied when it spans pieces.
+///
+/// ptable_search_start splits the document into chunks searched on the
+/// job pool. Each finished chunk hands its matches to the main thread
+/// straight away, so the first hits show before the scan ends. Chunks
+/// finish in any order, matches are sorted within a batch only.
+///
+/// Literal searches report every occurrence, overlapping ones included,
+/// which keeps chunk results independent of each other.
+
+typedef enum table_search_mode {
+SEARCH_LITERAL,
+SEARCH_REGEX,
+} PTableSearchMode;
+
+typedef struct table_match {
+    size_t offset;
+    size_t length;
+} PTableMatch;
+
+typedef struct table_search PTableSearch;
+
+/// Runs on the main thread. `finished` is set exactly once, on the last
+/// call, after which the search is freed. Cancelled searches still get
+/// the finishing call but no further matches.
+typedef void ptable_search_results(void* user, const PTableMatch* matches, size_t count, uint8_t finished);
+
+/// First match at or past `from`, searching forward without a pool.
+/// Returns 0 when there is none.
+int32_t ptable_find(PTable* table, size_t from, const char* pattern, PTableSearchMode mode, PTableMatch* out);
+
+/// Searches a snapshot taken up front, edits after this do not affect the
+/// running search (nor are they seen by it). The table may be released
+/// before the finishing call. Returns NULL when the pattern is invalid or
+/// nothing could be queued.
+PTableSearch* ptable_search_start(PTable* table, JobPool* pool, const char* pattern, PTableSearchMode mode,
+                                  ptable_search_results* on_results, void* user);
+void ptable_search_cancel(PTableSearch* search);
+
+#endif // PTABLE_SEARCH_H_